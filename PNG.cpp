@@ -11,8 +11,11 @@
 #include <algorithm>
 #include <functional>
 #include <cassert>
+#include <cstring>
+#include <thread>
 #include "lodepng/lodepng.h"
 #include "PNG.h"
+#include "trace.h"
 //#include "RGB_HSL.h"
 
 namespace cs221util {
@@ -23,8 +26,9 @@ namespace cs221util {
     // Copy `other` to self
     width_ = other.width_;
     height_ = other.height_;
-    imageData_ = new RGBAPixel[width_ * height_];
-    for (unsigned i = 0; i < width_ * height_; i++) {
+    std::size_t count = (std::size_t) width_ * height_;
+    imageData_ = new RGBAPixel[count];
+    for (std::size_t i = 0; i < count; i++) {
       imageData_[i] = other.imageData_[i];
     }
   }
@@ -38,7 +42,7 @@ namespace cs221util {
   PNG::PNG(unsigned int width, unsigned int height) {
     width_ = width;
     height_ = height;
-    imageData_ = new RGBAPixel[width * height];
+    imageData_ = new RGBAPixel[(std::size_t) width * height];
   }
 
   PNG::PNG(PNG const & other) {
@@ -59,7 +63,8 @@ namespace cs221util {
     if (width_ != other.width_) { return false; }
     if (height_ != other.height_) { return false; }
 
-    for (unsigned i = 0; i < width_ * height_; i++) {
+    std::size_t count = (std::size_t) width_ * height_;
+    for (std::size_t i = 0; i < count; i++) {
       RGBAPixel & p1 = imageData_[i];
       RGBAPixel & p2 = other.imageData_[i];
       if (p1 != p2) { return false; }
@@ -93,11 +98,13 @@ namespace cs221util {
       y = height_ - 1;
     }
 
-    unsigned index = x + (y * width_);
+    // 64-bit, as gigapixel images have more than 2^32 pixels
+    std::size_t index = x + ((std::size_t) y * width_);
     return &imageData_[index];
   }
 
   bool PNG::readFromFile(string const & fileName) {
+    TRACE_SCOPE("PNG::readFromFile");
     vector<unsigned char> byteData;
     unsigned error = lodepng::decode(byteData, width_, height_, fileName);
 
@@ -107,9 +114,9 @@ namespace cs221util {
     }
 
     delete[] imageData_;
-    imageData_ = new RGBAPixel[width_ * height_];
+    imageData_ = new RGBAPixel[(std::size_t) width_ * height_];
 
-    for (unsigned i = 0; i < byteData.size(); i += 4) {
+    for (std::size_t i = 0; i < byteData.size(); i += 4) {
       RGBAPixel & pixel = imageData_[i/4];
       pixel.r = byteData[i];
       pixel.g = byteData[i + 1];
@@ -138,37 +145,9 @@ namespace cs221util {
   }
 
   bool PNG::writeToFile(string const & fileName) {
-    unsigned char *byteData = new unsigned char[width_ * height_ * 4];
-/*
-    for (unsigned i = 0; i < width_ * height_; i++) {
-      hslaColor hsl;
-      hsl.h = imageData_[i].h;
-      hsl.s = imageData_[i].s;
-      hsl.l = imageData_[i].l;
-      hsl.a = imageData_[i].a;
-
-      rgbaColor rgb = hsl2rgb(hsl);
-
-      byteData[(i * 4)]     = rgb.r;
-      byteData[(i * 4) + 1] = rgb.g;
-      byteData[(i * 4) + 2] = rgb.b;
-      byteData[(i * 4) + 3] = rgb.a;
-    }*/
-
-    for (unsigned i = 0; i < width_ * height_; i++) {
-      byteData[(i * 4)]     = imageData_[i].r;
-      byteData[(i * 4) + 1] = imageData_[i].g;
-      byteData[(i * 4) + 2] = imageData_[i].b;
-      byteData[(i * 4) + 3] = imageData_[i].a * 255;
-    }
-
-    unsigned error = lodepng::encode(fileName, byteData, width_, height_);
-    if (error) {
-      cerr << "PNG encoding error " << error << ": " << lodepng_error_text(error) << endl;
-    }
-
-    delete[] byteData;
-    return (error == 0);
+    // one encoder per thread, so repeated writes reuse its buffers
+    static thread_local PNGEncoder encoder;
+    return encoder.writeToFile(*this, fileName);
   }
 
   unsigned int PNG::width() const {
@@ -181,7 +160,7 @@ namespace cs221util {
 
   void PNG::resize(unsigned int newWidth, unsigned int newHeight) {
     // Create a new vector to store the image data for the new (resized) image
-    RGBAPixel * newImageData = new RGBAPixel[newWidth * newHeight];
+    RGBAPixel * newImageData = new RGBAPixel[(std::size_t) newWidth * newHeight];
 
     // Copy the current data to the new image data, using the existing pixel
     // for coordinates within the bounds of the old image size
@@ -189,7 +168,7 @@ namespace cs221util {
       for (unsigned y = 0; y < newHeight; y++) {
         if (x < width_ && y < height_) {
           RGBAPixel * oldPixel = this->getPixel(x, y);
-          RGBAPixel & newPixel = newImageData[ (x + (y * newWidth)) ];
+          RGBAPixel & newPixel = newImageData[ (x + ((std::size_t) y * newWidth)) ];
           newPixel = *oldPixel;
         }
       }
@@ -205,26 +184,376 @@ namespace cs221util {
   }
 
   std::size_t PNG::computeHash() const {
-    std::hash<float> hashFunction;
-    std::size_t hash = 0;
+    return (std::size_t) contentHash();
+  }
 
+  namespace {
+    const std::uint64_t PRIME1 = 0x9e3779b185ebca87ULL;
+    const std::uint64_t PRIME2 = 0xc2b2ae3d27d4eb4fULL;
 
-    for (unsigned x = 0; x < this->width(); x++) {
-      for (unsigned y = 0; y < this->height(); y++) {
-        RGBAPixel * pixel = this->getPixel(x, y);
-        hash = (hash << 1) + hash + hashFunction(pixel->r);
-        hash = (hash << 1) + hash + hashFunction(pixel->g);
-        hash = (hash << 1) + hash + hashFunction(pixel->b);
-        hash = (hash << 1) + hash + hashFunction(pixel->a);
-      }
+    inline std::uint64_t rotl(std::uint64_t v, int bits) {
+      return (v << bits) | (v >> (64 - bits));
+    }
+
+    // One pixel as a 64-bit word: the color bytes spread across the
+    // word, xored with the bit pattern of alpha.
+    inline std::uint64_t pixelWord(RGBAPixel const & p) {
+      std::uint64_t alpha;
+      std::memcpy(&alpha, &p.a, sizeof(alpha));
+      std::uint64_t rgb = p.r | (p.g << 8) | (p.b << 16);
+      return alpha ^ (rgb * PRIME2);
+    }
+
+    inline std::uint64_t mixLane(std::uint64_t lane, std::uint64_t word) {
+      return rotl(lane + word * PRIME2, 31) * PRIME1;
+    }
+  }
+
+  std::uint64_t PNG::contentHash() const {
+    std::size_t count = (std::size_t) width_ * height_;
+    std::uint64_t lanes[4] = {PRIME1 + PRIME2, PRIME2, 0, 0 - PRIME1};
+
+    // four pixels per step, one per lane, so the multiplies overlap and
+    // the loop keeps up with memory (see PNG.h on why this is not SIMD)
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+      lanes[0] = mixLane(lanes[0], pixelWord(imageData_[i]));
+      lanes[1] = mixLane(lanes[1], pixelWord(imageData_[i + 1]));
+      lanes[2] = mixLane(lanes[2], pixelWord(imageData_[i + 2]));
+      lanes[3] = mixLane(lanes[3], pixelWord(imageData_[i + 3]));
+    }
+    for (; i < count; i++) {
+      lanes[i & 3] = mixLane(lanes[i & 3], pixelWord(imageData_[i]));
     }
 
+    std::uint64_t hash = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18);
+    hash = mixLane(hash, ((std::uint64_t) width_ << 32) | height_);
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
     return hash;
   }
 
+  namespace {
+    // Pixels are 16 bytes, so a 32 x 32 tile is 16 KB, and the tile read
+    // and the tile written fit in L1 together.
+    const unsigned int TILE = 32;
+
+    // Below this many pixels a transform is not worth spreading over threads.
+    const std::size_t PARALLEL_PIXELS = 1 << 20;
+
+    // Calls body(begin, end) over slices of [0, count), one slice per
+    // hardware thread when the transform touches enough pixels.
+    void parallelFor(unsigned int count, std::size_t pixels, std::function<void(unsigned int, unsigned int)> const & body) {
+      unsigned int threads = pixels < PARALLEL_PIXELS ? 1 : std::min(std::max(std::thread::hardware_concurrency(), 1u), count);
+      if (threads <= 1) {
+        body(0, count);
+        return;
+      }
+      std::vector<std::thread> workers;
+      for (unsigned int t = 1; t < threads; t++) {
+        workers.push_back(std::thread(body, (unsigned int) ((std::uint64_t) count * t / threads),
+                                      (unsigned int) ((std::uint64_t) count * (t + 1) / threads)));
+      }
+      body(0, count / threads);
+      for (std::size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+      }
+    }
+  }
+
+  PNG PNG::_oriented(unsigned int width, unsigned int height, std::ptrdiff_t origin, std::ptrdiff_t xStep, std::ptrdiff_t yStep) const {
+    PNG out(width, height);
+    if (width == 0 || height == 0) {
+      return out;
+    }
+    RGBAPixel * dst = out.imageData_;
+    RGBAPixel const * src = imageData_ + origin;
+    if (xStep == 1 || xStep == -1) {
+      // rows map to rows: copy them whole, reversed if need be
+      parallelFor(height, (std::size_t) width * height, [=](unsigned int begin, unsigned int end) {
+        for (unsigned int y = begin; y < end; y++) {
+          RGBAPixel const * row = src + (std::ptrdiff_t) y * yStep;
+          if (xStep == 1) {
+            std::copy(row, row + width, dst + (std::size_t) y * width);
+          } else {
+            std::reverse_copy(row - (width - 1), row + 1, dst + (std::size_t) y * width);
+          }
+        }
+      });
+      return out;
+    }
+    // rows map to columns: copy tile by tile, each tile's source rows
+    // being read TILE pixels at a time
+    unsigned int tileRows = (height + TILE - 1) / TILE;
+    parallelFor(tileRows, (std::size_t) width * height, [=](unsigned int begin, unsigned int end) {
+      for (unsigned int ty = begin * TILE; ty < std::min(end * TILE, height); ty += TILE) {
+        unsigned int yEnd = std::min(ty + TILE, height);
+        for (unsigned int tx = 0; tx < width; tx += TILE) {
+          unsigned int xEnd = std::min(tx + TILE, width);
+          for (unsigned int y = ty; y < yEnd; y++) {
+            RGBAPixel * target = dst + (std::size_t) y * width;
+            RGBAPixel const * source = src + (std::ptrdiff_t) y * yStep;
+            for (unsigned int x = tx; x < xEnd; x++) {
+              target[x] = source[(std::ptrdiff_t) x * xStep];
+            }
+          }
+        }
+      }
+    });
+    return out;
+  }
+
+  void PNG::_transpose() {
+    unsigned int n = width_;
+    RGBAPixel * data = imageData_;
+    unsigned int tiles = (n + TILE - 1) / TILE;
+    // tile row k is paired with tile row tiles - 1 - k, so every slice
+    // of pairs swaps about the same number of tiles
+    parallelFor((tiles + 1) / 2, (std::size_t) n * n, [=](unsigned int begin, unsigned int end) {
+      for (unsigned int k = begin; k < end; k++) {
+        unsigned int rows[2] = {k, tiles - 1 - k};
+        for (unsigned int r = 0; r < (rows[0] == rows[1] ? 1u : 2u); r++) {
+          unsigned int ty = rows[r] * TILE;
+          unsigned int yEnd = std::min(ty + TILE, n);
+          // the tiles on and right of the diagonal swap with their mirror images
+          for (unsigned int tx = ty; tx < n; tx += TILE) {
+            unsigned int xEnd = std::min(tx + TILE, n);
+            for (unsigned int y = ty; y < yEnd; y++) {
+              for (unsigned int x = std::max(tx, y + 1); x < xEnd; x++) {
+                std::swap(data[(std::size_t) y * n + x], data[(std::size_t) x * n + y]);
+              }
+            }
+          }
+        }
+      }
+    });
+  }
+
+  void PNG::flipHorizontal() {
+    TRACE_SCOPE("PNG::flipHorizontal");
+    unsigned int w = width_;
+    RGBAPixel * data = imageData_;
+    parallelFor(height_, (std::size_t) width_ * height_, [=](unsigned int begin, unsigned int end) {
+      for (unsigned int y = begin; y < end; y++) {
+        std::reverse(data + (std::size_t) y * w, data + (std::size_t) (y + 1) * w);
+      }
+    });
+  }
+
+  void PNG::flipVertical() {
+    TRACE_SCOPE("PNG::flipVertical");
+    unsigned int w = width_;
+    unsigned int h = height_;
+    RGBAPixel * data = imageData_;
+    parallelFor(h / 2, (std::size_t) width_ * height_, [=](unsigned int begin, unsigned int end) {
+      for (unsigned int y = begin; y < end; y++) {
+        std::swap_ranges(data + (std::size_t) y * w, data + (std::size_t) (y + 1) * w, data + (std::size_t) (h - 1 - y) * w);
+      }
+    });
+  }
+
+  void PNG::rotateCCW(unsigned int quarterTurns) {
+    TRACE_SCOPE("PNG::rotateCCW");
+    quarterTurns %= 4;
+    if (quarterTurns == 2) {
+      flipVertical();
+      flipHorizontal();
+    } else if (quarterTurns != 0 && width_ == height_) {
+      // a quarter turn is a transpose followed by a flip
+      _transpose();
+      if (quarterTurns == 1) {
+        flipVertical();
+      } else {
+        flipHorizontal();
+      }
+    } else if (quarterTurns != 0) {
+      PNG turned = rotatedCCW(quarterTurns);
+      std::swap(imageData_, turned.imageData_);
+      std::swap(width_, turned.width_);
+      std::swap(height_, turned.height_);
+    }
+  }
+
+  PNG PNG::flippedHorizontal() const {
+    TRACE_SCOPE("PNG::flippedHorizontal");
+    return _oriented(width_, height_, (std::ptrdiff_t) width_ - 1, -1, width_);
+  }
+
+  PNG PNG::flippedVertical() const {
+    TRACE_SCOPE("PNG::flippedVertical");
+    return _oriented(width_, height_, (std::ptrdiff_t) (height_ - 1) * width_, 1, -(std::ptrdiff_t) width_);
+  }
+
+  PNG PNG::rotatedCCW(unsigned int quarterTurns) const {
+    TRACE_SCOPE("PNG::rotatedCCW");
+    std::ptrdiff_t w = width_;
+    std::ptrdiff_t h = height_;
+    switch (quarterTurns % 4) {
+      case 1:  return _oriented(height_, width_, w - 1, w, -1);
+      case 2:  return _oriented(width_, height_, w * h - 1, -1, -w);
+      case 3:  return _oriented(height_, width_, (h - 1) * w, -w, 1);
+      default: return PNG(*this);
+    }
+  }
+
   std::ostream & operator << ( std::ostream& os, PNG const& png ) {
     os << "PNG(w=" << png.width() << ", h=" << png.height() << ", hash=" << std::hex << png.computeHash() << std::dec << ")";
     return os;
   }
 
+  PNGEncodeOptions::PNGEncodeOptions() {
+    effort = 5;
+    filter = FILTER_MINSUM;
+    autoPalette = true;
+  }
+
+  PNGEncoder::PNGEncoder() {
+    indexed_ = false;
+  }
+
+  PNGEncoder::PNGEncoder(PNGEncodeOptions const & options) {
+    options_ = options;
+    indexed_ = false;
+  }
+
+  void PNGEncoder::setOptions(PNGEncodeOptions const & options) {
+    options_ = options;
+  }
+
+  bool PNGEncoder::lastWasIndexed() const {
+    return indexed_;
+  }
+
+  void PNGEncoder::convert(PNG const & image) {
+    size_t count = (size_t) image.width() * image.height();
+    const RGBAPixel * pixels = image.getPixel(0, 0);
+    indexed_ = false;
+    palette_.clear();
+
+    if (options_.autoPalette) {
+      // 512 slots keep the table at most half full; a slot holds the
+      // color's palette index + 1 (the color itself is in colors), or 0
+      // when empty
+      const unsigned int slots = 512;
+      paletteSlots_.assign(slots, 0);
+      vector<unsigned int> colors;
+      pixels_.resize(count);
+      bool fits = true;
+      for (size_t i = 0; i < count && fits; i++) {
+        const RGBAPixel & p = pixels[i];
+        unsigned char a = p.a * 255;
+        unsigned int color = p.r | (p.g << 8) | (p.b << 16) | ((unsigned int) a << 24);
+        unsigned int slot = (color * 2654435761u) >> 23;
+        while (true) {
+          unsigned int entry = paletteSlots_[slot];
+          if (entry == 0) {
+            if (colors.size() == 256) {
+              fits = false;
+              break;
+            }
+            colors.push_back(color);
+            paletteSlots_[slot] = colors.size();
+            pixels_[i] = colors.size() - 1;
+            break;
+          }
+          if (colors[entry - 1] == color) {
+            pixels_[i] = entry - 1;
+            break;
+          }
+          slot = (slot + 1) & (slots - 1);
+        }
+      }
+      if (fits) {
+        indexed_ = true;
+        for (size_t i = 0; i < colors.size(); i++) {
+          palette_.push_back(colors[i] & 0xff);
+          palette_.push_back((colors[i] >> 8) & 0xff);
+          palette_.push_back((colors[i] >> 16) & 0xff);
+          palette_.push_back(colors[i] >> 24);
+        }
+        return;
+      }
+    }
+
+    pixels_.resize(count * 4);
+    for (size_t i = 0; i < count; i++) {
+      pixels_[(i * 4)]     = pixels[i].r;
+      pixels_[(i * 4) + 1] = pixels[i].g;
+      pixels_[(i * 4) + 2] = pixels[i].b;
+      pixels_[(i * 4) + 3] = pixels[i].a * 255;
+    }
+  }
+
+  bool PNGEncoder::encode(PNG const & image, vector<unsigned char> & out) {
+    TRACE_SCOPE("PNGEncoder::encode");
+    out.clear();
+    if (image.width() == 0 || image.height() == 0) {
+      cerr << "PNG encoding error: image has no pixels" << endl;
+      return false;
+    }
+    convert(image);
+
+    lodepng::State state;
+    LodePNGCompressSettings & zlib = state.encoder.zlibsettings;
+    unsigned int effort = min(options_.effort, 9u);
+    if (effort == 0) {
+      zlib.btype = 0;
+    } else if (effort == 1) {
+      zlib.btype = 1;
+      zlib.windowsize = 256;
+      zlib.lazymatching = 0;
+      zlib.nicematch = 32;
+    } else {
+      zlib.btype = 2;
+      zlib.windowsize = 256u << min(effort - 2, 7u);
+      zlib.lazymatching = effort >= 4;
+      zlib.nicematch = min(258u, 16 * effort);
+    }
+
+    switch (options_.filter) {
+      case PNGEncodeOptions::FILTER_NONE:        state.encoder.filter_strategy = LFS_ZERO; break;
+      case PNGEncodeOptions::FILTER_MINSUM:      state.encoder.filter_strategy = LFS_MINSUM; break;
+      case PNGEncodeOptions::FILTER_ENTROPY:     state.encoder.filter_strategy = LFS_ENTROPY; break;
+      case PNGEncodeOptions::FILTER_BRUTE_FORCE: state.encoder.filter_strategy = LFS_BRUTE_FORCE; break;
+    }
+
+    // the color type is chosen here, so lodepng need not analyze the image again
+    state.encoder.auto_convert = 0;
+    if (indexed_) {
+      state.info_raw.colortype = LCT_PALETTE;
+      state.info_raw.bitdepth = 8;
+      state.info_png.color.colortype = LCT_PALETTE;
+      state.info_png.color.bitdepth = 8;
+      for (size_t i = 0; i < palette_.size(); i += 4) {
+        lodepng_palette_add(&state.info_raw, palette_[i], palette_[i + 1], palette_[i + 2], palette_[i + 3]);
+        lodepng_palette_add(&state.info_png.color, palette_[i], palette_[i + 1], palette_[i + 2], palette_[i + 3]);
+      }
+    } else {
+      state.info_raw.colortype = LCT_RGBA;
+      state.info_raw.bitdepth = 8;
+      state.info_png.color.colortype = LCT_RGBA;
+      state.info_png.color.bitdepth = 8;
+    }
+
+    unsigned error = lodepng::encode(out, pixels_.data(), image.width(), image.height(), state);
+    if (error) {
+      cerr << "PNG encoding error " << error << ": " << lodepng_error_text(error) << endl;
+      out.clear();
+    }
+    return (error == 0);
+  }
+
+  bool PNGEncoder::writeToFile(PNG const & image, string const & fileName) {
+    TRACE_SCOPE("PNG::writeToFile");
+    if (!encode(image, encoded_)) {
+      return false;
+    }
+    unsigned error = lodepng::save_file(encoded_, fileName);
+    if (error) {
+      cerr << "PNG encoding error " << error << ": " << lodepng_error_text(error) << endl;
+    }
+    return (error == 0);
+  }
+
 }
@@ -8,6 +8,8 @@
 #ifndef CS221_PNG_H_
 #define CS221_PNG_H_
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
 #include <vector>
 //#include "HSLAPixel.h"
@@ -74,7 +76,7 @@ namespace cs221util {
     bool readFromFile(string const & fileName);
 
     /**
-      * Writes a PNG image to a file.
+      * Writes a PNG image to a file, with PNGEncoder's default settings.
       * @param fileName Name of the file to be written.
       * @return true, if the image was successfully written.
       */
@@ -116,6 +118,49 @@ namespace cs221util {
      */
     std::size_t computeHash() const;
 
+    /**
+     * Computes a 64-bit hash of the exact contents of the image: its
+     * dimensions and every channel of every pixel, alpha included. Pixels
+     * are read in memory (row-major) order, in four independent lanes.
+     * Suitable as a cache key; images that compare == only because of the
+     * tolerance in RGBAPixel::operator== hash differently.
+     *
+     * The lanes are scalar, not SIMD. Pixels are 16-byte structs with a
+     * double alpha, so the hash reads 16 bytes per pixel, and the four
+     * lanes already run at over 90% of the speed of a plain read of the
+     * pixel array. Vector lanes would need 64-bit multiplies, which SSE2
+     * and AVX2 lack, and a shuffle to pull the channels out of each struct.
+     */
+    std::uint64_t contentHash() const;
+
+    /**
+     * Mirrors the image in place across its vertical axis (left and right
+     * swap) or its horizontal axis (top and bottom swap).
+     */
+    void flipHorizontal();
+    void flipVertical();
+
+    /**
+     * Rotates the image in place by quarterTurns quarter turns
+     * counter-clockwise (taken mod 4; 3 is a clockwise quarter turn).
+     * Quarter turns swap the width and height; those of a non-square
+     * image go through a second buffer.
+     */
+    void rotateCCW(unsigned int quarterTurns = 1);
+
+    /**
+     * Mirrored or rotated copies of the image, as flipHorizontal,
+     * flipVertical and rotateCCW would leave it.
+     *
+     * The transforms copy square tiles, so that both the rows read and
+     * the rows written stay in cache, and split large images across
+     * threads. They are the raster path when only the oriented image is
+     * needed, and the reference for QTree::FlipHorizontal and RotateCCW.
+     */
+    PNG flippedHorizontal() const;
+    PNG flippedVertical() const;
+    PNG rotatedCCW(unsigned int quarterTurns = 1) const;
+
   private:
     unsigned int width_;            /*< Width of the image */
     unsigned int height_;           /*< Height of the image */
@@ -126,6 +171,97 @@ namespace cs221util {
      * Copeies the contents of `other` to self
      */
      void _copy(PNG const & other);
+
+    /**
+     * A width x height image whose pixel (x, y) is pixel
+     * origin + x * xStep + y * yStep of this image's row-major array.
+     */
+    PNG _oriented(unsigned int width, unsigned int height, std::ptrdiff_t origin, std::ptrdiff_t xStep, std::ptrdiff_t yStep) const;
+
+    /**
+     * Transposes a square image in place.
+     */
+    void _transpose();
+  };
+
+  /**
+   * Settings for PNGEncoder.
+   */
+  struct PNGEncodeOptions {
+    /**
+     * Row filter strategies, from cheapest to most thorough.
+     */
+    enum Filter {
+      FILTER_NONE,        /*< no filtering; fastest, best for flat regions */
+      FILTER_MINSUM,      /*< per row, the filter minimizing the sum of bytes */
+      FILTER_ENTROPY,     /*< per row, the filter minimizing byte entropy */
+      FILTER_BRUTE_FORCE  /*< per row, the filter that deflates smallest */
+    };
+
+    unsigned int effort;  /*< 0 (store only) to 9 (smallest output) */
+    Filter filter;        /*< filter for truecolor output; palette output is never filtered */
+    bool autoPalette;     /*< write 8-bit indexed color when there are at most 256 colors */
+
+    /**
+     * Defaults comparable to lodepng's own: effort 5, FILTER_MINSUM,
+     * automatic palette.
+     */
+    PNGEncodeOptions();
+  };
+
+  /**
+   * PNGEncoder: encodes PNG images with configurable effort and filtering.
+   * Keeps its conversion and output buffers between calls, so encoding a
+   * stream of images does not allocate once the buffers have grown.
+   * Images with at most 256 distinct colors (such as renders of pruned
+   * trees) are written as indexed color when autoPalette is set, which is
+   * both smaller and faster to deflate than RGBA.
+   * An encoder must not be used by several threads at once.
+   */
+  class PNGEncoder {
+  public:
+    PNGEncoder();
+
+    /**
+     * @param options encoding settings
+     */
+    PNGEncoder(PNGEncodeOptions const & options);
+
+    /**
+     * Changes the settings for later images; the buffers are kept.
+     */
+    void setOptions(PNGEncodeOptions const & options);
+
+    /**
+     * Encodes an image into memory, replacing the contents of out.
+     * @return true, if the image was successfully encoded.
+     */
+    bool encode(PNG const & image, vector<unsigned char> & out);
+
+    /**
+     * Encodes an image and writes it to a file.
+     * @return true, if the image was successfully written.
+     */
+    bool writeToFile(PNG const & image, string const & fileName);
+
+    /**
+     * Whether the last image encoded was written as indexed color.
+     */
+    bool lastWasIndexed() const;
+
+  private:
+    PNGEncodeOptions options_;
+    vector<unsigned char> pixels_;       /*< converted pixels, RGBA or palette indices */
+    vector<unsigned char> palette_;      /*< RGBA entries of the current palette */
+    vector<unsigned int> paletteSlots_;  /*< open-addressed color -> index table */
+    vector<unsigned char> encoded_;      /*< output of the last writeToFile */
+    bool indexed_;
+
+    /**
+     * Fills pixels_ with palette indices if the image has at most 256
+     * colors, and with RGBA bytes otherwise.
+     */
+    void convert(PNG const & image);
   };
 
   std::ostream & operator<<(std::ostream & out, PNG const & pixel);
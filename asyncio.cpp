@@ -0,0 +1,159 @@
+/**
+ * @file asyncio.cpp
+ * @description background reading and writing of PNG files, so that
+ *              decoding the next input and encoding the last output
+ *              overlap with building and pruning the current tree
+ */
+
+#include <chrono>
+#include "asyncio.h"
+#include "trace.h"
+
+ImagePrefetcher::ImagePrefetcher(const vector<string>& files, unsigned int depth, ThreadPool& pool, Callback done)
+	: files(files), depth(max(depth, 1u)), pool(pool), done(done)
+{
+	issued = 0;
+	while (issued < files.size() && ahead.size() < this->depth)
+	{
+		Issue();
+	}
+}
+
+ImagePrefetcher::~ImagePrefetcher()
+{
+	for (size_t i = 0; i < ahead.size(); i++)
+	{
+		// help with queued tasks rather than block a pool thread on them
+		while (ahead[i].wait_for(chrono::seconds(0)) != future_status::ready)
+		{
+			if (!pool.RunPending())
+			{
+				ahead[i].wait_for(chrono::milliseconds(1));
+			}
+		}
+	}
+}
+
+bool ImagePrefetcher::HasNext() const
+{
+	return !ahead.empty();
+}
+
+future<shared_ptr<PNG> > ImagePrefetcher::Next()
+{
+	future<shared_ptr<PNG> > next = move(ahead.front());
+	ahead.pop_front();
+	if (issued < files.size())
+	{
+		Issue();
+	}
+	return next;
+}
+
+void ImagePrefetcher::Issue()
+{
+	size_t index = issued++;
+	string fileName = files[index];
+	Callback callback = done;
+	ahead.push_back(pool.Submit([index, fileName, callback]() {
+		TraceImage tag(index);
+		shared_ptr<PNG> image = make_shared<PNG>();
+		if (!image->readFromFile(fileName))
+		{
+			image.reset();
+		}
+		if (callback)
+		{
+			callback(index, image);
+		}
+		return image;
+	}));
+}
+
+ImageWriter::ImageWriter(unsigned int maxInFlight, const PNGEncodeOptions& options, ThreadPool& pool, Callback done)
+	: maxInFlight(max(maxInFlight, 1u)), options(options), pool(pool), done(done), inFlight(0), failures(0)
+{
+}
+
+ImageWriter::~ImageWriter()
+{
+	Wait();
+}
+
+future<bool> ImageWriter::Write(shared_ptr<const PNG> image, const string& fileName)
+{
+	WaitBelow(maxInFlight);
+	inFlight++;
+	long long traceImage = Tracer::Image();
+	return pool.Submit([this, image, fileName, traceImage]() {
+		// releases the slot however the task ends, so Wait cannot hang
+		struct Release
+		{
+			ImageWriter& writer;
+			~Release()
+			{
+				// notify under the lock so a waiter cannot miss the completion
+				lock_guard<mutex> guard(writer.lock);
+				writer.inFlight--;
+				writer.finished.notify_all();
+			}
+		} release = {*this};
+		TraceImage tag(traceImage);
+		bool ok;
+		try
+		{
+			PNGEncoder& encoder = ThreadEncoder();
+			encoder.setOptions(options);
+			ok = encoder.writeToFile(*image, fileName);
+		}
+		catch (...)
+		{
+			ok = false;
+		}
+		if (!ok)
+		{
+			failures++;
+		}
+		if (done)
+		{
+			done(fileName, ok);
+		}
+		return ok;
+	});
+}
+
+void ImageWriter::Wait()
+{
+	WaitBelow(1);
+	// the last write may still hold the lock while notifying
+	lock_guard<mutex> guard(lock);
+}
+
+unsigned int ImageWriter::InFlight() const
+{
+	return inFlight;
+}
+
+unsigned int ImageWriter::Failures() const
+{
+	return failures;
+}
+
+PNGEncoder& ImageWriter::ThreadEncoder()
+{
+	// one per thread rather than per write, so its buffers are reused
+	thread_local PNGEncoder encoder;
+	return encoder;
+}
+
+void ImageWriter::WaitBelow(unsigned int limit)
+{
+	while (inFlight >= limit)
+	{
+		if (!pool.RunPending())
+		{
+			unique_lock<mutex> guard(lock);
+			finished.wait_for(guard, chrono::milliseconds(1), [this, limit]() { return inFlight < limit; });
+		}
+	}
+}
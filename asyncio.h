@@ -0,0 +1,157 @@
+/**
+ * @file asyncio.h
+ * @description background reading and writing of PNG files, so that
+ *              decoding the next input and encoding the last output
+ *              overlap with building and pruning the current tree
+ */
+
+#ifndef _ASYNCIO_H_
+#define _ASYNCIO_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "cs221util/PNG.h"
+#include "threadpool.h"
+
+using namespace std;
+using namespace cs221util;
+
+/**
+ * ImagePrefetcher: reads and decodes a list of PNG files in order, on a
+ * ThreadPool, staying at most depth files ahead of the consumer. Only
+ * the images read ahead (and those the consumer still holds) are in
+ * memory at once.
+ *
+ * Each read completes a future and, if given, calls a callback on the
+ * thread that did the read, so completion can drive either a blocking
+ * loop or another scheduler. A read's trace spans (see trace.h) carry the
+ * file's position in the list as their image ID.
+ */
+class ImagePrefetcher {
+public:
+    /**
+     * Called with the file's position in the list and its image (null
+     * if it could not be read).
+     */
+    typedef function<void(size_t index, shared_ptr<PNG> image)> Callback;
+
+    /**
+     * Starts reading the first depth files.
+     *
+     * @param depth number of files read ahead; at least 1
+     */
+    ImagePrefetcher(const vector<string>& files, unsigned int depth, ThreadPool& pool = ThreadPool::Shared(),
+                    Callback done = Callback());
+
+    /**
+     * Waits for any reads still running.
+     */
+    ~ImagePrefetcher();
+
+    /**
+     * Whether there are files not yet handed out by Next.
+     */
+    bool HasNext() const;
+
+    /**
+     * Hands out the next file's image, in list order, and starts reading
+     * the file depth places further on.
+     *
+     * @pre HasNext()
+     * @return future of the image, null if the file could not be read
+     */
+    future<shared_ptr<PNG> > Next();
+
+private:
+    vector<string> files;
+    unsigned int depth;
+    ThreadPool& pool;
+    Callback done;
+    deque<future<shared_ptr<PNG> > > ahead; // reads started, in list order
+    size_t issued;                          // files whose read has started
+
+    void Issue();
+
+    ImagePrefetcher(const ImagePrefetcher& other);
+    ImagePrefetcher& operator=(const ImagePrefetcher& other);
+};
+
+/**
+ * ImageWriter: encodes and writes PNG files on a ThreadPool, with at most
+ * maxInFlight writes queued or running; Write waits for a slot (running
+ * queued pool tasks meanwhile) rather than letting rendered images pile up.
+ * A write's trace spans carry the image ID of the thread that called Write.
+ * Each thread that writes keeps one PNGEncoder, so its buffers are reused
+ * from one image to the next. A write whose encoder throws counts as failed.
+ */
+class ImageWriter {
+public:
+    /**
+     * Called on the writing thread with the file name and whether the
+     * write succeeded.
+     */
+    typedef function<void(const string& fileName, bool ok)> Callback;
+
+    /**
+     * @param maxInFlight most writes outstanding at once; at least 1
+     * @param options encoder settings for every file
+     */
+    ImageWriter(unsigned int maxInFlight, const PNGEncodeOptions& options = PNGEncodeOptions(),
+                ThreadPool& pool = ThreadPool::Shared(), Callback done = Callback());
+
+    /**
+     * Waits for every write.
+     */
+    ~ImageWriter();
+
+    /**
+     * Queues a write of image, which must not be modified until the
+     * write completes (it is shared rather than copied).
+     *
+     * @return future of whether the file was written
+     */
+    future<bool> Write(shared_ptr<const PNG> image, const string& fileName);
+
+    /**
+     * Blocks until every queued write has completed.
+     */
+    void Wait();
+
+    /**
+     * Writes queued or running.
+     */
+    unsigned int InFlight() const;
+
+    /**
+     * Writes that have failed so far.
+     */
+    unsigned int Failures() const;
+
+private:
+    unsigned int maxInFlight;
+    PNGEncodeOptions options;
+    ThreadPool& pool;
+    Callback done;
+    atomic<unsigned int> inFlight;
+    atomic<unsigned int> failures;
+    mutex lock;
+    condition_variable finished;
+
+    // Encoder of the calling thread, shared by every writer on it.
+    static PNGEncoder& ThreadEncoder();
+
+    // Waits, running queued pool tasks, until fewer than limit writes are in flight.
+    void WaitBelow(unsigned int limit);
+
+    ImageWriter(const ImageWriter& other);
+    ImageWriter& operator=(const ImageWriter& other);
+};
+
+#endif
@@ -0,0 +1,107 @@
+/**
+ * @file batch.cpp
+ * @description compression of many small images (thumbnails, icons,
+ *              sprite sheet cells) in one call
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include "batch.h"
+#include "trace.h"
+
+BatchOptions::BatchOptions()
+{
+	tolerance = 0.05;
+	gradient = false;
+	paletteSize = 0;
+}
+
+BatchResult CompressBatch(const vector<RawImage>& images, const BatchOptions& options, ThreadPool& pool)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	// a few runs per worker keeps the threads busy without splitting the
+	// batch so finely that per-task overhead shows
+	size_t runs = min(images.size(), (size_t)4 * pool.Size());
+	vector<vector<unsigned char> > outputs(runs);
+	vector<size_t> lengths(images.size());
+	vector<size_t> nodes(runs, 0);
+	TaskGroup group(pool);
+	for (size_t r = 0; r < runs; r++)
+	{
+		size_t begin = images.size() * r / runs, end = images.size() * (r + 1) / runs;
+		group.Run([&images, &options, &outputs, &lengths, &nodes, r, begin, end]() {
+			vector<unsigned char>& out = outputs[r];
+			for (size_t i = begin; i < end; i++)
+			{
+				TraceImage tag(i);
+				QTree tree(images[i], options.build);
+				if (options.tolerance >= 0 && options.gradient)
+				{
+					tree.PruneGradient(options.tolerance);
+				}
+				else if (options.tolerance >= 0)
+				{
+					tree.Prune(options.tolerance);
+				}
+				if (options.paletteSize > 0)
+				{
+					tree.Quantize(options.paletteSize);
+				}
+				size_t before = out.size();
+				tree.EncodeProgressive(out);
+				lengths[i] = out.size() - before;
+				nodes[r] += tree.CountNodes();
+			}
+		});
+	}
+	group.Wait();
+
+	BatchResult result;
+	result.offsets.reserve(images.size() + 1);
+	result.offsets.push_back(0);
+	for (size_t i = 0; i < images.size(); i++)
+	{
+		result.offsets.push_back(result.offsets.back() + lengths[i]);
+	}
+	result.data.resize(result.offsets.back());
+	size_t at = 0;
+	result.stats.nodes = 0;
+	for (size_t r = 0; r < runs; r++)
+	{
+		if (!outputs[r].empty())
+		{
+			memcpy(&result.data[at], outputs[r].data(), outputs[r].size());
+		}
+		at += outputs[r].size();
+		result.stats.nodes += nodes[r];
+	}
+
+	result.stats.images = images.size();
+	result.stats.bytes = result.data.size();
+	result.stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	result.stats.imagesPerSecond = result.stats.seconds > 0 ? images.size() / result.stats.seconds : 0;
+	return result;
+}
+
+vector<RawImage> SpriteCells(const RawImage& sheet, unsigned int cellWidth, unsigned int cellHeight)
+{
+	vector<RawImage> cells;
+	if (cellWidth == 0 || cellHeight == 0)
+	{
+		return cells;
+	}
+	for (unsigned int y = 0; y + cellHeight <= sheet.height; y += cellHeight)
+	{
+		for (unsigned int x = 0; x + cellWidth <= sheet.width; x += cellWidth)
+		{
+			RawImage cell = sheet;
+			cell.data = sheet.data + y * sheet.stride + (size_t)x * sheet.channels;
+			cell.width = cellWidth;
+			cell.height = cellHeight;
+			cells.push_back(cell);
+		}
+	}
+	return cells;
+}
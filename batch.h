@@ -0,0 +1,67 @@
+/**
+ * @file batch.h
+ * @description compression of many small images (thumbnails, icons,
+ *              sprite sheet cells) in one call
+ */
+
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include <vector>
+#include "qtree.h"
+#include "rawimage.h"
+#include "threadpool.h"
+
+/**
+ * What CompressBatch does to each image.
+ */
+struct BatchOptions {
+    BuildOptions build;
+    double tolerance;         // Prune tolerance; negative leaves the trees unpruned
+    bool gradient;            // prune with PruneGradient instead of Prune
+    unsigned int paletteSize; // Quantize to this many entries after pruning; 0 skips it
+
+    BatchOptions(); // prunes at tolerance 0.05, no gradients, no palette
+};
+
+/**
+ * Totals of a CompressBatch call.
+ */
+struct BatchStats {
+    size_t images;
+    size_t nodes;           // nodes of all pruned trees together
+    size_t bytes;           // size of all encodings together
+    double seconds;         // wall-clock time of the call
+    double imagesPerSecond;
+};
+
+/**
+ * The encodings of a batch, back to back in one buffer: image i's
+ * EncodeProgressive stream is data[offsets[i]] .. data[offsets[i + 1] - 1].
+ */
+struct BatchResult {
+    vector<unsigned char> data;
+    vector<size_t> offsets; // one more entry than there are images
+    BatchStats stats;
+};
+
+/**
+ * Builds, prunes and encodes every image. Images are read straight from
+ * the views (no PNG copies), handed to the pool in contiguous runs, and
+ * each run reuses one output buffer and its thread's node free list (see
+ * nodepool.h) from one image to the next, so per-image allocation is
+ * limited to what the encodings themselves need. Each image's trace
+ * spans (see trace.h) carry its index in images as their image ID.
+ *
+ * @param images views of the images; only read during the call
+ * @return the encodings, in the order of images, and their totals
+ */
+BatchResult CompressBatch(const vector<RawImage>& images, const BatchOptions& options, ThreadPool& pool = ThreadPool::Shared());
+
+/**
+ * Views of the cells of a sprite sheet: cellWidth x cellHeight tiles in
+ * row-major order. Partial cells at the right and bottom edges are left out.
+ */
+vector<RawImage> SpriteCells(const RawImage& sheet, unsigned int cellWidth, unsigned int cellHeight);
+
+#endif
@@ -0,0 +1,220 @@
+/**
+ * @file budgetprune.cpp
+ * @description rate-distortion pruning of a QTree to a node or error budget
+ *
+ * Every node keeps area-weighted first and second moments of the colors of
+ * the leaves below it, so the squared error of replacing a subtree by its
+ * root's average is S2 - 2 avg S1 + A avg^2 per channel, in O(1). Only
+ * nodes whose children are all (current) leaves can be collapsed; they sit
+ * in a heap keyed by added error per node removed, and collapsing one may
+ * make its parent a candidate.
+ */
+
+#include <queue>
+#include <vector>
+#include "qtree.h"
+#include "qtree-traversal.h"
+#include "spill.h"
+#include "trace.h"
+
+namespace
+{
+	struct Entry
+	{
+		Node* node;
+		ptrdiff_t parent;      // index of the parent entry; -1 at the root
+		unsigned int children;
+		unsigned int interiorChildren; // children that are not leaves yet
+		double area;
+		double s1[4];          // sum of area * channel over the original leaves
+		double s2[4];          // sum of area * channel^2
+		double error;          // squared error of this node as a leaf
+	};
+
+	inline void Channels(const RGBAPixel& p, double c[4])
+	{
+		c[0] = p.r;
+		c[1] = p.g;
+		c[2] = p.b;
+		c[3] = p.a * 255;
+	}
+
+	// Appends entries for the subtree in post-order; returns nd's index.
+	ptrdiff_t Summarize(Node* nd, ptrdiff_t parent, vector<Entry>& entries)
+	{
+		ptrdiff_t self = entries.size();
+		Entry entry;
+		entry.node = nd;
+		entry.parent = parent;
+		entry.children = 0;
+		entry.interiorChildren = 0;
+		entry.error = 0;
+		entries.push_back(entry);
+
+		double c[4];
+		Channels(nd->avg, c);
+		Node* children[4] = {nd->NW, nd->NE, nd->SW, nd->SE};
+		double area = 0, s1[4] = {0, 0, 0, 0}, s2[4] = {0, 0, 0, 0};
+		for (int i = 0; i < 4; i++)
+		{
+			if (children[i] == NULL)
+			{
+				continue;
+			}
+			ptrdiff_t child = Summarize(children[i], self, entries);
+			const Entry& ce = entries[child];
+			area += ce.area;
+			for (int k = 0; k < 4; k++)
+			{
+				s1[k] += ce.s1[k];
+				s2[k] += ce.s2[k];
+			}
+			entries[self].children++;
+			if (ce.children > 0)
+			{
+				entries[self].interiorChildren++;
+			}
+		}
+
+		Entry& e = entries[self];
+		if (e.children == 0)
+		{
+			e.area = (double)(nd->lowRight.first - nd->upLeft.first + 1) * (nd->lowRight.second - nd->upLeft.second + 1);
+			if (nd->block != NULL)
+			{
+				// a block leaf renders its pixels, so they are what it summarizes
+				for (int k = 0; k < 4; k++)
+				{
+					e.s1[k] = 0;
+					e.s2[k] = 0;
+				}
+				const unsigned char* end = nd->block + BlockBytes(nd);
+				for (const unsigned char* p = nd->block; p != end; p += 4)
+				{
+					double v[4];
+					Channels(BlockPixel(p), v);
+					for (int k = 0; k < 4; k++)
+					{
+						e.s1[k] += v[k];
+						e.s2[k] += v[k] * v[k];
+					}
+				}
+				return self;
+			}
+			if (nd->gradient != NULL)
+			{
+				// likewise for the colors of a gradient leaf
+				for (int k = 0; k < 4; k++)
+				{
+					e.s1[k] = 0;
+					e.s2[k] = 0;
+				}
+				for (unsigned int y = 0; y <= nd->lowRight.second - nd->upLeft.second; y++)
+				{
+					for (unsigned int x = 0; x <= nd->lowRight.first - nd->upLeft.first; x++)
+					{
+						double v[4];
+						Channels(GradientPixel(nd->gradient, x, y), v);
+						for (int k = 0; k < 4; k++)
+						{
+							e.s1[k] += v[k];
+							e.s2[k] += v[k] * v[k];
+						}
+					}
+				}
+				return self;
+			}
+			for (int k = 0; k < 4; k++)
+			{
+				e.s1[k] = e.area * c[k];
+				e.s2[k] = e.area * c[k] * c[k];
+			}
+			return self;
+		}
+		e.area = area;
+		for (int k = 0; k < 4; k++)
+		{
+			e.s1[k] = s1[k];
+			e.s2[k] = s2[k];
+			e.error += s2[k] - 2 * c[k] * s1[k] + area * c[k] * c[k];
+		}
+		e.error = max(e.error, 0.0);
+		return self;
+	}
+
+	// Error added per node removed by collapsing entry i, whose children
+	// are all leaves. Leaves carry their own error (0 unless collapsed).
+	double Cost(const vector<Entry>& entries, size_t i, const vector<double>& leafError)
+	{
+		return (entries[i].error - leafError[i]) / entries[i].children;
+	}
+}
+
+PruneStats QTree::PruneToBudget(size_t maxNodes, double maxError)
+{
+	TRACE_SCOPE("QTree::PruneToBudget");
+	SpillGuard guard(*this);
+	Unshare();
+
+	vector<Entry> entries;
+	if (root != NULL)
+	{
+		entries.reserve(CountNodes());
+		Summarize(root, -1, entries);
+	}
+
+	// leafError[i]: error of the leaves currently under entry i
+	vector<double> leafError(entries.size(), 0.0);
+	typedef pair<double, size_t> Candidate;
+	priority_queue<Candidate, vector<Candidate>, greater<Candidate> > heap;
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		if (entries[i].children > 0 && entries[i].interiorChildren == 0)
+		{
+			heap.push(Candidate(Cost(entries, i, leafError), i));
+		}
+	}
+
+	PruneStats stats;
+	stats.nodes = entries.size();
+	stats.squaredError = 0;
+	while (!heap.empty() && (maxNodes == 0 || stats.nodes > maxNodes))
+	{
+		size_t i = heap.top().second;
+		heap.pop();
+		Entry& e = entries[i];
+		double added = e.error - leafError[i];
+		if (stats.squaredError + added > maxError)
+		{
+			break;
+		}
+
+		Node* nd = e.node;
+		Node** slots[4] = {&nd->NW, &nd->NE, &nd->SW, &nd->SE};
+		for (int k = 0; k < 4; k++)
+		{
+			delete *slots[k];
+			*slots[k] = NULL;
+		}
+		stats.nodes -= e.children;
+		stats.squaredError += added;
+		e.children = 0;
+
+		if (e.parent >= 0)
+		{
+			Entry& p = entries[e.parent];
+			leafError[e.parent] += e.error;
+			if (--p.interiorChildren == 0)
+			{
+				heap.push(Candidate(Cost(entries, e.parent, leafError), e.parent));
+			}
+		}
+	}
+
+	// leaves may now carry interior averages that are not palette entries
+	if (stats.nodes < entries.size())
+	{
+		palette.clear();
+	}
+	return stats;
+}
@@ -0,0 +1,79 @@
+/**
+ * @file colorintegral.h
+ * @description summed-area tables of pixel colors, giving the squared
+ *              color error of any rectangle in constant time
+ */
+
+#ifndef _COLORINTEGRAL_H_
+#define _COLORINTEGRAL_H_
+
+#include <utility>
+#include <vector>
+#include "cs221util/RGBAPixel.h"
+
+using namespace std;
+using namespace cs221util;
+
+/**
+ * ColorIntegral: prefix sums of each channel (R, G, B, and A scaled to
+ * [0, 255]) and of its square over an image.
+ */
+class ColorIntegral {
+public:
+    /**
+     * @param pixel callable returning the RGBAPixel at (x, y)
+     */
+    template <class F>
+    ColorIntegral(unsigned int width, unsigned int height, F pixel)
+    {
+        stride = (size_t)width + 1;
+        for (int c = 0; c < 4; c++)
+        {
+            sum[c].assign(stride * (height + 1), 0.0);
+            squares[c].assign(stride * (height + 1), 0.0);
+        }
+        for (unsigned int y = 0; y < height; y++)
+        {
+            double rowSum[4] = {0, 0, 0, 0}, rowSquares[4] = {0, 0, 0, 0};
+            for (unsigned int x = 0; x < width; x++)
+            {
+                RGBAPixel p = pixel(x, y);
+                double v[4] = {(double)p.r, (double)p.g, (double)p.b, p.a * 255};
+                size_t at = (y + 1) * stride + x + 1;
+                for (int c = 0; c < 4; c++)
+                {
+                    rowSum[c] += v[c];
+                    rowSquares[c] += v[c] * v[c];
+                    sum[c][at] = sum[c][at - stride] + rowSum[c];
+                    squares[c][at] = squares[c][at - stride] + rowSquares[c];
+                }
+            }
+        }
+    }
+
+    /**
+     * Sum over the channels and pixels of the rectangle (corners
+     * inclusive) of the squared difference from the rectangle's mean color.
+     */
+    double SquaredError(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) const
+    {
+        size_t a = ul.second * stride + ul.first, b = ul.second * stride + lr.first + 1;
+        size_t c = (lr.second + 1) * stride + ul.first, d = (lr.second + 1) * stride + lr.first + 1;
+        double area = (double)(lr.first - ul.first + 1) * (lr.second - ul.second + 1);
+        double error = 0;
+        for (int k = 0; k < 4; k++)
+        {
+            double s = sum[k][d] - sum[k][b] - sum[k][c] + sum[k][a];
+            double s2 = squares[k][d] - squares[k][b] - squares[k][c] + squares[k][a];
+            error += s2 - s * s / area;
+        }
+        return error;
+    }
+
+private:
+    size_t stride;
+    vector<double> sum[4];
+    vector<double> squares[4];
+};
+
+#endif
@@ -0,0 +1,133 @@
+/**
+ * @file colormetric.h
+ * @description color-distance policies for QTree::Prune
+ *
+ * Each policy is a stateless struct providing
+ *   value_type                         type the distance is computed in
+ *   Threshold(double tolerance)        tolerance converted to value_type
+ *   Distance(const RGBAPixel& p, q)    distance between two colors
+ * A leaf is within tolerance when Distance(leaf, avg) <= Threshold(tolerance).
+ * Everything is inline so the prune engine is specialized per policy.
+ */
+
+#ifndef _COLORMETRIC_H_
+#define _COLORMETRIC_H_
+
+#include <cmath>
+#include <cstdlib>
+#include "cs221util/RGBAPixel.h"
+
+using namespace cs221util;
+
+/**
+ * The original prune metric, RGBAPixel::distanceTo: squared distance of
+ * alpha-premultiplied channels in [0, 1], taking for each channel the
+ * worse of compositing over black or over white.
+ */
+struct PremultipliedDistance {
+    typedef double value_type;
+
+    static inline value_type Threshold(double tolerance)
+    {
+        return tolerance;
+    }
+
+    static inline value_type Distance(const RGBAPixel& p, const RGBAPixel& q)
+    {
+        double r_diff = (q.r / 255.0) * q.a - (p.r / 255.0) * p.a;
+        double g_diff = (q.g / 255.0) * q.a - (p.g / 255.0) * p.a;
+        double b_diff = (q.b / 255.0) * q.a - (p.b / 255.0) * p.a;
+        double alphadiff = q.a - p.a;
+
+        double maxdiff_r = fmax(r_diff * r_diff, (r_diff - alphadiff) * (r_diff - alphadiff));
+        double maxdiff_g = fmax(g_diff * g_diff, (g_diff - alphadiff) * (g_diff - alphadiff));
+        double maxdiff_b = fmax(b_diff * b_diff, (b_diff - alphadiff) * (b_diff - alphadiff));
+
+        return maxdiff_r + maxdiff_g + maxdiff_b;
+    }
+};
+
+/**
+ * Integer policies share the conversion of a tolerance to an integer bound:
+ * an integer distance d satisfies d <= tolerance exactly when d <= floor(tolerance).
+ * Negative tolerances map to -1, which no distance meets.
+ */
+inline int IntegerThreshold(double tolerance)
+{
+    if (tolerance < 0)
+    {
+        return -1;
+    }
+    if (tolerance >= 2147483647.0)
+    {
+        return 2147483647;
+    }
+    return (int)tolerance;
+}
+
+/**
+ * Squared Euclidean distance of the 8-bit RGB channels, ignoring alpha.
+ * Range [0, 195075].
+ */
+struct SquaredRGBDistance {
+    typedef int value_type;
+
+    static inline value_type Threshold(double tolerance)
+    {
+        return IntegerThreshold(tolerance);
+    }
+
+    static inline value_type Distance(const RGBAPixel& p, const RGBAPixel& q)
+    {
+        int dr = (int)p.r - (int)q.r;
+        int dg = (int)p.g - (int)q.g;
+        int db = (int)p.b - (int)q.b;
+        return dr * dr + dg * dg + db * db;
+    }
+};
+
+/**
+ * Largest absolute difference over the 8-bit RGB channels, ignoring alpha.
+ * Range [0, 255].
+ */
+struct MaxChannelDistance {
+    typedef int value_type;
+
+    static inline value_type Threshold(double tolerance)
+    {
+        return IntegerThreshold(tolerance);
+    }
+
+    static inline value_type Distance(const RGBAPixel& p, const RGBAPixel& q)
+    {
+        int dr = abs((int)p.r - (int)q.r);
+        int dg = abs((int)p.g - (int)q.g);
+        int db = abs((int)p.b - (int)q.b);
+        int m = dr > dg ? dr : dg;
+        return m > db ? m : db;
+    }
+};
+
+/**
+ * Squared RGB distance weighted by each channel's contribution to luma
+ * (BT.601 weights 0.299/0.587/0.114 as 77/150/29 in 8.8 fixed point),
+ * ignoring alpha. Range [0, 65025].
+ */
+struct LumaWeightedDistance {
+    typedef int value_type;
+
+    static inline value_type Threshold(double tolerance)
+    {
+        return IntegerThreshold(tolerance);
+    }
+
+    static inline value_type Distance(const RGBAPixel& p, const RGBAPixel& q)
+    {
+        int dr = (int)p.r - (int)q.r;
+        int dg = (int)p.g - (int)q.g;
+        int db = (int)p.b - (int)q.b;
+        return (77 * dr * dr + 150 * dg * dg + 29 * db * db) >> 8;
+    }
+};
+
+#endif
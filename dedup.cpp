@@ -0,0 +1,237 @@
+/**
+ * @file dedup.cpp
+ * @description sharing of identical QTree subtrees (hash-consing), which
+ *              turns the tree into a DAG
+ *
+ * Once subtrees are shared, a node's upLeft/lowRight are those of one of
+ * the places it appears and only its dimensions can be relied on; every
+ * operation on a shared tree places children by size instead (see
+ * WestWidth/NorthHeight in qtree-traversal.h).
+ */
+
+#include <cstring>
+#include <unordered_set>
+#include "qtree.h"
+#include "qtree-traversal.h"
+#include "spill.h"
+
+namespace
+{
+	// Everything that makes two subtrees interchangeable, given that their
+	// children have already been replaced by their shared representatives.
+	struct NodeKey
+	{
+		unsigned int width;
+		unsigned int height;
+		RGBAPixel avg;
+		const Node* children[4];
+		const unsigned char* block; // pixels of a block leaf, compared by content
+		size_t blockHash;
+		const int* gradient;        // plane of a gradient leaf, compared by value
+
+		bool operator==(const NodeKey& other) const
+		{
+			return width == other.width && height == other.height &&
+				   avg.r == other.avg.r && avg.g == other.avg.g && avg.b == other.avg.b && avg.a == other.avg.a &&
+				   children[0] == other.children[0] && children[1] == other.children[1] &&
+				   children[2] == other.children[2] && children[3] == other.children[3] &&
+				   (block == NULL) == (other.block == NULL) &&
+				   (block == NULL || (blockHash == other.blockHash && memcmp(block, other.block, (size_t)width * height * 4) == 0)) &&
+				   (gradient == NULL) == (other.gradient == NULL) &&
+				   (gradient == NULL || memcmp(gradient, other.gradient, GRADIENT_TERMS * sizeof(int)) == 0);
+		}
+	};
+
+	struct NodeKeyHash
+	{
+		size_t operator()(const NodeKey& key) const
+		{
+			size_t h = key.width * 0x9e3779b97f4a7c15ULL ^ key.height;
+			h = h * 31 + (key.avg.r | (key.avg.g << 8) | (key.avg.b << 16));
+			h = h * 31 + hash<double>()(key.avg.a);
+			for (int i = 0; i < 4; i++)
+			{
+				h = h * 31 + hash<const Node*>()(key.children[i]);
+			}
+			h = h * 31 + key.blockHash;
+			for (unsigned int i = 0; key.gradient != NULL && i < GRADIENT_TERMS; i++)
+			{
+				h = h * 31 + (unsigned int)key.gradient[i];
+			}
+			return h;
+		}
+	};
+
+	typedef unordered_map<NodeKey, Node*, NodeKeyHash> NodeTable;
+
+	// Replaces the children of nd by their representatives, then returns
+	// nd's own representative. Nodes that turn out to be duplicates go to
+	// garbage; they are freed only at the end, so no address is reused
+	// while representatives are still being looked up.
+	Node* Canonicalize(Node* nd, unordered_map<Node*, Node*>& representative, NodeTable& table, vector<Node*>& garbage)
+	{
+		if (nd == NULL)
+		{
+			return NULL;
+		}
+		unordered_map<Node*, Node*>::iterator known = representative.find(nd);
+		if (known != representative.end())
+		{
+			return known->second;
+		}
+
+		nd->NW = Canonicalize(nd->NW, representative, table, garbage);
+		nd->NE = Canonicalize(nd->NE, representative, table, garbage);
+		nd->SW = Canonicalize(nd->SW, representative, table, garbage);
+		nd->SE = Canonicalize(nd->SE, representative, table, garbage);
+
+		NodeKey key = {nd->lowRight.first - nd->upLeft.first + 1, nd->lowRight.second - nd->upLeft.second + 1, nd->avg,
+					   {nd->NW, nd->NE, nd->SW, nd->SE}, nd->block, 0, nd->gradient};
+		if (nd->block != NULL)
+		{
+			// FNV-1a
+			key.blockHash = 14695981039346656037ULL;
+			for (size_t i = 0; i < BlockBytes(nd); i++)
+			{
+				key.blockHash = (key.blockHash ^ nd->block[i]) * 1099511628211ULL;
+			}
+		}
+		pair<NodeTable::iterator, bool> ins = table.insert(make_pair(key, nd));
+		if (!ins.second)
+		{
+			garbage.push_back(nd);
+		}
+		representative[nd] = ins.first->second;
+		return ins.first->second;
+	}
+
+	// Adds every distinct node reachable from nd to seen.
+	void CollectUnique(Node* nd, unordered_set<Node*>& seen)
+	{
+		if (nd == NULL || !seen.insert(nd).second)
+		{
+			return;
+		}
+		CollectUnique(nd->NW, seen);
+		CollectUnique(nd->NE, seen);
+		CollectUnique(nd->SW, seen);
+		CollectUnique(nd->SE, seen);
+	}
+}
+
+/**
+ * Shares identical subtrees, bottom-up (block and gradient leaves match
+ * only if their pixels and planes do): once a node's children have been
+ * replaced by their representatives, identical subtrees have equal keys,
+ * so one hash lookup per node finds the representative.
+ *
+ * @return node counts after sharing
+ */
+DedupStats QTree::Deduplicate()
+{
+	// spilled subtrees are read back first, and a shared tree is not spilled again
+	SpillGuard guard(*this);
+	unordered_map<Node*, Node*> representative;
+	NodeTable table;
+	vector<Node*> garbage;
+	root = Canonicalize(root, representative, table, garbage);
+	for (size_t i = 0; i < garbage.size(); i++)
+	{
+		delete garbage[i];
+	}
+	shared = true;
+	return SharingStats();
+}
+
+DedupStats QTree::SharingStats() const
+{
+	unordered_set<Node*> unique;
+	CollectUnique(root, unique);
+
+	DedupStats stats;
+	stats.nodes = CountNodes();
+	stats.uniqueNodes = unique.size() + (spill != NULL ? spill->HiddenNodes() : 0);
+	stats.ratio = stats.uniqueNodes == 0 ? 1.0 : (double)stats.nodes / stats.uniqueNodes;
+	return stats;
+}
+
+/**
+ * Expands a shared tree back into an ordinary tree, with every node's
+ * corners set to where it is actually rendered. Does nothing if no
+ * subtree is shared.
+ */
+void QTree::Unshare()
+{
+	if (!shared)
+	{
+		return;
+	}
+	Node* expanded = ExpandNode(root, pair<unsigned int, unsigned int>(0, 0));
+	ClearSharedNode(root);
+	root = expanded;
+	shared = false;
+}
+
+/**
+ * Private helper for Unshare: a private copy of the subtree, placed with
+ * its upper left corner at ul.
+ */
+Node* QTree::ExpandNode(const Node* subroot, pair<unsigned int, unsigned int> ul)
+{
+	if (subroot == NULL)
+	{
+		return NULL;
+	}
+	pair<unsigned int, unsigned int> lr(ul.first + subroot->lowRight.first - subroot->upLeft.first,
+										ul.second + subroot->lowRight.second - subroot->upLeft.second);
+	Node* copy = new Node(ul, lr, subroot->avg);
+	copy->block = CopyBlock(subroot);
+	copy->gradient = CopyGradient(subroot);
+
+	unsigned int east = ul.first + WestWidth(subroot);
+	unsigned int south = ul.second + NorthHeight(subroot);
+	copy->NW = ExpandNode(subroot->NW, ul);
+	copy->NE = ExpandNode(subroot->NE, pair<unsigned int, unsigned int>(east, ul.second));
+	copy->SW = ExpandNode(subroot->SW, pair<unsigned int, unsigned int>(ul.first, south));
+	copy->SE = ExpandNode(subroot->SE, pair<unsigned int, unsigned int>(east, south));
+	return copy;
+}
+
+/**
+ * Frees every node of a shared tree exactly once.
+ */
+void QTree::ClearSharedNode(Node* subroot)
+{
+	unordered_set<Node*> unique;
+	CollectUnique(subroot, unique);
+	for (unordered_set<Node*>::iterator it = unique.begin(); it != unique.end(); ++it)
+	{
+		delete *it;
+	}
+}
+
+/**
+ * Copies a shared tree, preserving its sharing: each distinct node is
+ * copied once, and copies maps originals to their copies.
+ */
+Node* QTree::CopySharedNode(Node* subroot, unordered_map<Node*, Node*>& copies)
+{
+	if (subroot == NULL)
+	{
+		return NULL;
+	}
+	unordered_map<Node*, Node*>::iterator known = copies.find(subroot);
+	if (known != copies.end())
+	{
+		return known->second;
+	}
+	Node* copy = new Node(subroot->upLeft, subroot->lowRight, subroot->avg);
+	copy->block = CopyBlock(subroot);
+	copy->gradient = CopyGradient(subroot);
+	copy->NW = CopySharedNode(subroot->NW, copies);
+	copy->NE = CopySharedNode(subroot->NE, copies);
+	copy->SW = CopySharedNode(subroot->SW, copies);
+	copy->SE = CopySharedNode(subroot->SE, copies);
+	copies[subroot] = copy;
+	return copy;
+}
@@ -0,0 +1,313 @@
+/**
+ * @file gradient.cpp
+ * @description pruning of a QTree into flat and gradient (plane-fit) leaves
+ *
+ * Every node keeps the sums of each channel, and of x and y times each
+ * channel, over its pixels. They add up from children to parent, so one
+ * bottom-up pass gives every node's moments, and the least-squares plane
+ * through a node's pixels follows from them in O(1): on a full rectangle
+ * x and y are uncorrelated, so each slope is the covariance of the channel
+ * with that coordinate over the coordinate's variance.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <vector>
+#include "qtree.h"
+#include "qtree-traversal.h"
+#include "spill.h"
+#include "trace.h"
+
+namespace
+{
+	struct Moments
+	{
+		Node* node;
+		unsigned int size; // nodes in the subtree, this one included
+		double s[4];       // sum of each channel (alpha scaled to 255)
+		double sx[4];      // sum of x * channel
+		double sy[4];      // sum of y * channel
+	};
+
+	/**
+	 * How the pass reaches a tree's spilled subtrees: load reads back a
+	 * copy of the one at a stub (null for any other node), and free
+	 * releases a subtree along with the records of any spilled within it.
+	 */
+	struct Spilled
+	{
+		function<Node*(const Node*)> load;
+		function<void(Node*)> free;
+	};
+
+	inline void AddPixel(Moments& m, const RGBAPixel& p, double x, double y)
+	{
+		double v[4] = {(double)p.r, (double)p.g, (double)p.b, p.a * 255};
+		for (int k = 0; k < 4; k++)
+		{
+			m.s[k] += v[k];
+			m.sx[k] += x * v[k];
+			m.sy[k] += y * v[k];
+		}
+	}
+
+	// Appends the moments of the subtree in pre-order (children in
+	// NW/NE/SW/SE order); returns nd's index. A stub gets the moments of
+	// the subtree it stands for, and counts as a single node.
+	size_t Summarize(Node* nd, vector<Moments>& moments, const Spilled& spilled)
+	{
+		size_t self = moments.size();
+		Moments m = {nd, 1, {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0}};
+		moments.push_back(m);
+
+		unsigned int x0 = nd->upLeft.first, y0 = nd->upLeft.second;
+		unsigned int w = nd->lowRight.first - x0 + 1, h = nd->lowRight.second - y0 + 1;
+		if (nd->block != NULL)
+		{
+			const unsigned char* p = nd->block;
+			for (unsigned int y = 0; y < h; y++)
+			{
+				for (unsigned int x = 0; x < w; x++, p += 4)
+				{
+					AddPixel(moments[self], BlockPixel(p), x0 + x, y0 + y);
+				}
+			}
+			return self;
+		}
+		if (nd->gradient != NULL)
+		{
+			for (unsigned int y = 0; y < h; y++)
+			{
+				for (unsigned int x = 0; x < w; x++)
+				{
+					AddPixel(moments[self], GradientPixel(nd->gradient, x, y), x0 + x, y0 + y);
+				}
+			}
+			return self;
+		}
+		if (IsLeaf(nd))
+		{
+			Node* copy = spilled.load(nd);
+			if (copy != NULL)
+			{
+				vector<Moments> below;
+				Summarize(copy, below, spilled);
+				copy_n(below[0].s, 4, moments[self].s);
+				copy_n(below[0].sx, 4, moments[self].sx);
+				copy_n(below[0].sy, 4, moments[self].sy);
+				DeleteSubtree(copy);
+				return self;
+			}
+			// a flat leaf: its color times the sums of the coordinates
+			double area = (double)w * h;
+			double sumX = area * (x0 + (w - 1) / 2.0), sumY = area * (y0 + (h - 1) / 2.0);
+			double v[4] = {(double)nd->avg.r, (double)nd->avg.g, (double)nd->avg.b, nd->avg.a * 255};
+			for (int k = 0; k < 4; k++)
+			{
+				moments[self].s[k] = area * v[k];
+				moments[self].sx[k] = sumX * v[k];
+				moments[self].sy[k] = sumY * v[k];
+			}
+			return self;
+		}
+
+		Node* children[4] = {nd->NW, nd->NE, nd->SW, nd->SE};
+		for (int i = 0; i < 4; i++)
+		{
+			if (children[i] == NULL)
+			{
+				continue;
+			}
+			size_t child = Summarize(children[i], moments, spilled);
+			for (int k = 0; k < 4; k++)
+			{
+				moments[self].s[k] += moments[child].s[k];
+				moments[self].sx[k] += moments[child].sx[k];
+				moments[self].sy[k] += moments[child].sy[k];
+			}
+			moments[self].size += moments[child].size;
+		}
+		return self;
+	}
+
+	// Least-squares plane through the node's pixels, in Node::gradient's layout.
+	void FitPlane(const Moments& m, int plane[GRADIENT_TERMS])
+	{
+		const Node* nd = m.node;
+		double w = nd->lowRight.first - nd->upLeft.first + 1, h = nd->lowRight.second - nd->upLeft.second + 1;
+		double area = w * h;
+		double cx = nd->upLeft.first + (w - 1) / 2, cy = nd->upLeft.second + (h - 1) / 2;
+		// sums of (x - cx)^2 and (y - cy)^2 over the rectangle
+		double varX = h * w * (w * w - 1) / 12, varY = w * h * (h * h - 1) / 12;
+		for (int k = 0; k < 4; k++)
+		{
+			double mean = m.s[k] / area;
+			double gx = varX > 0 ? (m.sx[k] - cx * m.s[k]) / varX : 0;
+			double gy = varY > 0 ? (m.sy[k] - cy * m.s[k]) / varY : 0;
+			double corner = mean - gx * (w - 1) / 2 - gy * (h - 1) / 2;
+			plane[k] = (int)lround(corner * (1 << GRADIENT_SHIFT));
+			plane[4 + k] = (int)lround(gx * (1 << GRADIENT_SHIFT));
+			plane[8 + k] = (int)lround(gy * (1 << GRADIENT_SHIFT));
+		}
+	}
+
+	// Calls test on every pixel under subroot (single pixels, blocks and
+	// gradients, as toleranceLeaves visits them) until it returns false;
+	// spilled subtrees are read back for it. Returns false if stopped.
+	template <class T>
+	bool AllPixels(const Node* subroot, T& test, const Spilled& spilled)
+	{
+		return AllLeaves(subroot, [&test, &spilled](const Node* leaf) {
+			unsigned int w = leaf->lowRight.first - leaf->upLeft.first + 1, h = leaf->lowRight.second - leaf->upLeft.second + 1;
+			if (leaf->block != NULL || leaf->gradient != NULL)
+			{
+				for (unsigned int y = 0; y < h; y++)
+				{
+					for (unsigned int x = 0; x < w; x++)
+					{
+						RGBAPixel p = leaf->block != NULL ? BlockPixel(leaf->block + ((size_t)y * w + x) * 4)
+														  : GradientPixel(leaf->gradient, x, y);
+						if (!test(p, leaf->upLeft.first + x, leaf->upLeft.second + y))
+						{
+							return false;
+						}
+					}
+				}
+				return true;
+			}
+			// only single-pixel leaves take part, as in an unpruned tree
+			if (leaf->upLeft == leaf->lowRight)
+			{
+				return test(leaf->avg, leaf->upLeft.first, leaf->upLeft.second);
+			}
+			Node* copy = spilled.load(leaf);
+			if (copy == NULL)
+			{
+				return true;
+			}
+			bool all = AllPixels(copy, test, spilled);
+			DeleteSubtree(copy);
+			return all;
+		});
+	}
+
+	// Tests every pixel under subroot against both the flat color avg and
+	// the plane, stopping once neither fits. Sets found if any pixel was seen.
+	template <class Metric>
+	void FitLeaves(const Node* subroot, const RGBAPixel& avg, const int* plane, typename Metric::value_type tol,
+				   const Spilled& spilled, bool& flatFits, bool& planeFits, bool& found)
+	{
+		unsigned int x0 = subroot->upLeft.first, y0 = subroot->upLeft.second;
+		flatFits = true;
+		planeFits = true;
+		auto test = [&](const RGBAPixel& p, unsigned int x, unsigned int y) {
+			found = true;
+			flatFits = flatFits && Metric::Distance(p, avg) <= tol;
+			planeFits = planeFits && Metric::Distance(p, GradientPixel(plane, x - x0, y - y0)) <= tol;
+			return flatFits || planeFits;
+		};
+		AllPixels(subroot, test, spilled);
+	}
+
+	// Makes nd a leaf, freeing its subtree and any block.
+	void Collapse(Node* nd, const Spilled& spilled)
+	{
+		Node** slots[4] = {&nd->NW, &nd->NE, &nd->SW, &nd->SE};
+		for (int i = 0; i < 4; i++)
+		{
+			spilled.free(*slots[i]);
+			*slots[i] = NULL;
+		}
+		delete[] nd->block;
+		nd->block = NULL;
+	}
+
+	// Prunes the subtree at moments[i] top-down; returns whether anything
+	// changed. A stub is left for its own pass (see PruneGradient).
+	template <class Metric>
+	bool PruneGradientNode(const vector<Moments>& moments, size_t i, typename Metric::value_type tol, const Spilled& spilled)
+	{
+		Node* nd = moments[i].node;
+		if (nd->gradient != NULL || (IsLeaf(nd) && nd->block == NULL))
+		{
+			return false;
+		}
+
+		int plane[GRADIENT_TERMS];
+		FitPlane(moments[i], plane);
+		bool flatFits, planeFits, found = false;
+		FitLeaves<Metric>(nd, nd->avg, plane, tol, spilled, flatFits, planeFits, found);
+		if (found && flatFits)
+		{
+			Collapse(nd, spilled);
+			return true;
+		}
+		if (found && planeFits)
+		{
+			Collapse(nd, spilled);
+			nd->gradient = new int[GRADIENT_TERMS];
+			copy(plane, plane + GRADIENT_TERMS, nd->gradient);
+			return true;
+		}
+
+		// children follow their parent in pre-order, each after the
+		// whole subtree of the one before
+		bool changed = false;
+		for (size_t child = i + 1; child < i + moments[i].size; child += moments[child].size)
+		{
+			changed = PruneGradientNode<Metric>(moments, child, tol, spilled) || changed;
+		}
+		return changed;
+	}
+}
+
+void QTree::PruneGradient(double tolerance)
+{
+	PruneGradient<PremultipliedDistance>(tolerance);
+}
+
+/**
+ * Prunes top-down like Prune, with the least-squares plane through each
+ * subtree's pixels as a second candidate: a subtree becomes a flat leaf if
+ * every pixel is within tolerance of its average, and otherwise a gradient
+ * leaf if every pixel is within tolerance of the plane's color there.
+ *
+ * @param tolerance maximum distance, in the metric's units, to qualify for pruning
+ * @pre this tree has not previously been pruned, nor is copied from a previously pruned tree.
+ */
+template <class Metric>
+void QTree::PruneGradient(double tolerance)
+{
+	TRACE_SCOPE("QTree::PruneGradient");
+	SpillGuard guard(*this, SpillGuard::ON_DEMAND);
+	Unshare();
+	if (root == NULL)
+	{
+		return;
+	}
+	Spilled spilled = {[this](const Node* nd) { return LoadSpilled(nd); }, [this](Node* nd) { ClearNode(nd); }};
+	typename Metric::value_type tol = Metric::Threshold(tolerance);
+	vector<Moments> moments;
+	moments.reserve(CountNodes(root));
+	Summarize(root, moments, spilled);
+	bool changed = PruneGradientNode<Metric>(moments, 0, tol, spilled);
+
+	// the spilled subtrees left standing are pruned one at a time
+	ForEachSpilled([&spilled, tol, &changed](Node* unit) {
+		vector<Moments> unitMoments;
+		Summarize(unit, unitMoments, spilled);
+		changed = PruneGradientNode<Metric>(unitMoments, 0, tol, spilled) || changed;
+	});
+
+	// leaves may now carry colors that are not palette entries
+	if (changed)
+	{
+		palette.clear();
+	}
+}
+
+template void QTree::PruneGradient<PremultipliedDistance>(double tolerance);
+template void QTree::PruneGradient<SquaredRGBDistance>(double tolerance);
+template void QTree::PruneGradient<MaxChannelDistance>(double tolerance);
+template void QTree::PruneGradient<LumaWeightedDistance>(double tolerance);
@@ -0,0 +1,194 @@
+/**
+ * @file imagemetrics.cpp
+ * @description image quality metrics (MSE, PSNR, maximum error, SSIM)
+ *              between an original image and a rendering of it
+ */
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "imagemetrics.h"
+
+namespace
+{
+	// rows per task; a multiple of the SSIM window height
+	const unsigned int BAND_ROWS = 64;
+	const unsigned int WINDOW = 8;
+	// pixels whose squared errors (at most 255^2 each) fit in 32 bits
+	const unsigned int RUN = 65536;
+
+	// Sums over one band of rows.
+	struct Partial
+	{
+		uint64_t squared[4];
+		unsigned int maxError[4];
+		double ssim;          // sum over the band's windows
+		unsigned long windows;
+	};
+
+	inline int Alpha(const RGBAPixel& p)
+	{
+		return (int)(p.a * 255);
+	}
+
+	// Luma scaled by 256 to stay in integers.
+	inline int Luma(const RGBAPixel& p)
+	{
+		return 77 * p.r + 150 * p.g + 29 * p.b;
+	}
+
+	// Structural similarity of one window, from luma (scaled by 256).
+	double WindowSSIM(const RGBAPixel* const* rowsA, const RGBAPixel* const* rowsB, unsigned int x0, unsigned int ww, unsigned int wh)
+	{
+		int64_t sumA = 0, sumB = 0, sumAA = 0, sumBB = 0, sumAB = 0;
+		for (unsigned int y = 0; y < wh; y++)
+		{
+			for (unsigned int x = x0; x < x0 + ww; x++)
+			{
+				int64_t la = Luma(rowsA[y][x]), lb = Luma(rowsB[y][x]);
+				sumA += la;
+				sumB += lb;
+				sumAA += la * la;
+				sumBB += lb * lb;
+				sumAB += la * lb;
+			}
+		}
+		double n = (double)ww * wh, scale = 256.0;
+		double meanA = sumA / n / scale, meanB = sumB / n / scale;
+		double varA = sumAA / n / (scale * scale) - meanA * meanA;
+		double varB = sumBB / n / (scale * scale) - meanB * meanB;
+		double cov = sumAB / n / (scale * scale) - meanA * meanB;
+
+		const double C1 = (0.01 * 255) * (0.01 * 255), C2 = (0.03 * 255) * (0.03 * 255);
+		return ((2 * meanA * meanB + C1) * (2 * cov + C2)) / ((meanA * meanA + meanB * meanB + C1) * (varA + varB + C2));
+	}
+
+	// Compares rows [0, count) of a band. rowsA/rowsB point at each row's
+	// first pixel. Windows start every wh rows from the top of the band,
+	// so bands must start on a window boundary.
+	Partial CompareBand(const vector<const RGBAPixel*>& rowsA, const vector<const RGBAPixel*>& rowsB, unsigned int width, unsigned int ww, unsigned int wh)
+	{
+		Partial result = {{0, 0, 0, 0}, {0, 0, 0, 0}, 0.0, 0};
+		unsigned int count = rowsA.size();
+		for (unsigned int y = 0; y < count; y++)
+		{
+			const RGBAPixel* a = rowsA[y];
+			const RGBAPixel* b = rowsB[y];
+			// 32-bit sums over runs short enough not to overflow; the inner
+			// loop is branch-free so it vectorizes
+			for (unsigned int x0 = 0; x0 < width; x0 += RUN)
+			{
+				unsigned int x1 = min(width, x0 + RUN);
+				uint32_t sq[4] = {0, 0, 0, 0};
+				int mx[4] = {0, 0, 0, 0};
+				for (unsigned int x = x0; x < x1; x++)
+				{
+					int d[4] = {a[x].r - b[x].r, a[x].g - b[x].g, a[x].b - b[x].b, Alpha(a[x]) - Alpha(b[x])};
+					for (int c = 0; c < 4; c++)
+					{
+						int m = d[c] < 0 ? -d[c] : d[c];
+						sq[c] += m * m;
+						mx[c] = m > mx[c] ? m : mx[c];
+					}
+				}
+				for (int c = 0; c < 4; c++)
+				{
+					result.squared[c] += sq[c];
+					result.maxError[c] = max(result.maxError[c], (unsigned int)mx[c]);
+				}
+			}
+		}
+
+		for (unsigned int y = 0; y + wh <= count; y += wh)
+		{
+			for (unsigned int x = 0; x + ww <= width; x += ww)
+			{
+				result.ssim += WindowSSIM(&rowsA[y], &rowsB[y], x, ww, wh);
+				result.windows++;
+			}
+		}
+		return result;
+	}
+
+	ImageMetrics Combine(const vector<Partial>& partial, unsigned int width, unsigned int height)
+	{
+		ImageMetrics metrics;
+		uint64_t squared = 0;
+		double ssim = 0;
+		unsigned long windows = 0;
+		for (int c = 0; c < 4; c++)
+		{
+			metrics.maxError[c] = 0;
+		}
+		for (size_t i = 0; i < partial.size(); i++)
+		{
+			for (int c = 0; c < 4; c++)
+			{
+				squared += partial[i].squared[c];
+				metrics.maxError[c] = max(metrics.maxError[c], partial[i].maxError[c]);
+			}
+			ssim += partial[i].ssim;
+			windows += partial[i].windows;
+		}
+		// two empty images are identical
+		metrics.mse = width == 0 || height == 0 ? 0 : (double)squared / (4.0 * width * height);
+		metrics.psnr = metrics.mse == 0 ? numeric_limits<double>::infinity() : 10 * log10(255.0 * 255.0 / metrics.mse);
+		metrics.ssim = windows == 0 ? 1.0 : ssim / windows;
+		return metrics;
+	}
+
+	// Runs compare(y0, y1, partial) for every band of rows on the pool.
+	template <class F>
+	ImageMetrics CompareBands(unsigned int width, unsigned int height, ThreadPool& pool, F compare)
+	{
+		if (width == 0 || height == 0)
+		{
+			return Combine(vector<Partial>(), width, height);
+		}
+		unsigned int wh = min(WINDOW, height);
+		unsigned int band = BAND_ROWS - BAND_ROWS % wh;
+		vector<Partial> partial((height + band - 1) / band);
+		TaskGroup group(pool);
+		for (size_t i = 0; i < partial.size(); i++)
+		{
+			unsigned int y0 = i * band;
+			unsigned int y1 = min(height, y0 + band) - 1;
+			Partial* slot = &partial[i];
+			group.Run([y0, y1, slot, &compare]() { *slot = compare(y0, y1); });
+		}
+		group.Wait();
+		return Combine(partial, width, height);
+	}
+}
+
+ImageMetrics CompareImages(const PNG& a, const PNG& b, ThreadPool& pool)
+{
+	unsigned int width = a.width(), height = a.height();
+	unsigned int ww = min(WINDOW, width), wh = min(WINDOW, height);
+	return CompareBands(width, height, pool, [&a, &b, width, ww, wh](unsigned int y0, unsigned int y1) {
+		vector<const RGBAPixel*> rowsA, rowsB;
+		for (unsigned int y = y0; y <= y1; y++)
+		{
+			rowsA.push_back(a.getPixel(0, y));
+			rowsB.push_back(b.getPixel(0, y));
+		}
+		return CompareBand(rowsA, rowsB, width, ww, wh);
+	});
+}
+
+ImageMetrics CompareImages(const PNG& original, const QTree& tree, ThreadPool& pool)
+{
+	unsigned int width = original.width(), height = original.height();
+	unsigned int ww = min(WINDOW, width), wh = min(WINDOW, height);
+	return CompareBands(width, height, pool, [&original, &tree, width, ww, wh](unsigned int y0, unsigned int y1) {
+		PNG rendered = tree.RenderRegion(pair<unsigned int, unsigned int>(0, y0), pair<unsigned int, unsigned int>(width - 1, y1), 1);
+		vector<const RGBAPixel*> rowsA, rowsB;
+		for (unsigned int y = y0; y <= y1; y++)
+		{
+			rowsA.push_back(original.getPixel(0, y));
+			rowsB.push_back(rendered.getPixel(0, y - y0));
+		}
+		return CompareBand(rowsA, rowsB, width, ww, wh);
+	});
+}
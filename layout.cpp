@@ -0,0 +1,125 @@
+/**
+ * @file layout.cpp
+ * @description van Emde Boas relayout of QTree nodes, so that traversals
+ *              touch few cache lines per root-to-leaf path
+ */
+
+#include <algorithm>
+#include <new>
+#include "nodepool.h"
+#include "qtree.h"
+#include "qtree-traversal.h"
+#include "spill.h"
+
+namespace
+{
+	/**
+	 * Levels of the subtree at nd, nd included (0 for null); adds its
+	 * nodes to count.
+	 */
+	unsigned int Levels(const Node* nd, size_t& count)
+	{
+		if (nd == NULL)
+		{
+			return 0;
+		}
+		count++;
+		unsigned int west = max(Levels(nd->NW, count), Levels(nd->SW, count));
+		unsigned int east = max(Levels(nd->NE, count), Levels(nd->SE, count));
+		return 1 + max(west, east);
+	}
+
+	/**
+	 * A node waiting for its slot, and the child pointer of its parent's
+	 * copy that is to point at its own copy.
+	 */
+	struct Pending
+	{
+		Node* node;
+		Node** parent;
+	};
+
+	/**
+	 * Moves nodes into consecutive slots of a run, in van Emde Boas order.
+	 * Each old node is read once, when it is placed, and freed there and
+	 * then while it is still in cache, so the old tree (possibly scattered
+	 * over the whole pool) is walked only once.
+	 */
+	class Placer
+	{
+	public:
+		Placer(void* run, unsigned int levels)
+			: run(run), next(0), scratch(levels + 1)
+		{
+		}
+
+		/**
+		 * Places the top levels of the subtree of top, and appends the
+		 * subtrees hanging below those levels to below, in NW/NE/SW/SE order.
+		 */
+		void Layout(const Pending& top, unsigned int levels, vector<Pending>& below, unsigned int depth)
+		{
+			if (levels == 1)
+			{
+				Place(top, below);
+				return;
+			}
+			// a vector per recursion depth, reused, rather than one per call
+			vector<Pending>& middle = scratch[depth];
+			middle.clear();
+			Layout(top, levels / 2, middle, depth + 1);
+			for (size_t i = 0; i < middle.size(); i++)
+			{
+				Layout(middle[i], levels - levels / 2, below, depth + 1);
+			}
+		}
+
+	private:
+		void* run;
+		size_t next;
+		vector<vector<Pending> > scratch;
+
+		// Moves p's node, with its block and gradient, to the next slot.
+		void Place(const Pending& p, vector<Pending>& below)
+		{
+			Node* old = p.node;
+			Node* nd = ::new (NodePool::RunSlot(run, next++)) Node(old->upLeft, old->lowRight, old->avg);
+			nd->block = old->block;
+			nd->gradient = old->gradient;
+			old->block = NULL;
+			old->gradient = NULL;
+			*p.parent = nd;
+
+			Node* children[4] = {old->NW, old->NE, old->SW, old->SE};
+			Node** slots[4] = {&nd->NW, &nd->NE, &nd->SW, &nd->SE};
+			for (int i = 0; i < 4; i++)
+			{
+				if (children[i] != NULL)
+				{
+					Pending child = {children[i], slots[i]};
+					below.push_back(child);
+				}
+			}
+			delete old;
+		}
+	};
+}
+
+/**
+ * Moves the nodes into van Emde Boas order; see qtree.h.
+ */
+void QTree::Relayout()
+{
+	SpillGuard guard(*this);
+	if (shared || root == NULL)
+	{
+		return;
+	}
+	size_t count = 0;
+	unsigned int levels = Levels(root, count);
+
+	Placer placer(NodePool::AllocateRun(count), levels);
+	Pending top = {root, &root};
+	vector<Pending> below;
+	placer.Layout(top, levels, below, 0);
+}
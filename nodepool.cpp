@@ -0,0 +1,286 @@
+/**
+ * @file nodepool.cpp
+ * @description pooled allocation of QTree nodes, with a free list per
+ *              thread so that building and freeing trees rarely touches
+ *              the global heap
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <vector>
+#include "nodepool.h"
+#include "qtree.h"
+
+namespace
+{
+	const size_t BATCH = 256; // nodes moved between a thread and the shared list at a time
+
+	struct FreeNode
+	{
+		FreeNode* next;
+	};
+
+	/**
+	 * Header in the first node slot of every chunk. A run's chunks all
+	 * point at its first chunk, whose header counts the run's live nodes.
+	 */
+	struct Chunk
+	{
+		Chunk* run;         // first chunk of the run; null for chunks of the free lists
+		atomic<size_t> live; // first chunk of a run: nodes not yet released
+		size_t chunks;      // first chunk of a run: chunks in the run
+		size_t free;        // chunks of the free lists: Trim's count of their free nodes
+	};
+
+	static_assert(sizeof(Chunk) <= sizeof(Node), "a chunk header must fit in a node slot");
+
+	const size_t SLOTS = NodePool::CHUNK_BYTES / sizeof(Node) - 1; // node slots per chunk
+
+	mutex sharedLock;
+	FreeNode* sharedFree = NULL; // guarded by sharedLock
+	size_t sharedCount = 0;      // nodes on sharedFree; guarded by sharedLock
+	atomic<size_t> chunks(0);
+	atomic<size_t> reserved(0);
+
+	Chunk* ChunkOf(const void* p)
+	{
+		return (Chunk*)((uintptr_t)p & ~(uintptr_t)(NodePool::CHUNK_BYTES - 1));
+	}
+
+	Node* Slot(Chunk* chunk, size_t i)
+	{
+		return (Node*)chunk + 1 + i;
+	}
+
+	// n chunks, contiguous and aligned to CHUNK_BYTES, with their headers set
+	Chunk* NewChunks(size_t n, bool run)
+	{
+		char* memory = (char*)::operator new(n * NodePool::CHUNK_BYTES, align_val_t(NodePool::CHUNK_BYTES));
+		for (size_t i = 0; i < n; i++)
+		{
+			Chunk* chunk = ::new (memory + i * NodePool::CHUNK_BYTES) Chunk();
+			chunk->run = run ? (Chunk*)memory : NULL;
+			chunk->free = 0;
+		}
+		chunks++;
+		reserved += n * NodePool::CHUNK_BYTES;
+		return (Chunk*)memory;
+	}
+
+	void FreeChunks(Chunk* first, size_t n)
+	{
+		::operator delete(first, align_val_t(NodePool::CHUNK_BYTES));
+		chunks--;
+		reserved -= n * NodePool::CHUNK_BYTES;
+	}
+
+	// Detaches the first n nodes of list (which has at least n) and
+	// returns them; list keeps the rest.
+	FreeNode* Detach(FreeNode*& list, size_t n, FreeNode*& tail)
+	{
+		FreeNode* head = list;
+		tail = head;
+		for (size_t i = 1; i < n; i++)
+		{
+			tail = tail->next;
+		}
+		list = tail->next;
+		tail->next = NULL;
+		return head;
+	}
+
+	struct LocalList
+	{
+		FreeNode* head;
+		size_t count;
+
+		LocalList()
+		{
+			head = NULL;
+			count = 0;
+		}
+
+		// nodes freed by a thread outlive it, so its list goes to the shared one
+		~LocalList()
+		{
+			if (head != NULL)
+			{
+				FreeNode* tail;
+				FreeNode* all = Detach(head, count, tail);
+				lock_guard<mutex> guard(sharedLock);
+				tail->next = sharedFree;
+				sharedFree = all;
+				sharedCount += count;
+			}
+			count = 0;
+		}
+	};
+
+	thread_local LocalList local;
+
+	// Refills the empty local list from the shared list, or from a new chunk.
+	void Refill()
+	{
+		{
+			lock_guard<mutex> guard(sharedLock);
+			while (sharedFree != NULL && local.count < BATCH)
+			{
+				FreeNode* nd = sharedFree;
+				sharedFree = nd->next;
+				sharedCount--;
+				nd->next = local.head;
+				local.head = nd;
+				local.count++;
+			}
+		}
+		if (local.head != NULL)
+		{
+			return;
+		}
+		Chunk* chunk = NewChunks(1, false);
+		for (size_t i = SLOTS; i-- > 0;)
+		{
+			FreeNode* nd = (FreeNode*)Slot(chunk, i);
+			nd->next = local.head;
+			local.head = nd;
+		}
+		local.count = SLOTS;
+	}
+}
+
+void* NodePool::Allocate()
+{
+	if (local.head == NULL)
+	{
+		Refill();
+	}
+	FreeNode* nd = local.head;
+	local.head = nd->next;
+	local.count--;
+	return nd;
+}
+
+void* NodePool::AllocateRun(size_t n)
+{
+	size_t count = (n + SLOTS - 1) / SLOTS;
+	Chunk* run = NewChunks(count, true);
+	run->live = n;
+	run->chunks = count;
+	return run;
+}
+
+void* NodePool::RunSlot(void* run, size_t i)
+{
+	return Slot((Chunk*)((char*)run + i / SLOTS * CHUNK_BYTES), i % SLOTS);
+}
+
+void NodePool::Release(void* p)
+{
+	Chunk* run = ChunkOf(p)->run;
+	if (run != NULL)
+	{
+		if (--run->live == 0)
+		{
+			FreeChunks(run, run->chunks);
+		}
+		return;
+	}
+	FreeNode* nd = (FreeNode*)p;
+	nd->next = local.head;
+	local.head = nd;
+	local.count++;
+	if (local.count >= 2 * BATCH + SLOTS)
+	{
+		// a thread that mostly frees (e.g. one clearing trees built
+		// elsewhere) passes nodes on rather than hoarding them
+		FreeNode* tail;
+		FreeNode* surplus = Detach(local.head, local.count - BATCH, tail);
+		lock_guard<mutex> guard(sharedLock);
+		tail->next = sharedFree;
+		sharedFree = surplus;
+		sharedCount += local.count - BATCH;
+		local.count = BATCH;
+	}
+}
+
+size_t NodePool::Trim()
+{
+	lock_guard<mutex> guard(sharedLock);
+	if ((local.count + sharedCount) * sizeof(Node) <= TRIM_BYTES)
+	{
+		return 0;
+	}
+	// the calling thread's nodes join the shared list, so that the chunks
+	// of a tree it has just freed are seen whole
+	if (local.head != NULL)
+	{
+		FreeNode* tail;
+		FreeNode* all = Detach(local.head, local.count, tail);
+		tail->next = sharedFree;
+		sharedFree = all;
+		sharedCount += local.count;
+		local.count = 0;
+	}
+
+	for (FreeNode* nd = sharedFree; nd != NULL; nd = nd->next)
+	{
+		ChunkOf(nd)->free++;
+	}
+	// unlinks the nodes of chunks found all free (marked SLOTS + 1 once
+	// collected), and resets the count of every other chunk
+	vector<Chunk*> empty;
+	FreeNode** link = &sharedFree;
+	while (*link != NULL)
+	{
+		Chunk* chunk = ChunkOf(*link);
+		if (chunk->free < SLOTS)
+		{
+			chunk->free = 0;
+			link = &(*link)->next;
+			continue;
+		}
+		if (chunk->free == SLOTS)
+		{
+			empty.push_back(chunk);
+			chunk->free = SLOTS + 1;
+		}
+		*link = (*link)->next;
+		sharedCount--;
+	}
+	for (size_t i = 0; i < empty.size(); i++)
+	{
+		FreeChunks(empty[i], 1);
+	}
+	return empty.size() * CHUNK_BYTES;
+}
+
+NodePoolStats NodePool::Stats()
+{
+	NodePoolStats stats;
+	stats.chunks = chunks;
+	stats.reservedBytes = reserved;
+	return stats;
+}
+
+void* Node::operator new(size_t size)
+{
+	return size == sizeof(Node) ? NodePool::Allocate() : ::operator new(size);
+}
+
+void Node::operator delete(void* p, size_t size)
+{
+	if (p == NULL)
+	{
+		return;
+	}
+	if (size == sizeof(Node))
+	{
+		NodePool::Release(p);
+	}
+	else
+	{
+		::operator delete(p);
+	}
+}
@@ -0,0 +1,87 @@
+/**
+ * @file nodepool.h
+ * @description pooled allocation of QTree nodes, with a free list per
+ *              thread so that building and freeing trees rarely touches
+ *              the global heap
+ */
+
+#ifndef _NODEPOOL_H_
+#define _NODEPOOL_H_
+
+#include <cstddef>
+
+/**
+ * Memory held by the node pool.
+ */
+struct NodePoolStats {
+    size_t chunks;        // chunks and runs held now
+    size_t reservedBytes; // bytes in those chunks and runs
+};
+
+/**
+ * NodePool: storage for every Node (Node's operator new and delete come
+ * here). Nodes are carved from chunks of CHUNK_BYTES and recycled
+ * through a free list owned by the current thread; threads that free
+ * more than they allocate hand surplus nodes back to a shared list, from
+ * which allocating threads refill in batches. Chunks are kept while
+ * the free nodes are few (up to TRIM_BYTES), so a workload that builds
+ * and frees many trees (see CompressBatch) reuses the same memory
+ * throughout, while freeing one large tree gives most of it back to the
+ * heap (see Trim).
+ *
+ * Chunks are aligned to their size, and their first node slot holds a
+ * header, so the chunk of any node is found from its address. Runs
+ * (AllocateRun) are made of such chunks too; their nodes are not
+ * recycled, and a run goes back to the heap when its last node is freed.
+ */
+class NodePool {
+public:
+    static const size_t CHUNK_BYTES = 1 << 19;
+    static const size_t TRIM_BYTES = 1 << 26; // free nodes kept before Trim does anything
+
+    /**
+     * Memory for one node; never returns null (throws bad_alloc instead,
+     * like operator new).
+     */
+    static void* Allocate();
+
+    /**
+     * Memory for n nodes, in order, from chunks of their own: contiguous
+     * but for a header slot every CHUNK_BYTES. Each node may later be
+     * given to Release on its own; the run is freed with the last of
+     * them, so every slot must be used. Used to place a tree's nodes in
+     * a chosen order (see QTree::Relayout).
+     * @pre n > 0
+     * @return the run, whose slots RunSlot gives
+     */
+    static void* AllocateRun(size_t n);
+
+    /**
+     * Slot i of a run from AllocateRun.
+     * @pre i < the run's n
+     */
+    static void* RunSlot(void* run, size_t i);
+
+    /**
+     * Returns a node's memory to the calling thread's free list, or to
+     * its run.
+     * @param p memory from Allocate or AllocateRun, on any thread
+     */
+    static void Release(void* p);
+
+    /**
+     * Gives every chunk whose nodes are all free back to the heap, once
+     * the free nodes of the calling thread and the shared list come to
+     * more than TRIM_BYTES; does nothing below that. QTree::Clear calls
+     * it. Chunks with nodes on other threads' free lists are kept.
+     * @return bytes given back
+     */
+    static size_t Trim();
+
+    /**
+     * Memory reserved now, across all threads.
+     */
+    static NodePoolStats Stats();
+};
+
+#endif
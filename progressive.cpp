@@ -0,0 +1,589 @@
+/**
+ * @file progressive.cpp
+ * @description level-ordered (coarse-to-fine) encoding of a QTree, and an
+ *              incremental decoder that can render any prefix of the stream
+ */
+
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+#include "progressive.h"
+#include "qtree-traversal.h"
+#include "spill.h"
+#include "trace.h"
+
+namespace
+{
+	const unsigned char MAGIC[3] = {'Q', 'T', 'P'};
+	const unsigned char VERSION = 4;
+	const unsigned char BLOCK = 0x10;    // mask bit of a block leaf
+	const unsigned char GRADIENT = 0x20; // mask bit of a gradient leaf
+
+	// Signed values as zigzag varints: small magnitudes stay short.
+	void PutSigned(vector<unsigned char>& out, long long v)
+	{
+		PutVarint(out, ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63));
+	}
+
+	bool GetSigned(const vector<unsigned char>& in, size_t& pos, long long& v, bool& malformed)
+	{
+		unsigned long long u;
+		if (!GetVarint(in, pos, u, malformed))
+		{
+			return false;
+		}
+		v = (long long)(u >> 1) ^ -(long long)(u & 1);
+		return true;
+	}
+
+	bool SameColor(const RGBAPixel& p, const RGBAPixel& q)
+	{
+		return p.r == q.r && p.g == q.g && p.b == q.b && p.a == q.a;
+	}
+
+	// RGBA8 as written to the stream
+	unsigned int PackColor(const RGBAPixel& p)
+	{
+		return p.r | (p.g << 8) | (p.b << 16) | ((unsigned int)lround(p.a * 255) << 24);
+	}
+
+	// Fallback for a leaf whose color is not in the palette.
+	unsigned char NearestEntry(const vector<RGBAPixel>& palette, const RGBAPixel& p)
+	{
+		size_t best = 0;
+		int bestDistance = -1;
+		for (size_t i = 0; i < palette.size(); i++)
+		{
+			int d = SquaredRGBDistance::Distance(palette[i], p);
+			if (bestDistance < 0 || d < bestDistance)
+			{
+				best = i;
+				bestDistance = d;
+			}
+		}
+		return (unsigned char)best;
+	}
+}
+
+void PutVarint(vector<unsigned char>& out, unsigned long long v)
+{
+	while (v >= 0x80)
+	{
+		out.push_back((unsigned char)(v | 0x80));
+		v >>= 7;
+	}
+	out.push_back((unsigned char)v);
+}
+
+bool GetVarint(const vector<unsigned char>& in, size_t& pos, unsigned long long& v)
+{
+	bool malformed = false;
+	return GetVarint(in, pos, v, malformed);
+}
+
+bool GetVarint(const vector<unsigned char>& in, size_t& pos, unsigned long long& v, bool& malformed)
+{
+	v = 0;
+	for (unsigned int shift = 0;; shift += 7)
+	{
+		if (pos >= in.size())
+		{
+			return false;
+		}
+		unsigned char byte = in[pos++];
+		// the tenth byte holds bit 63 alone and ends the varint
+		if (shift == 63 && byte > 1)
+		{
+			malformed = true;
+			return false;
+		}
+		v |= (unsigned long long)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0)
+		{
+			return true;
+		}
+	}
+}
+
+void EncodeSubtree(const Node* subroot, vector<unsigned char>& out, const vector<RGBAPixel>& palette)
+{
+	unordered_map<unsigned int, unsigned char> indices;
+	for (size_t i = 0; i < palette.size(); i++)
+	{
+		indices[PackColor(palette[i])] = (unsigned char)i;
+	}
+
+	LevelOrder(subroot, [&out, &palette, &indices](const Node* nd) {
+		unsigned char mask = (nd->NW != NULL ? 1 : 0) | (nd->NE != NULL ? 2 : 0) |
+							 (nd->SW != NULL ? 4 : 0) | (nd->SE != NULL ? 8 : 0);
+		out.push_back(nd->block != NULL ? BLOCK : (nd->gradient != NULL ? GRADIENT : mask));
+
+		if (nd->block != NULL)
+		{
+			out.push_back(nd->avg.r);
+			out.push_back(nd->avg.g);
+			out.push_back(nd->avg.b);
+			out.push_back((unsigned char)lround(nd->avg.a * 255));
+			for (size_t i = 0; i < BlockBytes(nd); i += 4)
+			{
+				const unsigned char* p = nd->block + i;
+				if (palette.empty())
+				{
+					out.insert(out.end(), p, p + 4);
+					continue;
+				}
+				unordered_map<unsigned int, unsigned char>::const_iterator it = indices.find(PackColor(BlockPixel(p)));
+				out.push_back(it != indices.end() ? it->second : NearestEntry(palette, BlockPixel(p)));
+			}
+			return;
+		}
+
+		if (nd->gradient != NULL)
+		{
+			out.push_back(nd->avg.r);
+			out.push_back(nd->avg.g);
+			out.push_back(nd->avg.b);
+			out.push_back((unsigned char)lround(nd->avg.a * 255));
+			for (unsigned int i = 0; i < GRADIENT_TERMS; i++)
+			{
+				PutSigned(out, nd->gradient[i]);
+			}
+			return;
+		}
+
+		if (mask != 0)
+		{
+			PutVarint(out, WestWidth(nd));
+			PutVarint(out, NorthHeight(nd));
+		}
+
+		if (mask == 0 && !palette.empty())
+		{
+			unordered_map<unsigned int, unsigned char>::const_iterator it = indices.find(PackColor(nd->avg));
+			out.push_back(it != indices.end() ? it->second : NearestEntry(palette, nd->avg));
+			return;
+		}
+		out.push_back(nd->avg.r);
+		out.push_back(nd->avg.g);
+		out.push_back(nd->avg.b);
+		out.push_back((unsigned char)lround(nd->avg.a * 255));
+	});
+}
+
+/**
+ * Encodes the tree in level order: a coarse approximation is available
+ * as soon as the first few records arrive, and every further record
+ * refines a single rectangle of the image.
+ *
+ * @param out byte buffer to append the encoding to
+ */
+void QTree::EncodeProgressive(vector<unsigned char>& out) const
+{
+	TRACE_SCOPE("QTree::EncodeProgressive");
+	out.insert(out.end(), MAGIC, MAGIC + 3);
+	out.push_back(VERSION);
+	PutVarint(out, width);
+	PutVarint(out, height);
+	PutVarint(out, palette.size());
+	for (size_t i = 0; i < palette.size(); i++)
+	{
+		unsigned int color = PackColor(palette[i]);
+		out.push_back(color & 0xff);
+		out.push_back((color >> 8) & 0xff);
+		out.push_back((color >> 16) & 0xff);
+		out.push_back(color >> 24);
+	}
+	if (spill != NULL)
+	{
+		// spilled subtrees are read back into a temporary copy
+		Node* full = CopySpilledNode(root);
+		EncodeSubtree(full, out, palette);
+		DeleteSubtree(full);
+		return;
+	}
+	EncodeSubtree(root, out, palette);
+}
+
+/**
+ * Constructor that rebuilds a QTree from a (possibly truncated) level-ordered
+ * encoding. Parts of the image whose records are missing take the color
+ * of their nearest decoded ancestor.
+ *
+ * @param encoded stream produced by EncodeProgressive
+ */
+QTree::QTree(const vector<unsigned char>& encoded, DecodeResult* result) : QTree(encoded.data(), encoded.size(), result)
+{
+}
+
+QTree::QTree(const unsigned char* data, size_t length, DecodeResult* result)
+{
+	// no canvas: the tree is all that is kept, and a canvas of a
+	// gigapixel image would not fit in memory
+	ProgressiveDecoder decoder(false);
+	bool wellFormed = decoder.Feed(data, length);
+	shared = false;
+	spill = NULL;
+	Touch();
+	if (result != NULL)
+	{
+		*result = !wellFormed ? DECODE_MALFORMED : (decoder.Done() ? DECODE_COMPLETE : DECODE_TRUNCATED);
+	}
+	if (!wellFormed)
+	{
+		// what came before the corruption is not worth keeping
+		width = 0;
+		height = 0;
+		root = NULL;
+		return;
+	}
+	width = decoder.Width();
+	height = decoder.Height();
+	palette = decoder.Palette();
+	root = decoder.ReleaseRoot();
+}
+
+ProgressiveDecoder::ProgressiveDecoder(bool paint)
+{
+	headerDone = false;
+	this->paint = paint;
+	width = 0;
+	height = 0;
+	root = NULL;
+	pendingPos = 0;
+	decoded = 0;
+	malformed = false;
+}
+
+ProgressiveDecoder::ProgressiveDecoder(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, const vector<RGBAPixel>& palette)
+{
+	this->palette = palette;
+	headerDone = true;
+	paint = false;
+	width = lr.first - ul.first + 1;
+	height = lr.second - ul.second + 1;
+	root = new Node(ul, lr, RGBAPixel());
+	frontier.push_back(root);
+	pendingPos = 0;
+	decoded = 0;
+	malformed = false;
+}
+
+ProgressiveDecoder::~ProgressiveDecoder()
+{
+	PostOrder(root, [](Node* nd) { delete nd; });
+}
+
+bool ProgressiveDecoder::Feed(const unsigned char* data, size_t len)
+{
+	if (malformed)
+	{
+		return false;
+	}
+
+	// drop the consumed prefix before it dominates the buffer
+	if (pendingPos > 0 && pendingPos >= pending.size() / 2)
+	{
+		pending.erase(pending.begin(), pending.begin() + pendingPos);
+		pendingPos = 0;
+	}
+	pending.insert(pending.end(), data, data + len);
+
+	if (!headerDone)
+	{
+		size_t pos = pendingPos;
+		if (pending.size() - pos < 4)
+		{
+			return true;
+		}
+		unsigned char version = pending[pos + 3];
+		if (pending[pos] != MAGIC[0] || pending[pos + 1] != MAGIC[1] || pending[pos + 2] != MAGIC[2] || version < 1 || version > VERSION)
+		{
+			malformed = true;
+			return false;
+		}
+		pos += 4;
+		unsigned long long w, h, entries = 0;
+		if (!GetVarint(pending, pos, w, malformed) || !GetVarint(pending, pos, h, malformed) ||
+			(version >= 2 && !GetVarint(pending, pos, entries, malformed)))
+		{
+			return !malformed;
+		}
+		if (w == 0 || h == 0 || w > 0xffffffffULL || h > 0xffffffffULL || entries > 256)
+		{
+			malformed = true;
+			return false;
+		}
+		if (pending.size() - pos < entries * 4)
+		{
+			return true;
+		}
+		for (unsigned int i = 0; i < entries; i++, pos += 4)
+		{
+			palette.push_back(RGBAPixel(pending[pos], pending[pos + 1], pending[pos + 2], pending[pos + 3] / 255.0));
+		}
+		width = (unsigned int)w;
+		height = (unsigned int)h;
+		root = new Node(make_pair(0u, 0u), make_pair(width - 1, height - 1), RGBAPixel());
+		frontier.push_back(root);
+		if (paint)
+		{
+			canvas = PNG(width, height);
+		}
+		headerDone = true;
+		pendingPos = pos;
+	}
+
+	while (!frontier.empty() && DecodeRecord(pendingPos))
+	{
+	}
+	return !malformed;
+}
+
+bool ProgressiveDecoder::DecodeRecord(size_t& pos)
+{
+	size_t p = pos;
+	if (p >= pending.size())
+	{
+		return false;
+	}
+	unsigned char mask = pending[p++];
+	if (mask > 0x0f && mask != BLOCK && mask != GRADIENT)
+	{
+		malformed = true;
+		return false;
+	}
+
+	Node* nd = frontier.front();
+	unsigned int nodeWidth = nd->lowRight.first - nd->upLeft.first + 1;
+	unsigned int nodeHeight = nd->lowRight.second - nd->upLeft.second + 1;
+	unsigned long long westWidth = 0, northHeight = 0;
+	if (mask != 0 && mask != BLOCK && mask != GRADIENT)
+	{
+		if (!GetVarint(pending, p, westWidth, malformed) || !GetVarint(pending, p, northHeight, malformed))
+		{
+			return false;
+		}
+		// every present child must get a nonempty rectangle
+		bool westOk = westWidth > 0, eastOk = westWidth < nodeWidth;
+		bool northOk = northHeight > 0, southOk = northHeight < nodeHeight;
+		if (westWidth > nodeWidth || northHeight > nodeHeight ||
+			((mask & 1) && !(westOk && northOk)) || ((mask & 2) && !(eastOk && northOk)) ||
+			((mask & 4) && !(westOk && southOk)) || ((mask & 8) && !(eastOk && southOk)))
+		{
+			malformed = true;
+			return false;
+		}
+	}
+	RGBAPixel color;
+	if (mask == BLOCK)
+	{
+		size_t pixelBytes = palette.empty() ? 4 : 1;
+		size_t count = (size_t)nodeWidth * nodeHeight;
+		if (pending.size() - p < 4 || (pending.size() - p - 4) / pixelBytes < count)
+		{
+			return false;
+		}
+		color = RGBAPixel(pending[p], pending[p + 1], pending[p + 2], pending[p + 3] / 255.0);
+		p += 4;
+		unsigned char* block = new unsigned char[count * 4];
+		for (size_t i = 0; i < count; i++)
+		{
+			if (palette.empty())
+			{
+				memcpy(block + i * 4, &pending[p], 4);
+				p += 4;
+			}
+			else if (pending[p] >= palette.size())
+			{
+				delete[] block;
+				malformed = true;
+				return false;
+			}
+			else
+			{
+				PackBlockPixel(palette[pending[p++]], block + i * 4);
+			}
+		}
+		delete[] nd->block;
+		nd->block = block;
+	}
+	else if (mask == GRADIENT)
+	{
+		if (pending.size() - p < 4)
+		{
+			return false;
+		}
+		color = RGBAPixel(pending[p], pending[p + 1], pending[p + 2], pending[p + 3] / 255.0);
+		p += 4;
+		int terms[GRADIENT_TERMS];
+		for (unsigned int i = 0; i < GRADIENT_TERMS; i++)
+		{
+			long long v;
+			if (!GetSigned(pending, p, v, malformed))
+			{
+				return false;
+			}
+			if (v < -0x7fffffffLL || v > 0x7fffffffLL)
+			{
+				malformed = true;
+				return false;
+			}
+			terms[i] = (int)v;
+		}
+		delete[] nd->gradient;
+		nd->gradient = new int[GRADIENT_TERMS];
+		memcpy(nd->gradient, terms, sizeof(terms));
+	}
+	else if (mask == 0 && !palette.empty())
+	{
+		if (p >= pending.size())
+		{
+			return false;
+		}
+		if (pending[p] >= palette.size())
+		{
+			malformed = true;
+			return false;
+		}
+		color = palette[pending[p++]];
+	}
+	else
+	{
+		if (pending.size() - p < 4)
+		{
+			return false;
+		}
+		color = RGBAPixel(pending[p], pending[p + 1], pending[p + 2], pending[p + 3] / 255.0);
+		p += 4;
+	}
+
+	// the record is complete; commit it
+	frontier.pop_front();
+	pos = p;
+	decoded++;
+
+	bool repaint = paint && (!SameColor(color, nd->avg) || nd->block != NULL || nd->gradient != NULL);
+	nd->avg = color;
+
+	if (mask != 0 && mask != BLOCK && mask != GRADIENT)
+	{
+		unsigned int x0 = nd->upLeft.first, y0 = nd->upLeft.second;
+		unsigned int x1 = nd->lowRight.first, y1 = nd->lowRight.second;
+		unsigned int xs = x0 + (unsigned int)westWidth;  // first column of the eastern half
+		unsigned int ys = y0 + (unsigned int)northHeight; // first row of the southern half
+		Node** slots[4] = {&nd->NW, &nd->NE, &nd->SW, &nd->SE};
+		pair<unsigned int, unsigned int> uls[4] = {make_pair(x0, y0), make_pair(xs, y0), make_pair(x0, ys), make_pair(xs, ys)};
+		pair<unsigned int, unsigned int> lrs[4] = {make_pair(xs - 1, ys - 1), make_pair(x1, ys - 1), make_pair(xs - 1, y1), make_pair(x1, y1)};
+		for (int i = 0; i < 4; i++)
+		{
+			if (mask & (1 << i))
+			{
+				*slots[i] = new Node(uls[i], lrs[i], color);
+				frontier.push_back(*slots[i]);
+			}
+		}
+	}
+
+	if (repaint)
+	{
+		PaintRect(nd);
+	}
+	return true;
+}
+
+void ProgressiveDecoder::PaintRect(const Node* nd)
+{
+	const unsigned char* block = nd->block;
+	for (unsigned int y = nd->upLeft.second; y <= nd->lowRight.second; y++)
+	{
+		RGBAPixel* row = canvas.getPixel(0, y);
+		for (unsigned int x = nd->upLeft.first; x <= nd->lowRight.first; x++)
+		{
+			if (block != NULL)
+			{
+				row[x] = BlockPixel(block);
+				block += 4;
+			}
+			else if (nd->gradient != NULL)
+			{
+				row[x] = GradientPixel(nd->gradient, x - nd->upLeft.first, y - nd->upLeft.second);
+			}
+			else
+			{
+				row[x] = nd->avg;
+			}
+		}
+	}
+}
+
+bool ProgressiveDecoder::Done() const
+{
+	return headerDone && frontier.empty();
+}
+
+bool ProgressiveDecoder::Malformed() const
+{
+	return malformed;
+}
+
+size_t ProgressiveDecoder::NodesDecoded() const
+{
+	return decoded;
+}
+
+const PNG& ProgressiveDecoder::Canvas() const
+{
+	return canvas;
+}
+
+PNG ProgressiveDecoder::Render(unsigned int scale) const
+{
+	PNG output(width * scale, height * scale);
+	ForEachLeaf(root, [&output, scale](const Node* leaf) {
+		unsigned int w = leaf->lowRight.first - leaf->upLeft.first + 1;
+		for (unsigned int y = leaf->upLeft.second * scale; y < (leaf->lowRight.second + 1) * scale; y++)
+		{
+			RGBAPixel* row = output.getPixel(0, y);
+			for (unsigned int x = leaf->upLeft.first * scale; x < (leaf->lowRight.first + 1) * scale; x++)
+			{
+				if (leaf->block != NULL)
+				{
+					size_t at = (size_t)(y / scale - leaf->upLeft.second) * w + (x / scale - leaf->upLeft.first);
+					row[x] = BlockPixel(leaf->block + at * 4);
+				}
+				else if (leaf->gradient != NULL)
+				{
+					row[x] = GradientPixel(leaf->gradient, x / scale - leaf->upLeft.first, y / scale - leaf->upLeft.second);
+				}
+				else
+				{
+					row[x] = leaf->avg;
+				}
+			}
+		}
+	});
+	return output;
+}
+
+Node* ProgressiveDecoder::ReleaseRoot()
+{
+	Node* released = root;
+	root = NULL;
+	frontier.clear();
+	return released;
+}
+
+unsigned int ProgressiveDecoder::Width() const
+{
+	return width;
+}
+
+unsigned int ProgressiveDecoder::Height() const
+{
+	return height;
+}
+
+const vector<RGBAPixel>& ProgressiveDecoder::Palette() const
+{
+	return palette;
+}
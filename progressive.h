@@ -0,0 +1,185 @@
+/**
+ * @file progressive.h
+ * @description level-ordered (coarse-to-fine) encoding of a QTree, and an
+ *              incremental decoder that can render any prefix of the stream
+ */
+
+#ifndef _PROGRESSIVE_H_
+#define _PROGRESSIVE_H_
+
+#include <deque>
+#include <vector>
+#include "qtree.h"
+
+/**
+ * Stream layout (all integers are LEB128 varints):
+ *
+ *   'Q' 'T' 'P' version | width | height | paletteSize | palette | node record*
+ *
+ * paletteSize is the number of RGBA entries (4 bytes each) in the palette
+ * that follows; it is 0 unless the tree was quantized. Version 1 streams
+ * have neither field.
+ *
+ * Node records appear in breadth-first order, root first, and children in
+ * NW, NE, SW, SE order. Each record is
+ *
+ *   mask | [westWidth northHeight] | r g b a     (or a palette index)
+ *        | [block | gradient]
+ *
+ * where the low four bits of mask flag which of NW/NE/SW/SE are present.
+ * Bit 4 of mask (version 3) marks a block leaf: its color is followed by
+ * the block's pixels, row-major, each as r g b a (or a palette index).
+ * Bit 5 of mask (version 4) marks a gradient leaf: its color is followed
+ * by the 12 values of Node::gradient as zigzag-encoded signed varints.
+ * westWidth and northHeight (only present when mask is nonzero) give the
+ * size of the western column and northern row of the node's rectangle, so
+ * the children's rectangles can be reconstructed from the parent alone.
+ * Alpha is stored as a byte, at the same precision PNG::writeToFile uses.
+ * When the stream has a palette, leaf records (mask 0) carry a one-byte
+ * palette index in place of the color; block leaves keep their full
+ * average color.
+ */
+
+/**
+ * Appends v to out as a LEB128 varint, the integer format of the stream.
+ */
+void PutVarint(vector<unsigned char>& out, unsigned long long v);
+
+/**
+ * Reads a varint at pos, advancing pos past it.
+ * @return false if the buffer ends before the varint does, or if the
+ *         varint runs past 64 bits
+ */
+bool GetVarint(const vector<unsigned char>& in, size_t& pos, unsigned long long& v);
+
+/**
+ * As above, telling the two failures apart for a caller that may yet
+ * receive more bytes.
+ * @param malformed set if the varint runs past 64 bits, which no further
+ *                  bytes can mend; left alone otherwise
+ */
+bool GetVarint(const vector<unsigned char>& in, size_t& pos, unsigned long long& v, bool& malformed);
+
+/**
+ * Appends the level-ordered encoding of the subtree rooted at subroot to out.
+ * Only the node records are written; the caller is responsible for any
+ * header describing the subtree's rectangle and palette.
+ *
+ * @param subroot root of the subtree to encode; may not be null
+ * @param out byte buffer to append to
+ * @param palette if nonempty, leaves are written as indices into it
+ */
+void EncodeSubtree(const Node* subroot, vector<unsigned char>& out, const vector<RGBAPixel>& palette);
+
+/**
+ * ProgressiveDecoder: rebuilds a QTree from a level-ordered stream that
+ * arrives in arbitrary chunks.
+ *
+ * Whenever a node record arrives, placeholder children are created for it
+ * carrying the node's own average color. The partially decoded tree is
+ * therefore always a complete tree covering the whole image, and rendering
+ * it at any point gives the best approximation the received prefix allows.
+ * Each record costs O(1) tree work, so a refinement step costs time
+ * proportional to the bytes it delivers, plus repainting the refined
+ * rectangles of the incremental canvas.
+ */
+class ProgressiveDecoder {
+public:
+    /**
+     * Creates a decoder expecting a full stream, header included.
+     *
+     * @param paint whether to maintain the canvas; without it, decoding
+     *              takes memory for the tree alone, not for every pixel
+     */
+    ProgressiveDecoder(bool paint = true);
+
+    /**
+     * Creates a decoder for a bare run of node records (as produced by
+     * EncodeSubtree) whose root covers the given rectangle.
+     * No canvas is maintained for subtree decoders.
+     *
+     * @param palette palette the records were encoded with, if any
+     */
+    ProgressiveDecoder(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, const vector<RGBAPixel>& palette);
+
+    ~ProgressiveDecoder();
+
+    /**
+     * Consumes the next chunk of the stream. Records split across chunks
+     * are buffered until they are complete, so a stream that merely ends
+     * early is not an error.
+     *
+     * @return false if the stream is malformed, now or in an earlier
+     *         chunk; the records before the corruption stay decoded, and
+     *         nothing after it is read
+     */
+    bool Feed(const unsigned char* data, size_t len);
+
+    /**
+     * True once every node announced by the stream has been decoded.
+     */
+    bool Done() const;
+
+    /**
+     * True once Feed has found the stream malformed.
+     */
+    bool Malformed() const;
+
+    /**
+     * Number of node records decoded so far.
+     */
+    size_t NodesDecoded() const;
+
+    /**
+     * Image at scale 1 reflecting everything decoded so far. Only the
+     * rectangles touched by new records are repainted on each Feed.
+     * Empty until the header has arrived, or if the decoder does not paint.
+     */
+    const PNG& Canvas() const;
+
+    /**
+     * Renders the current approximation at the given scale.
+     * @pre the root record has been decoded
+     */
+    PNG Render(unsigned int scale) const;
+
+    /**
+     * Hands ownership of the decoded tree to the caller; the decoder
+     * is left empty. Returns null if no root has been decoded.
+     */
+    Node* ReleaseRoot();
+
+    unsigned int Width() const;
+    unsigned int Height() const;
+
+    /**
+     * Palette of the stream; empty if it has none.
+     */
+    const vector<RGBAPixel>& Palette() const;
+
+private:
+    bool headerDone;         // whether width/height are known
+    bool paint;              // whether the canvas is maintained
+    unsigned int width;
+    unsigned int height;
+    Node* root;
+    vector<RGBAPixel> palette;
+    deque<Node*> frontier;   // placeholders awaiting their records, in stream order
+    vector<unsigned char> pending; // bytes not yet consumed
+    size_t pendingPos;
+    size_t decoded;
+    bool malformed;          // whether a corrupt header or record was found
+    PNG canvas;
+
+    // Parses one record into the next frontier node; false if incomplete
+    // or malformed.
+    bool DecodeRecord(size_t& pos);
+
+    // Paints a leaf's rectangle of the canvas: its color, block or gradient.
+    void PaintRect(const Node* nd);
+
+    ProgressiveDecoder(const ProgressiveDecoder& other);
+    ProgressiveDecoder& operator=(const ProgressiveDecoder& other);
+};
+
+#endif
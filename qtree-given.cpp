@@ -7,6 +7,8 @@
  */
 
 #include "qtree.h"
+#include "qtree-traversal.h"
+#include "spill.h"
 
  /**
   * Node constructor.
@@ -21,6 +23,16 @@ Node::Node(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int>
 	NE = nullptr;
 	SW = nullptr;
 	SE = nullptr;
+	block = nullptr;
+	gradient = nullptr;
+}
+
+/**
+ * Node destructor. Children are not freed; that is up to the tree.
+ */
+Node::~Node() {
+	delete[] block;
+	delete[] gradient;
 }
 
 /**
@@ -48,39 +60,29 @@ QTree::QTree(const QTree& other) {
 /**
  * Counts the number of nodes in the tree
  */
-unsigned int QTree::CountNodes() const {
-	return CountNodes(root);
+size_t QTree::CountNodes() const {
+	return CountNodes(root) + (spill != NULL ? spill->HiddenNodes() : 0);
 }
 
 /**
  * Counts the number of leaves in the tree
  */
-unsigned int QTree::CountLeaves() const {
-	return CountLeaves(root);
+size_t QTree::CountLeaves() const {
+	return CountLeaves(root) + (spill != NULL ? spill->HiddenLeaves() : 0);
 }
 
 /**
  * Private helper function for counting the total number of nodes in the tree. GIVEN
  * @param nd the root of the subtree whose nodes we want to count
  */
-unsigned int QTree::CountNodes(Node* nd) const {
-	if (nd == nullptr)
-		return 0;
-	else
-		return 1 + CountNodes(nd->NW) + CountNodes(nd->NE) + CountNodes(nd->SW) + CountNodes(nd->SE);
+size_t QTree::CountNodes(Node* nd) const {
+	return ParallelReduce(nd, (size_t)0, [](Node*) { return (size_t)1; }, plus<size_t>(), false);
 }
 
 /**
  * Private helper function for counting the number of leaves in the tree. GIVEN
  * @param nd the root of the subtree whose leaves we want to count
  */
-unsigned int QTree::CountLeaves(Node* nd) const {
-	if (nd == nullptr)
-		return 0;
-	else {
-		if (nd->NW == nullptr && nd->NE == nullptr && nd->SW == nullptr && nd->SE == nullptr)
-			return 1;
-		else
-			return CountLeaves(nd->NW) + CountLeaves(nd->NE) + CountLeaves(nd->SW) + CountLeaves(nd->SE);
-	}
-}
\ No newline at end of file
+size_t QTree::CountLeaves(Node* nd) const {
+	return ParallelReduce(nd, (size_t)0, [](Node*) { return (size_t)1; }, plus<size_t>(), true);
+}
@@ -0,0 +1,85 @@
+/**
+ * @file qtree-private.h
+ * @description student declaration of private QTree functions
+ *              CPSC 221 PA3
+ *
+ *              SUBMIT THIS FILE.
+ *
+ *				Simply declare your function prototypes here.
+ *              No other scaffolding is necessary.
+ */
+
+ // begin your declarations below
+
+RGBAPixel calculateAvg(Node* NW, Node* NE, Node* SW, Node* SE);
+
+template <class Canvas>
+void RenderAll(const Canvas& canvas, unsigned int scale) const;
+
+template <class Canvas>
+void RenderNode(const Canvas& canvas, Node* subroot, unsigned int scale) const;
+
+template <class Canvas>
+void RenderRegionNode(const Canvas& canvas, Node* subroot, pair<unsigned int, unsigned int> origin, unsigned int scale, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) const;
+
+void ClearNode(Node* subroot);
+
+Node* CopyNode(Node* toCopy);
+
+void FlipHorizontalNode(Node* subroot);
+
+template <class Metric>
+bool PruneNode(Node* subroot, typename Metric::value_type tol); // whether the tree changed
+
+template <class Metric>
+void ParallelPruneNode(Node* subroot, typename Metric::value_type tol, unsigned int cutoff, TaskGroup& work,
+                       atomic<bool>& changed);
+
+template <class Metric>
+bool toleranceLeaves(const Node* subroot, const RGBAPixel& avg, typename Metric::value_type tol, bool& found) const;
+
+void RotateCCWNode(Node* subroot, int node_width);
+
+vector<RGBAPixel> palette; // leaf colors after Quantize; empty otherwise
+
+bool shared; // whether subtrees may be shared (see Deduplicate)
+
+void Unshare();
+
+Node* ExpandNode(const Node* subroot, pair<unsigned int, unsigned int> ul);
+
+void ClearSharedNode(Node* subroot);
+
+Node* CopySharedNode(Node* subroot, unordered_map<Node*, Node*>& copies);
+
+Node* UpdateFrameNode(Node* subroot, const RawImage& frame, const TileDiff& changed, const BuildOptions& options, double tolerance,
+                      vector<unsigned char>& path, vector<unsigned char>& records, unsigned int& rebuilt);
+
+Node* BuildRegion(const RawImage& frame, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+                  const BuildOptions& options, double tolerance);
+
+unsigned long long generation; // see Generation()
+
+void Touch(); // gives the tree a new generation
+
+SpillStore* spill; // spilled subtrees; null without a memory budget (see SetMemoryBudget)
+
+friend class SpillGuard;
+
+bool Unspill(); // false if a spilled subtree could not be read back
+
+void SpillToBudget();
+
+Node* LoadSpilled(const Node* nd) const;
+
+bool IsSpilled(const Node* nd) const;
+
+void FaultIn(Node* nd);
+
+void Respill(Node* unit);
+
+void ForgetSpilled(Node* subroot);
+
+void ForEachSpilled(const function<void(Node*)>& op);
+
+Node* CopySpilledNode(const Node* nd) const;
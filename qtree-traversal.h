@@ -0,0 +1,381 @@
+/**
+ * @file qtree-traversal.h
+ * @description generic traversals over QTree nodes, serial and parallel,
+ *              shared by the QTree operations
+ *
+ * Visitors are called with a Node* (or a const Node* for the serial
+ * traversals started from a const node). Children are read after a node is
+ * visited in pre-order, so a pre-order visitor may rewrite or replace a
+ * node's children (they are then traversed in their new form).
+ *
+ * The parallel variants split the tree into a frontier of independent
+ * subtrees, handle the nodes above the frontier on the calling thread,
+ * and run the subtrees as tasks on a ThreadPool. Visitors given to them
+ * must be safe to call concurrently on disjoint subtrees.
+ */
+
+#ifndef _QTREE_TRAVERSAL_H_
+#define _QTREE_TRAVERSAL_H_
+
+#include <cstring>
+#include <deque>
+#include <vector>
+#include "qtree.h"
+#include "threadpool.h"
+
+/**
+ * Whether a node has no children.
+ */
+inline bool IsLeaf(const Node* nd)
+{
+    return nd->NW == NULL && nd->NE == NULL && nd->SW == NULL && nd->SE == NULL;
+}
+
+/**
+ * Packs a pixel into a block leaf's RGBA8 layout.
+ */
+inline void PackBlockPixel(const RGBAPixel& p, unsigned char* out)
+{
+    out[0] = p.r;
+    out[1] = p.g;
+    out[2] = p.b;
+    out[3] = (unsigned char)(p.a * 255 + 0.5);
+}
+
+/**
+ * Unpacks a pixel of a block leaf.
+ */
+inline RGBAPixel BlockPixel(const unsigned char* p)
+{
+    return RGBAPixel(p[0], p[1], p[2], p[3] / 255.0);
+}
+
+/**
+ * Bytes in the block of a block leaf with nd's rectangle.
+ */
+inline size_t BlockBytes(const Node* nd)
+{
+    return (size_t)(nd->lowRight.first - nd->upLeft.first + 1) * (nd->lowRight.second - nd->upLeft.second + 1) * 4;
+}
+
+/**
+ * A new copy of nd's block, or null if it has none.
+ */
+inline unsigned char* CopyBlock(const Node* nd)
+{
+    if (nd->block == NULL)
+    {
+        return NULL;
+    }
+    unsigned char* copy = new unsigned char[BlockBytes(nd)];
+    memcpy(copy, nd->block, BlockBytes(nd));
+    return copy;
+}
+
+/**
+ * Fixed-point layout of Node::gradient: 12 values, 16 fraction bits.
+ */
+const unsigned int GRADIENT_TERMS = 12;
+const int GRADIENT_SHIFT = 16;
+
+/**
+ * A channel byte from a 16.16 gradient value: rounded, clamped to 0..255.
+ */
+inline unsigned char GradientChannel(long long v)
+{
+    v = v < 0 ? 0 : (v > (255LL << GRADIENT_SHIFT) ? 255LL << GRADIENT_SHIFT : v);
+    return (unsigned char)((v + (1 << (GRADIENT_SHIFT - 1))) >> GRADIENT_SHIFT);
+}
+
+/**
+ * Color of a gradient, in Node::gradient's layout, dx columns right of and
+ * dy rows below its corner.
+ */
+inline RGBAPixel GradientPixel(const int* gradient, unsigned int dx, unsigned int dy)
+{
+    unsigned char c[4];
+    for (int k = 0; k < 4; k++)
+    {
+        c[k] = GradientChannel(gradient[k] + (long long)gradient[4 + k] * dx + (long long)gradient[8 + k] * dy);
+    }
+    return RGBAPixel(c[0], c[1], c[2], c[3] / 255.0);
+}
+
+/**
+ * A new copy of nd's gradient, or null if it has none.
+ */
+inline int* CopyGradient(const Node* nd)
+{
+    if (nd->gradient == NULL)
+    {
+        return NULL;
+    }
+    int* copy = new int[GRADIENT_TERMS];
+    memcpy(copy, nd->gradient, GRADIENT_TERMS * sizeof(int));
+    return copy;
+}
+
+/**
+ * Width of the western column of a node's rectangle: the width of NW (or
+ * SW). It is 0 only when the eastern children span the whole rectangle.
+ */
+inline unsigned int WestWidth(const Node* nd)
+{
+    const Node* west = nd->NW != NULL ? nd->NW : nd->SW;
+    return west != NULL ? west->lowRight.first - west->upLeft.first + 1 : 0;
+}
+
+/**
+ * Height of the northern row of a node's rectangle: the height of NW (or
+ * NE). It is 0 only when the southern children span the whole rectangle.
+ */
+inline unsigned int NorthHeight(const Node* nd)
+{
+    const Node* north = nd->NW != NULL ? nd->NW : nd->NE;
+    return north != NULL ? north->lowRight.second - north->upLeft.second + 1 : 0;
+}
+
+/**
+ * Visits every node, parents before children, children in NW/NE/SW/SE order.
+ */
+template <class N, class F>
+void PreOrder(N* nd, F&& visit)
+{
+    if (nd == NULL)
+    {
+        return;
+    }
+    visit(nd);
+    PreOrder(nd->NW, visit);
+    PreOrder(nd->NE, visit);
+    PreOrder(nd->SW, visit);
+    PreOrder(nd->SE, visit);
+}
+
+/**
+ * Visits every node, children before parents. The children pointers are
+ * read before the visit, so the visitor may delete the node.
+ */
+template <class N, class F>
+void PostOrder(N* nd, F&& visit)
+{
+    if (nd == NULL)
+    {
+        return;
+    }
+    PostOrder(nd->NW, visit);
+    PostOrder(nd->NE, visit);
+    PostOrder(nd->SW, visit);
+    PostOrder(nd->SE, visit);
+    visit(nd);
+}
+
+/**
+ * Frees every node of the subtree at nd (which may be null).
+ */
+inline void DeleteSubtree(Node* nd)
+{
+    PostOrder(nd, [](Node* child) { delete child; });
+}
+
+/**
+ * Visits every node breadth-first, level by level.
+ */
+template <class N, class F>
+void LevelOrder(N* nd, F&& visit)
+{
+    deque<N*> queue;
+    if (nd != NULL)
+    {
+        queue.push_back(nd);
+    }
+    while (!queue.empty())
+    {
+        N* cur = queue.front();
+        queue.pop_front();
+        visit(cur);
+        N* children[4] = {cur->NW, cur->NE, cur->SW, cur->SE};
+        for (int i = 0; i < 4; i++)
+        {
+            if (children[i] != NULL)
+            {
+                queue.push_back(children[i]);
+            }
+        }
+    }
+}
+
+/**
+ * Visits every leaf, in NW/NE/SW/SE (pre-order) order.
+ */
+template <class N, class F>
+void ForEachLeaf(N* nd, F&& visit)
+{
+    if (nd == NULL)
+    {
+        return;
+    }
+    if (IsLeaf(nd))
+    {
+        visit(nd);
+        return;
+    }
+    ForEachLeaf(nd->NW, visit);
+    ForEachLeaf(nd->NE, visit);
+    ForEachLeaf(nd->SW, visit);
+    ForEachLeaf(nd->SE, visit);
+}
+
+/**
+ * Whether pred holds for every leaf; stops at the first leaf it fails on.
+ */
+template <class P>
+bool AllLeaves(const Node* nd, P&& pred)
+{
+    if (nd == NULL)
+    {
+        return true;
+    }
+    if (IsLeaf(nd))
+    {
+        return pred(nd);
+    }
+    return AllLeaves(nd->NW, pred) && AllLeaves(nd->NE, pred) &&
+           AllLeaves(nd->SW, pred) && AllLeaves(nd->SE, pred);
+}
+
+/**
+ * Splits the tree under nd breadth-first until there are at least target
+ * subtrees (or nothing left to split). Nodes that were split go to
+ * interior, in level order; the remaining subtree roots go to subtrees.
+ * If expand is true, each interior node is passed to visit before its
+ * children are read, exactly as in a pre-order traversal.
+ */
+template <class F>
+void SplitFrontier(Node* nd, size_t target, vector<Node*>& interior, vector<Node*>& subtrees, F&& visit, bool expand)
+{
+    deque<Node*> queue;
+    if (nd != NULL)
+    {
+        queue.push_back(nd);
+    }
+    while (!queue.empty() && queue.size() < target)
+    {
+        Node* cur = queue.front();
+        queue.pop_front();
+        if (IsLeaf(cur))
+        {
+            subtrees.push_back(cur);
+            continue;
+        }
+        if (expand)
+        {
+            visit(cur);
+        }
+        interior.push_back(cur);
+        Node* children[4] = {cur->NW, cur->NE, cur->SW, cur->SE};
+        for (int i = 0; i < 4; i++)
+        {
+            if (children[i] != NULL)
+            {
+                queue.push_back(children[i]);
+            }
+        }
+    }
+    subtrees.insert(subtrees.end(), queue.begin(), queue.end());
+}
+
+/**
+ * Parallel pre-order: every node is visited after its parent, and sibling
+ * subtrees are visited concurrently.
+ */
+template <class F>
+void ParallelPreOrder(Node* nd, F&& visit, ThreadPool& pool = ThreadPool::Shared())
+{
+    vector<Node*> interior, subtrees;
+    SplitFrontier(nd, 4 * pool.Size(), interior, subtrees, visit, true);
+    TaskGroup group(pool);
+    for (size_t i = 0; i < subtrees.size(); i++)
+    {
+        Node* sub = subtrees[i];
+        group.Run([sub, &visit]() { PreOrder(sub, visit); });
+    }
+    group.Wait();
+}
+
+/**
+ * Visits every leaf exactly once, concurrently across subtrees.
+ */
+template <class F>
+void ParallelForEachLeaf(Node* nd, F&& visit, ThreadPool& pool = ThreadPool::Shared())
+{
+    vector<Node*> interior, subtrees;
+    SplitFrontier(nd, 4 * pool.Size(), interior, subtrees, visit, false);
+    TaskGroup group(pool);
+    for (size_t i = 0; i < subtrees.size(); i++)
+    {
+        Node* sub = subtrees[i];
+        group.Run([sub, &visit]() { ForEachLeaf(sub, visit); });
+    }
+    group.Wait();
+}
+
+/**
+ * Serial reduction: combine(init, value(n)) over every node n (or every
+ * leaf, if leavesOnly), in pre-order.
+ */
+template <class T, class V, class C>
+T Reduce(Node* nd, T init, V&& value, C&& combine, bool leavesOnly)
+{
+    if (nd == NULL)
+    {
+        return init;
+    }
+    if (IsLeaf(nd))
+    {
+        return combine(init, value(nd));
+    }
+    T acc = leavesOnly ? init : combine(init, value(nd));
+    acc = Reduce(nd->NW, acc, value, combine, leavesOnly);
+    acc = Reduce(nd->NE, acc, value, combine, leavesOnly);
+    acc = Reduce(nd->SW, acc, value, combine, leavesOnly);
+    return Reduce(nd->SE, acc, value, combine, leavesOnly);
+}
+
+/**
+ * Parallel reduction over every node (or every leaf, if leavesOnly).
+ * Subtrees are reduced concurrently from init and the partial results
+ * combined, so combine must be associative with init as its identity.
+ */
+template <class T, class V, class C>
+T ParallelReduce(Node* nd, T init, V&& value, C&& combine, bool leavesOnly, ThreadPool& pool = ThreadPool::Shared())
+{
+    vector<Node*> interior, subtrees;
+    SplitFrontier(nd, 4 * pool.Size(), interior, subtrees, value, false);
+
+    vector<T> partial(subtrees.size(), init);
+    TaskGroup group(pool);
+    for (size_t i = 0; i < subtrees.size(); i++)
+    {
+        Node* sub = subtrees[i];
+        T* slot = &partial[i];
+        group.Run([sub, slot, init, &value, &combine, leavesOnly]() { *slot = Reduce(sub, init, value, combine, leavesOnly); });
+    }
+
+    T acc = init;
+    if (!leavesOnly)
+    {
+        for (size_t i = 0; i < interior.size(); i++)
+        {
+            acc = combine(acc, value(interior[i]));
+        }
+    }
+    group.Wait();
+    for (size_t i = 0; i < partial.size(); i++)
+    {
+        acc = combine(acc, partial[i]);
+    }
+    return acc;
+}
+
+#endif
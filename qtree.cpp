@@ -6,7 +6,165 @@
  *              SUBMIT THIS FILE
  */
 
+#include <atomic>
+#include <cstring>
+#include "colorintegral.h"
+#include "nodepool.h"
 #include "qtree.h"
+#include "qtree-traversal.h"
+#include "rawimage.h"
+#include "spill.h"
+#include "trace.h"
+
+/**
+ * Pixel access for BuildNode, for each kind of input image.
+ */
+static inline RGBAPixel PixelAt(const PNG &img, unsigned int x, unsigned int y)
+{
+	return *img.getPixel(x, y);
+}
+
+static inline RGBAPixel PixelAt(const RawImage &img, unsigned int x, unsigned int y)
+{
+	return img.Pixel(x, y);
+}
+
+/**
+ * Last generation handed out (see QTree::Generation), over all trees.
+ */
+static atomic<unsigned long long> lastGeneration(0);
+
+/**
+ * Thread that frees the subtrees ParallelPrune discards: a pool of its
+ * own, so that no TaskGroup::Wait on the shared pool runs a free in place
+ * of pruning work.
+ */
+static ThreadPool &Reclaimer()
+{
+	static ThreadPool reclaimer(1);
+	return reclaimer;
+}
+
+/**
+ * Smallest rectangle, in pixels, whose build is traced as a span of its
+ * own; smaller ones would flood the trace and slow the build.
+ */
+static const size_t BUILD_SPAN_PIXELS = 1 << 16;
+
+/**
+ * Render targets of RenderNode and RenderRegionNode. RowAt(y, shift)
+ * addresses row y so that Put(row, x, ...) writes its column x - shift.
+ */
+struct PNGCanvas
+{
+	struct Row
+	{
+		RGBAPixel *pixels; // column 0 of the row
+		unsigned int shift;
+	};
+
+	PNG &img;
+
+	PNGCanvas(PNG &img) : img(img)
+	{
+	}
+
+	unsigned int Width() const
+	{
+		return img.width();
+	}
+
+	unsigned int Height() const
+	{
+		return img.height();
+	}
+
+	Row RowAt(unsigned int y, unsigned int shift) const
+	{
+		Row row = {img.getPixel(0, y), shift};
+		return row;
+	}
+
+	static void Put(Row row, unsigned int x, const RGBAPixel &p)
+	{
+		row.pixels[x - row.shift] = p;
+	}
+
+	// one pixel of a block leaf's RGBA8 layout
+	static void PutBlock(Row row, unsigned int x, const unsigned char *block)
+	{
+		row.pixels[x - row.shift] = BlockPixel(block);
+	}
+
+	static void Fill(Row row, unsigned int x0, unsigned int x1, const RGBAPixel &p)
+	{
+		fill(row.pixels + (x0 - row.shift), row.pixels + (x1 - row.shift) + 1, p);
+	}
+};
+
+/**
+ * Caller-owned RGBA8 rows (see QTree::RenderInto), holding the bytes
+ * PNG::writeToFile would encode for the same pixels.
+ */
+struct RGBA8Canvas
+{
+	struct Row
+	{
+		unsigned char *bytes; // column 0 of the row
+		unsigned int shift;
+	};
+
+	unsigned char *data;
+	size_t stride;
+	unsigned int width;
+	unsigned int height;
+
+	unsigned int Width() const
+	{
+		return width;
+	}
+
+	unsigned int Height() const
+	{
+		return height;
+	}
+
+	Row RowAt(unsigned int y, unsigned int shift) const
+	{
+		Row row = {data + y * stride, shift};
+		return row;
+	}
+
+	static void Pack(const RGBAPixel &p, unsigned char *out)
+	{
+		out[0] = p.r;
+		out[1] = p.g;
+		out[2] = p.b;
+		out[3] = p.a * 255;
+	}
+
+	static void Put(Row row, unsigned int x, const RGBAPixel &p)
+	{
+		Pack(p, row.bytes + (size_t)(x - row.shift) * 4);
+	}
+
+	// block bytes are already RGBA8, and alpha a / 255.0 * 255 truncates
+	// back to a, so they are copied as they are
+	static void PutBlock(Row row, unsigned int x, const unsigned char *block)
+	{
+		memcpy(row.bytes + (size_t)(x - row.shift) * 4, block, 4);
+	}
+
+	static void Fill(Row row, unsigned int x0, unsigned int x1, const RGBAPixel &p)
+	{
+		unsigned char pixel[4];
+		Pack(p, pixel);
+		for (unsigned int x = x0; x <= x1; x++)
+		{
+			memcpy(row.bytes + (size_t)(x - row.shift) * 4, pixel, 4);
+		}
+	}
+};
 
 /**
  * Constructor that builds a QTree out of the given PNG.
@@ -49,10 +207,92 @@ QTree::QTree(const PNG &imIn)
 	// Initialize private member variables
 	height = imIn.height();
 	width = imIn.width();
+	shared = false;
+	spill = NULL;
+	Touch();
+	TRACE_SCOPE("QTree::QTree");
+	root = BuildNode(imIn, pair<unsigned int, unsigned int>(0, 0),
+					 pair<unsigned int, unsigned int>(width - 1, height - 1));
+}
+
+/**
+ * Constructor that builds a QTree straight from caller-owned 8-bit
+ * pixels (see rawimage.h), e.g. a decoded frame already in memory or a
+ * MappedImage, without first copying them into a PNG. The tree is
+ * identical to the one built from the equivalent PNG.
+ *
+ * @param imIn view of the pixels; only read during construction
+ */
+QTree::QTree(const RawImage &imIn)
+{
+	height = imIn.height;
+	width = imIn.width;
+	shared = false;
+	spill = NULL;
+	Touch();
+	TRACE_SCOPE("QTree::QTree");
 	root = BuildNode(imIn, pair<unsigned int, unsigned int>(0, 0),
 					 pair<unsigned int, unsigned int>(width - 1, height - 1));
 }
 
+BuildOptions::BuildOptions()
+{
+	split = MIDPOINT;
+	blockSize = 1;
+	layout = ALLOCATOR;
+}
+
+/**
+ * Constructors that build the tree as options say; see qtree.h.
+ */
+QTree::QTree(const PNG &imIn, const BuildOptions &options)
+{
+	height = imIn.height();
+	width = imIn.width();
+	shared = false;
+	spill = NULL;
+	Touch();
+	TRACE_SCOPE("QTree::QTree");
+	pair<unsigned int, unsigned int> ul(0, 0), lr(width - 1, height - 1);
+	if (options.split == BuildOptions::ADAPTIVE)
+	{
+		ColorIntegral integral(width, height, [&imIn](unsigned int x, unsigned int y) { return PixelAt(imIn, x, y); });
+		root = BuildAdaptiveNode(imIn, integral, ul, lr, options.blockSize);
+	}
+	else
+	{
+		root = BuildNode(imIn, ul, lr, options.blockSize);
+	}
+	if (options.layout == BuildOptions::VAN_EMDE_BOAS)
+	{
+		Relayout();
+	}
+}
+
+QTree::QTree(const RawImage &imIn, const BuildOptions &options)
+{
+	height = imIn.height;
+	width = imIn.width;
+	shared = false;
+	spill = NULL;
+	Touch();
+	TRACE_SCOPE("QTree::QTree");
+	pair<unsigned int, unsigned int> ul(0, 0), lr(width - 1, height - 1);
+	if (options.split == BuildOptions::ADAPTIVE)
+	{
+		ColorIntegral integral(width, height, [&imIn](unsigned int x, unsigned int y) { return PixelAt(imIn, x, y); });
+		root = BuildAdaptiveNode(imIn, integral, ul, lr, options.blockSize);
+	}
+	else
+	{
+		root = BuildNode(imIn, ul, lr, options.blockSize);
+	}
+	if (options.layout == BuildOptions::VAN_EMDE_BOAS)
+	{
+		Relayout();
+	}
+}
+
 /**
  * Overloaded assignment operator for QTrees.
  * Part of the Big Three that we must define because the class
@@ -87,9 +327,56 @@ QTree &QTree::operator=(const QTree &rhs)
  */
 PNG QTree::Render(unsigned int scale) const
 {
+	TRACE_SCOPE("QTree::Render");
 	// Replace the line below with your implementation
 	PNG output = PNG(width * scale, height * scale);
-	RenderNode(output, root, scale);
+	RenderAll(PNGCanvas(output), scale);
+	return output;
+}
+
+/**
+ * Render straight into caller-owned RGBA8 rows; see qtree.h.
+ */
+void QTree::RenderInto(unsigned char *out, size_t stride, unsigned int scale) const
+{
+	TRACE_SCOPE("QTree::RenderInto");
+	RGBA8Canvas canvas = {out, stride != 0 ? stride : (size_t)width * scale * 4, width * scale, height * scale};
+	RenderAll(canvas, scale);
+}
+
+template <class Canvas>
+void QTree::RenderAll(const Canvas &canvas, unsigned int scale) const
+{
+	if (shared)
+	{
+		// leaf corners are only meaningful for unshared subtrees
+		RenderRegionNode(canvas, root, pair<unsigned int, unsigned int>(0, 0), scale, pair<unsigned int, unsigned int>(0, 0),
+						 pair<unsigned int, unsigned int>(width * scale - 1, height * scale - 1));
+	}
+	else
+	{
+		RenderNode(canvas, root, scale);
+	}
+}
+
+/**
+ * RenderRegion renders only the part of Render(scale) that falls in
+ * the viewport with corners ul and lr (inclusive, in scaled output
+ * coordinates). Subtrees whose rectangles miss the viewport are
+ * skipped, so the cost depends on the visible area only.
+ * Viewport pixels outside the image are left at the default color.
+ *
+ * @param ul upper left corner of the viewport
+ * @param lr lower right corner of the viewport
+ * @param scale multiplier for each horizontal/vertical dimension
+ * @pre scale > 0, ul.first <= lr.first and ul.second <= lr.second
+ * @return image of (lr.first - ul.first + 1) x (lr.second - ul.second + 1) pixels
+ */
+PNG QTree::RenderRegion(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, unsigned int scale) const
+{
+	TRACE_SCOPE("QTree::RenderRegion");
+	PNG output = PNG(lr.first - ul.first + 1, lr.second - ul.second + 1);
+	RenderRegionNode(PNGCanvas(output), root, pair<unsigned int, unsigned int>(0, 0), scale, ul, lr);
 	return output;
 }
 
@@ -109,7 +396,85 @@ PNG QTree::Render(unsigned int scale) const
 void QTree::Prune(double tolerance)
 {
 	// ADD YOUR IMPLEMENTATION BELOW
-	PruneNode(root, tolerance, root->avg);
+	Prune<PremultipliedDistance>(tolerance);
+}
+
+/**
+ * Prune with a compile-time choice of color distance (see colormetric.h).
+ * The metric is inlined into the leaf test, and integer metrics compare
+ * in integer arithmetic throughout.
+ *
+ * @param tolerance maximum distance, in the metric's units, to qualify for pruning
+ * @pre this tree has not previously been pruned, nor is copied from a previously pruned tree.
+ */
+template <class Metric>
+void QTree::Prune(double tolerance)
+{
+	TRACE_SCOPE("QTree::Prune");
+	SpillGuard guard(*this, SpillGuard::ON_DEMAND);
+	Unshare();
+	typename Metric::value_type tol = Metric::Threshold(tolerance);
+	bool changed = PruneNode<Metric>(root, tol);
+	// the spilled subtrees left standing are pruned one at a time
+	ForEachSpilled([this, tol, &changed](Node *unit) { changed = PruneNode<Metric>(unit, tol) || changed; });
+	// collapsed leaves take interior averages, which are not palette entries
+	if (changed)
+	{
+		palette.clear();
+	}
+}
+
+template void QTree::Prune<PremultipliedDistance>(double tolerance);
+template void QTree::Prune<SquaredRGBDistance>(double tolerance);
+template void QTree::Prune<MaxChannelDistance>(double tolerance);
+template void QTree::Prune<LumaWeightedDistance>(double tolerance);
+
+/**
+ * Multi-threaded Prune, producing exactly the same tree as
+ * Prune<Metric>(tolerance). Once a node is kept, its children decide
+ * independently, so each is handed to the shared ThreadPool; subtrees
+ * covering at most cutoff pixels are pruned serially within one task.
+ * Discarded subtrees are freed on a background thread of their own.
+ *
+ * @param tolerance maximum distance, in the metric's units, to qualify for pruning
+ * @param cutoff largest subtree area (in pixels) pruned serially in one task
+ * @pre this tree has not previously been pruned, nor is copied from a previously pruned tree.
+ */
+template <class Metric>
+void QTree::ParallelPrune(double tolerance, unsigned int cutoff)
+{
+	TRACE_SCOPE("QTree::ParallelPrune");
+	SpillGuard guard(*this, SpillGuard::ON_DEMAND);
+	Unshare();
+	TaskGroup work(ThreadPool::Shared());
+	atomic<bool> changed(false);
+	typename Metric::value_type tol = Metric::Threshold(tolerance);
+	ParallelPruneNode<Metric>(root, tol, cutoff, work, changed);
+	work.Wait();
+	// as in Prune; a unit is small enough to prune serially
+	ForEachSpilled([this, tol, &changed](Node *unit) {
+		if (PruneNode<Metric>(unit, tol))
+		{
+			changed = true;
+		}
+	});
+	if (changed)
+	{
+		palette.clear();
+	}
+}
+
+template void QTree::ParallelPrune<PremultipliedDistance>(double tolerance, unsigned int cutoff);
+template void QTree::ParallelPrune<SquaredRGBDistance>(double tolerance, unsigned int cutoff);
+template void QTree::ParallelPrune<MaxChannelDistance>(double tolerance, unsigned int cutoff);
+template void QTree::ParallelPrune<LumaWeightedDistance>(double tolerance, unsigned int cutoff);
+
+/**
+ * ParallelPrune with the original RGBAPixel::distanceTo metric.
+ */
+void QTree::ParallelPrune(double tolerance, unsigned int cutoff)
+{
+	ParallelPrune<PremultipliedDistance>(tolerance, cutoff);
 }
 
 /**
@@ -129,7 +494,13 @@ void QTree::Prune(double tolerance)
 void QTree::FlipHorizontal()
 {
 	// ADD YOUR IMPLEMENTATION BELOW
-	root = FlipHorizontalNode(root, root->upLeft, root->lowRight);
+	TRACE_SCOPE("QTree::FlipHorizontal");
+	SpillGuard guard(*this, SpillGuard::ON_DEMAND);
+	Unshare();
+	FlipHorizontalNode(root);
+	// a stub was placed as a leaf, and has no block or gradient, so
+	// visiting it again only places its children
+	ForEachSpilled([this](Node *unit) { FlipHorizontalNode(unit); });
 }
 
 /**
@@ -155,13 +526,61 @@ void QTree::RotateCCW()
 	
 
 	// ADD YOUR IMPLEMENTATION BELOW
-	RotateCCWNode(root,width,height);
+	TRACE_SCOPE("QTree::RotateCCW");
+	SpillGuard guard(*this, SpillGuard::ON_DEMAND);
+	Unshare();
+	RotateCCWNode(root,width);
+	// a stub was turned as a leaf; its children are turned and rearranged as it would have been
+	unsigned int old_width = width;
+	ForEachSpilled([this, old_width](Node *unit) {
+		Node *children[4] = {unit->NW, unit->NE, unit->SW, unit->SE};
+		for (int i = 0; i < 4; i++)
+		{
+			if (children[i] != NULL)
+			{
+				RotateCCWNode(children[i], old_width);
+			}
+		}
+		unit->NW = children[1];
+		unit->NE = children[3];
+		unit->SE = children[2];
+		unit->SW = children[0];
+	});
 	unsigned int temp_height = height;
 	height = width;
 	width = temp_height;
 
 }
 
+/**
+ * Width of the image represented by the tree (at scale 1).
+ */
+unsigned int QTree::Width() const
+{
+	return width;
+}
+
+/**
+ * Height of the image represented by the tree (at scale 1).
+ */
+unsigned int QTree::Height() const
+{
+	return height;
+}
+
+/**
+ * Number identifying what the tree holds; see qtree.h.
+ */
+unsigned long long QTree::Generation() const
+{
+	return generation;
+}
+
+void QTree::Touch()
+{
+	generation = ++lastGeneration;
+}
+
 /**
  * Destroys all dynamically allocated memory associated with the
  * current QTree object. Complete for PA3.
@@ -170,7 +589,19 @@ void QTree::RotateCCW()
 void QTree::Clear()
 {
 	// ADD YOUR IMPLEMENTATION BELOW
-	ClearNode(root);
+	// the spill file goes first, so freeing the nodes need not consult it
+	delete spill;
+	spill = NULL;
+	if (shared)
+	{
+		ClearSharedNode(root);
+	}
+	else
+	{
+		ClearNode(root);
+	}
+	// past a threshold, the chunks the tree leaves all free go back to the heap
+	NodePool::Trim();
 }
 
 /**
@@ -182,28 +613,78 @@ void QTree::Clear()
 void QTree::Copy(const QTree &other)
 {
 	// ADD YOUR IMPLEMENTATION BELOW
-	Node *other_root = other.root;
-	root = new Node(other_root->upLeft, other_root->lowRight, other_root->avg);
-	root->NW = CopyNode(other_root->NW);
-	root->NE = CopyNode(other_root->NE);
-	root->SW = CopyNode(other_root->SW);
-	root->SE = CopyNode(other_root->SE);
+	width = other.width;
+	height = other.height;
+	palette = other.palette;
+	shared = other.shared;
+	spill = NULL;
+	Touch();
+	if (shared)
+	{
+		unordered_map<Node *, Node *> copies;
+		root = CopySharedNode(other.root, copies);
+	}
+	else if (other.spill != NULL)
+	{
+		// the copy reads the spilled subtrees back, and has no budget
+		root = other.CopySpilledNode(other.root);
+	}
+	else
+	{
+		root = CopyNode(other.root);
+	}
 }
 
 /**
- * Private helper function for the constructor. Recursively builds
+ * A block leaf for the rectangle: its pixels packed as RGBA8, and their
+ * average (truncated to whole channel values, as calculateAvg does).
+ */
+template <class Image>
+static Node *BuildBlockLeaf(const Image &img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr)
+{
+	unsigned int w = lr.first - ul.first + 1, h = lr.second - ul.second + 1;
+	Node *leaf = new Node(ul, lr, RGBAPixel());
+	leaf->block = new unsigned char[(size_t)w * h * 4];
+	double sum[4] = {0, 0, 0, 0};
+	unsigned char *out = leaf->block;
+	for (unsigned int y = ul.second; y <= lr.second; y++)
+	{
+		for (unsigned int x = ul.first; x <= lr.first; x++, out += 4)
+		{
+			RGBAPixel p = PixelAt(img, x, y);
+			PackBlockPixel(p, out);
+			sum[0] += p.r;
+			sum[1] += p.g;
+			sum[2] += p.b;
+			sum[3] += p.a;
+		}
+	}
+	double area = (double)w * h;
+	leaf->avg = RGBAPixel(sum[0] / area, sum[1] / area, sum[2] / area, sum[3] / area);
+	return leaf;
+}
+
+/**
+ * Private helper function for the constructors. Recursively builds
  * the tree according to the specification of the constructor.
- * @param img reference to the original input image.
+ * @param img reference to the original input image (a PNG or a RawImage).
  * @param ul upper left point of current node's rectangle.
  * @param lr lower right point of current node's rectangle.
  */
-Node *QTree::BuildNode(const PNG &img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr)
+template <class Image>
+Node *QTree::BuildNode(const Image &img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, unsigned int blockSize)
 {
 	int width_img = lr.first - ul.first + 1;	// number of pixels in the image (width)
 	int height_img = lr.second - ul.second + 1; // number of pixles in the image (height)
+	TRACE_SCOPE_IF("QTree::BuildNode", (size_t)width_img * height_img >= BUILD_SPAN_PIXELS);
+
+	if (blockSize > 1 && (width_img > 1 || height_img > 1) && width_img <= (int)blockSize && height_img <= (int)blockSize)
+	{
+		return BuildBlockLeaf(img, ul, lr);
+	}
 
-	RGBAPixel *pixel = img.getPixel(ul.first, ul.second);
-	Node *subroot = new Node(ul, lr, *pixel);
+	// interior averages are filled in from the children below
+	Node *subroot = new Node(ul, lr, RGBAPixel());
 	pair<unsigned int, unsigned int> ul_nw, lr_nw, ul_ne, lr_ne, ul_sw, lr_sw, ul_se, lr_se;
 
 	if (width_img == 1 && height_img == 1)
@@ -212,8 +693,7 @@ Node *QTree::BuildNode(const PNG &img, pair<unsigned int, unsigned int> ul, pair
 		// leaf node is a single pixel
 		// when ul and lr passed in build node is the same point
 		// ul = lr
-		RGBAPixel *pixel = img.getPixel(ul.first, ul.second);
-		subroot->avg = *pixel;
+		subroot->avg = PixelAt(img, ul.first, ul.second);
 		subroot->NW = NULL;
 		subroot->NE = NULL;
 		subroot->SW = NULL;
@@ -242,9 +722,9 @@ Node *QTree::BuildNode(const PNG &img, pair<unsigned int, unsigned int> ul, pair
 			ul_sw = make_pair(ul.first, (ul.second + (height_img) / 2));
 			lr_sw = make_pair(lr.first, lr.second);
 		}
-		subroot->NW = BuildNode(img, ul_nw, lr_nw);
+		subroot->NW = BuildNode(img, ul_nw, lr_nw, blockSize);
 		subroot->NE = NULL;
-		subroot->SW = BuildNode(img, ul_sw, lr_sw);
+		subroot->SW = BuildNode(img, ul_sw, lr_sw, blockSize);
 		subroot->SE = NULL;
 	}
 	else if (height_img == 1)
@@ -269,8 +749,8 @@ Node *QTree::BuildNode(const PNG &img, pair<unsigned int, unsigned int> ul, pair
 			ul_ne = make_pair(ul.first + (width_img / 2), ul.second);
 			lr_ne = make_pair(lr.first, lr.second);
 		}
-		subroot->NW = BuildNode(img, ul_nw, lr_nw);
-		subroot->NE = BuildNode(img, ul_ne, lr_ne);
+		subroot->NW = BuildNode(img, ul_nw, lr_nw, blockSize);
+		subroot->NE = BuildNode(img, ul_ne, lr_ne, blockSize);
 		subroot->SW = NULL;
 		subroot->SE = NULL;
 	}
@@ -308,10 +788,10 @@ Node *QTree::BuildNode(const PNG &img, pair<unsigned int, unsigned int> ul, pair
 			ul_se = make_pair(ul.first + width_img / 2, ul.second + (height_img + 1) / 2);
 			lr_se = make_pair(lr.first, lr.second);
 		}
-		subroot->NW = BuildNode(img, ul_nw, lr_nw);
-		subroot->NE = BuildNode(img, ul_ne, lr_ne);
-		subroot->SW = BuildNode(img, ul_sw, lr_sw);
-		subroot->SE = BuildNode(img, ul_se, lr_se);
+		subroot->NW = BuildNode(img, ul_nw, lr_nw, blockSize);
+		subroot->NE = BuildNode(img, ul_ne, lr_ne, blockSize);
+		subroot->SW = BuildNode(img, ul_sw, lr_sw, blockSize);
+		subroot->SE = BuildNode(img, ul_se, lr_se, blockSize);
 	}
 	else if (width_img % 2 == 1)
 	{
@@ -347,10 +827,106 @@ Node *QTree::BuildNode(const PNG &img, pair<unsigned int, unsigned int> ul, pair
 			ul_se = make_pair(ul.first + (width_img + 1) / 2, ul.second + (height_img + 1) / 2);
 			lr_se = make_pair(lr.first, lr.second);
 		}
-		subroot->NW = BuildNode(img, ul_nw, lr_nw);
-		subroot->NE = BuildNode(img, ul_ne, lr_ne);
-		subroot->SW = BuildNode(img, ul_sw, lr_sw);
-		subroot->SE = BuildNode(img, ul_se, lr_se);
+		subroot->NW = BuildNode(img, ul_nw, lr_nw, blockSize);
+		subroot->NE = BuildNode(img, ul_ne, lr_ne, blockSize);
+		subroot->SW = BuildNode(img, ul_sw, lr_sw, blockSize);
+		subroot->SE = BuildNode(img, ul_se, lr_se, blockSize);
+	}
+	subroot->avg = calculateAvg(subroot->NW, subroot->NE, subroot->SW, subroot->SE);
+	return subroot;
+}
+
+/**
+ * Width of the western part for an adaptive split of the rectangle:
+ * among widths in the middle half, the one minimizing the squared error of
+ * the two full-height sides; the midpoint (extra column to the west)
+ * unless another width is strictly better.
+ */
+static unsigned int AdaptiveWestWidth(const ColorIntegral &integral, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr)
+{
+	unsigned int w = lr.first - ul.first + 1;
+	unsigned int best = (w + 1) / 2;
+	unsigned int lo = max(1u, w / 4), hi = min(w - 1, w - w / 4);
+	double bestError = integral.SquaredError(ul, make_pair(ul.first + best - 1, lr.second)) +
+					   integral.SquaredError(make_pair(ul.first + best, ul.second), lr);
+	for (unsigned int west = lo; west <= hi; west++)
+	{
+		double error = integral.SquaredError(ul, make_pair(ul.first + west - 1, lr.second)) +
+					   integral.SquaredError(make_pair(ul.first + west, ul.second), lr);
+		if (error < bestError)
+		{
+			best = west;
+			bestError = error;
+		}
+	}
+	return best;
+}
+
+/**
+ * Height of the northern part for an adaptive split; as above, by rows.
+ */
+static unsigned int AdaptiveNorthHeight(const ColorIntegral &integral, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr)
+{
+	unsigned int h = lr.second - ul.second + 1;
+	unsigned int best = (h + 1) / 2;
+	unsigned int lo = max(1u, h / 4), hi = min(h - 1, h - h / 4);
+	double bestError = integral.SquaredError(ul, make_pair(lr.first, ul.second + best - 1)) +
+					   integral.SquaredError(make_pair(ul.first, ul.second + best), lr);
+	for (unsigned int north = lo; north <= hi; north++)
+	{
+		double error = integral.SquaredError(ul, make_pair(lr.first, ul.second + north - 1)) +
+					   integral.SquaredError(make_pair(ul.first, ul.second + north), lr);
+		if (error < bestError)
+		{
+			best = north;
+			bestError = error;
+		}
+	}
+	return best;
+}
+
+/**
+ * Private helper for the ADAPTIVE constructors. Like BuildNode, except
+ * that the west column and north row of each rectangle are chosen by
+ * AdaptiveWestWidth/AdaptiveNorthHeight instead of at the midpoint.
+ * Single-pixel-wide (tall) rectangles still have null eastern (southern)
+ * children.
+ */
+template <class Image>
+Node *QTree::BuildAdaptiveNode(const Image &img, const ColorIntegral &integral, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, unsigned int blockSize)
+{
+	unsigned int node_width = lr.first - ul.first + 1;
+	unsigned int node_height = lr.second - ul.second + 1;
+	TRACE_SCOPE_IF("QTree::BuildAdaptiveNode", (size_t)node_width * node_height >= BUILD_SPAN_PIXELS);
+	if (blockSize > 1 && (size_t)node_width * node_height > 1 && node_width <= blockSize && node_height <= blockSize)
+	{
+		return BuildBlockLeaf(img, ul, lr);
+	}
+	Node *subroot = new Node(ul, lr, RGBAPixel());
+
+	if (node_width == 1 && node_height == 1)
+	{
+		subroot->avg = PixelAt(img, ul.first, ul.second);
+		return subroot;
+	}
+
+	// a side of one pixel is not split; its whole length is "west"/"north"
+	unsigned int west = node_width == 1 ? 1 : AdaptiveWestWidth(integral, ul, lr);
+	unsigned int north = node_height == 1 ? 1 : AdaptiveNorthHeight(integral, ul, lr);
+	unsigned int east_x = ul.first + west, south_y = ul.second + north;
+
+	subroot->NW = BuildAdaptiveNode(img, integral, ul, make_pair(east_x - 1, south_y - 1), blockSize);
+	if (west < node_width)
+	{
+		subroot->NE = BuildAdaptiveNode(img, integral, make_pair(east_x, ul.second), make_pair(lr.first, south_y - 1), blockSize);
+	}
+	if (north < node_height)
+	{
+		subroot->SW = BuildAdaptiveNode(img, integral, make_pair(ul.first, south_y), make_pair(east_x - 1, lr.second), blockSize);
+	}
+	if (west < node_width && north < node_height)
+	{
+		subroot->SE = BuildAdaptiveNode(img, integral, make_pair(east_x, south_y), lr, blockSize);
 	}
 	subroot->avg = calculateAvg(subroot->NW, subroot->NE, subroot->SW, subroot->SE);
 	return subroot;
@@ -372,7 +948,7 @@ RGBAPixel QTree::calculateAvg(Node *NW, Node *NE, Node *SW, Node *SE)
 
 	if (NW != NULL)
 	{
-		NW_Area = ((NW->lowRight.first - NW->upLeft.first) + 1) * ((NW->lowRight.second - NW->upLeft.second) + 1);
+		NW_Area = (double)((NW->lowRight.first - NW->upLeft.first) + 1) * ((NW->lowRight.second - NW->upLeft.second) + 1);
 		nw_avgr = NW->avg.r * NW_Area;
 		nw_avgg = NW->avg.g * NW_Area;
 		nw_avgb = NW->avg.b * NW_Area;
@@ -380,7 +956,7 @@ RGBAPixel QTree::calculateAvg(Node *NW, Node *NE, Node *SW, Node *SE)
 	}
 	if (NE != NULL)
 	{
-		NE_Area = ((NE->lowRight.first - NE->upLeft.first) + 1) * ((NE->lowRight.second - NE->upLeft.second) + 1);
+		NE_Area = (double)((NE->lowRight.first - NE->upLeft.first) + 1) * ((NE->lowRight.second - NE->upLeft.second) + 1);
 		ne_avgr = NE->avg.r * NE_Area;
 		ne_avgg = NE->avg.g * NE_Area;
 		ne_avgb = NE->avg.b * NE_Area;
@@ -388,7 +964,7 @@ RGBAPixel QTree::calculateAvg(Node *NW, Node *NE, Node *SW, Node *SE)
 	}
 	if (SW != NULL)
 	{
-		SW_Area = ((SW->lowRight.first - SW->upLeft.first) + 1) * ((SW->lowRight.second - SW->upLeft.second) + 1);
+		SW_Area = (double)((SW->lowRight.first - SW->upLeft.first) + 1) * ((SW->lowRight.second - SW->upLeft.second) + 1);
 		sw_avgr = SW->avg.r * SW_Area;
 		sw_avgg = SW->avg.g * SW_Area;
 		sw_avgb = SW->avg.b * SW_Area;
@@ -396,14 +972,15 @@ RGBAPixel QTree::calculateAvg(Node *NW, Node *NE, Node *SW, Node *SE)
 	}
 	if (SE != NULL)
 	{
-		SE_Area = ((SE->lowRight.first - SE->upLeft.first) + 1) * ((SE->lowRight.second - SE->upLeft.second) + 1);
+		SE_Area = (double)((SE->lowRight.first - SE->upLeft.first) + 1) * ((SE->lowRight.second - SE->upLeft.second) + 1);
 		se_avgr = SE->avg.r * SE_Area;
 		se_avgg = SE->avg.g * SE_Area;
 		se_avgb = SE->avg.b * SE_Area;
 		se_avga = SE->avg.a * SE_Area;
 	}
 
-	unsigned int totalArea = NW_Area + NE_Area + SW_Area + SE_Area;
+	// in double, as areas of gigapixel images overflow 32 bits
+	double totalArea = NW_Area + NE_Area + SW_Area + SE_Area;
 
 	double average_r = ((nw_avgr + ne_avgr + sw_avgr + se_avgr) / totalArea);
 
@@ -418,49 +995,163 @@ RGBAPixel QTree::calculateAvg(Node *NW, Node *NE, Node *SW, Node *SE)
 	return pixel;
 }
 
-void QTree::RenderNode(PNG &img, Node *subroot, unsigned int scale) const
+/**
+ * Paints the pixels of a block leaf placed at origin, scaled, clipped to
+ * the viewport ul..lr; (0, 0) of the canvas is ul.
+ */
+template <class Canvas>
+static void PaintBlock(const Canvas &canvas, const Node *leaf, pair<unsigned int, unsigned int> origin, unsigned int scale,
+					   pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr)
 {
-	if (subroot == NULL)
+	unsigned int w = leaf->lowRight.first - leaf->upLeft.first + 1;
+	unsigned int h = leaf->lowRight.second - leaf->upLeft.second + 1;
+	unsigned int x0 = max(origin.first * scale, ul.first), x1 = min((origin.first + w) * scale - 1, lr.first);
+	unsigned int y0 = max(origin.second * scale, ul.second), y1 = min((origin.second + h) * scale - 1, lr.second);
+	for (unsigned int y = y0; y <= y1 && x0 <= x1; y++)
 	{
-		return;
+		typename Canvas::Row row = canvas.RowAt(y - ul.second, ul.first);
+		const unsigned char *src = leaf->block + (size_t)(y / scale - origin.second) * w * 4;
+		for (unsigned int x = x0; x <= x1; x++)
+		{
+			Canvas::PutBlock(row, x, src + (x / scale - origin.first) * 4);
+		}
 	}
-	if (subroot->NW == NULL && subroot->NE == NULL && subroot->SW == NULL && subroot->SE == NULL)
+}
+
+/**
+ * Paints a gradient leaf placed at origin, scaled, clipped to the viewport
+ * ul..lr; (0, 0) of the canvas is ul. Each row starts from the corner color
+ * plus whole steps and then adds the x step once per source pixel, which
+ * in fixed point gives exactly the colors GradientPixel does.
+ */
+template <class Canvas>
+static void PaintGradient(const Canvas &canvas, const Node *leaf, pair<unsigned int, unsigned int> origin, unsigned int scale,
+						  pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr)
+{
+	unsigned int w = leaf->lowRight.first - leaf->upLeft.first + 1;
+	unsigned int h = leaf->lowRight.second - leaf->upLeft.second + 1;
+	unsigned int x0 = max(origin.first * scale, ul.first), x1 = min((origin.first + w) * scale - 1, lr.first);
+	unsigned int y0 = max(origin.second * scale, ul.second), y1 = min((origin.second + h) * scale - 1, lr.second);
+	const int *g = leaf->gradient;
+	for (unsigned int y = y0; y <= y1 && x0 <= x1; y++)
 	{
-		for (unsigned int x = subroot->upLeft.first * scale; x <= ((subroot->lowRight.first * scale) + scale) - 1; x++)
+		typename Canvas::Row row = canvas.RowAt(y - ul.second, ul.first);
+		long long dy = y / scale - origin.second, dx = x0 / scale - origin.first;
+		long long v[4];
+		for (int k = 0; k < 4; k++)
 		{
-			for (unsigned int y = subroot->upLeft.second * scale; y <= ((subroot->lowRight.second * scale) + scale) - 1; y++)
+			v[k] = g[k] + g[4 + k] * dx + g[8 + k] * dy;
+		}
+		RGBAPixel color(GradientChannel(v[0]), GradientChannel(v[1]), GradientChannel(v[2]), GradientChannel(v[3]) / 255.0);
+		unsigned int repeat = scale - x0 % scale; // output pixels left for the current source pixel
+		for (unsigned int x = x0; x <= x1; x++)
+		{
+			Canvas::Put(row, x, color);
+			if (--repeat == 0)
 			{
-				RGBAPixel *pixel = img.getPixel(x, y);
-				*pixel = subroot->avg;
+				for (int k = 0; k < 4; k++)
+				{
+					v[k] += g[4 + k];
+				}
+				color = RGBAPixel(GradientChannel(v[0]), GradientChannel(v[1]), GradientChannel(v[2]), GradientChannel(v[3]) / 255.0);
+				repeat = scale;
 			}
 		}
 	}
+}
 
-	RenderNode(img, subroot->NW, scale);
-	RenderNode(img, subroot->NE, scale);
-	RenderNode(img, subroot->SW, scale);
-	RenderNode(img, subroot->SE, scale);
+template <class Canvas>
+void QTree::RenderNode(const Canvas &canvas, Node *subroot, unsigned int scale) const
+{
+	pair<unsigned int, unsigned int> all(canvas.Width() - 1, canvas.Height() - 1);
+	// leaves cover disjoint rectangles, so they can be painted concurrently
+	ParallelForEachLeaf(subroot, [this, &canvas, scale, all](Node *leaf) {
+		Node *spilled = LoadSpilled(leaf);
+		if (spilled != NULL)
+		{
+			RenderNode(canvas, spilled, scale);
+			DeleteSubtree(spilled);
+			return;
+		}
+		if (leaf->block != NULL)
+		{
+			PaintBlock(canvas, leaf, leaf->upLeft, scale, make_pair(0u, 0u), all);
+			return;
+		}
+		if (leaf->gradient != NULL)
+		{
+			PaintGradient(canvas, leaf, leaf->upLeft, scale, make_pair(0u, 0u), all);
+			return;
+		}
+		for (unsigned int y = leaf->upLeft.second * scale; y <= ((leaf->lowRight.second * scale) + scale) - 1; y++)
+		{
+			Canvas::Fill(canvas.RowAt(y, 0), leaf->upLeft.first * scale, ((leaf->lowRight.first * scale) + scale) - 1, leaf->avg);
+		}
+	});
 }
 
-void QTree::ClearNode(Node *subroot)
+template <class Canvas>
+void QTree::RenderRegionNode(const Canvas &canvas, Node *subroot, pair<unsigned int, unsigned int> origin, unsigned int scale, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) const
 {
 	if (subroot == NULL)
 	{
 		return;
 	}
+
+	// scaled rectangle covered by this node, clipped to the viewport; the
+	// node is placed at origin, which differs from its upLeft when it is
+	// shared by several parts of the image
+	unsigned int nodeWidth = subroot->lowRight.first - subroot->upLeft.first + 1;
+	unsigned int nodeHeight = subroot->lowRight.second - subroot->upLeft.second + 1;
+	unsigned int x0 = max(origin.first * scale, ul.first);
+	unsigned int y0 = max(origin.second * scale, ul.second);
+	unsigned int x1 = min((origin.first + nodeWidth) * scale - 1, lr.first);
+	unsigned int y1 = min((origin.second + nodeHeight) * scale - 1, lr.second);
+	if (x0 > x1 || y0 > y1)
+	{
+		return;
+	}
+
+	if (subroot->block != NULL)
+	{
+		PaintBlock(canvas, subroot, origin, scale, ul, lr);
+		return;
+	}
+	if (subroot->gradient != NULL)
+	{
+		PaintGradient(canvas, subroot, origin, scale, ul, lr);
+		return;
+	}
+
 	if (subroot->NW == NULL && subroot->NE == NULL && subroot->SW == NULL && subroot->SE == NULL)
 	{
-		delete subroot;
+		// a spilled subtree is read back only when it is in view
+		Node *spilled = LoadSpilled(subroot);
+		if (spilled != NULL)
+		{
+			RenderRegionNode(canvas, spilled, origin, scale, ul, lr);
+			DeleteSubtree(spilled);
+			return;
+		}
+		for (unsigned int y = y0; y <= y1; y++)
+		{
+			Canvas::Fill(canvas.RowAt(y - ul.second, ul.first), x0, x1, subroot->avg);
+		}
 		return;
 	}
 
-	ClearNode(subroot->NW);
-	ClearNode(subroot->NE);
-	ClearNode(subroot->SW);
-	ClearNode(subroot->SE);
+	unsigned int east = origin.first + WestWidth(subroot);
+	unsigned int south = origin.second + NorthHeight(subroot);
+	RenderRegionNode(canvas, subroot->NW, origin, scale, ul, lr);
+	RenderRegionNode(canvas, subroot->NE, pair<unsigned int, unsigned int>(east, origin.second), scale, ul, lr);
+	RenderRegionNode(canvas, subroot->SW, pair<unsigned int, unsigned int>(origin.first, south), scale, ul, lr);
+	RenderRegionNode(canvas, subroot->SE, pair<unsigned int, unsigned int>(east, south), scale, ul, lr);
+}
 
-	delete subroot;
-	subroot = 0;
+void QTree::ClearNode(Node *subroot)
+{
+	ForgetSpilled(subroot);
+	PostOrder(subroot, [](Node *nd) { delete nd; });
 }
 
 
@@ -472,181 +1163,342 @@ Node *QTree::CopyNode(Node *toCopy)
 		return NULL;
 	}
 
+	// Each copy starts out pointing at the original's children; visiting it
+	// swaps those for copies, which are then visited in turn.
 	Node *subroot = new Node(toCopy->upLeft, toCopy->lowRight, toCopy->avg);
-	subroot->NW = CopyNode(toCopy->NW);
-	subroot->NE = CopyNode(toCopy->NE);
-	subroot->SW = CopyNode(toCopy->SW);
-	subroot->SE = CopyNode(toCopy->SE);
+	subroot->block = CopyBlock(toCopy);
+	subroot->gradient = CopyGradient(toCopy);
+	subroot->NW = toCopy->NW;
+	subroot->NE = toCopy->NE;
+	subroot->SW = toCopy->SW;
+	subroot->SE = toCopy->SE;
+	ParallelPreOrder(subroot, [](Node *nd) {
+		Node **slots[4] = {&nd->NW, &nd->NE, &nd->SW, &nd->SE};
+		for (int i = 0; i < 4; i++)
+		{
+			Node *original = *slots[i];
+			if (original != NULL)
+			{
+				Node *copy = new Node(original->upLeft, original->lowRight, original->avg);
+				copy->block = CopyBlock(original);
+				copy->gradient = CopyGradient(original);
+				copy->NW = original->NW;
+				copy->NE = original->NE;
+				copy->SW = original->SW;
+				copy->SE = original->SE;
+				*slots[i] = copy;
+			}
+		}
+	});
 
 	return subroot;
 }
 
-Node *QTree::FlipHorizontalNode(Node *subroot, pair<unsigned int, unsigned int> parent_ul, pair<unsigned int, unsigned int> parent_lr)
+void QTree::FlipHorizontalNode(Node *subroot)
 {
+	// Step 1 : when a node is visited its own rectangle is already final
+	// Step 2 : find the new coordinates of its children from their old ones
+	// Step 3 : mirror the children; the traversal then visits them in turn
+	ParallelPreOrder(subroot, [](Node *nd) {
+		if (nd->block != NULL)
+		{
+			// mirror each row of the block
+			unsigned int w = nd->lowRight.first - nd->upLeft.first + 1;
+			for (unsigned char *row = nd->block; row != nd->block + BlockBytes(nd); row += w * 4)
+			{
+				for (unsigned int x = 0; x < w / 2; x++)
+				{
+					swap_ranges(row + x * 4, row + x * 4 + 4, row + (w - 1 - x) * 4);
+				}
+			}
+		}
+		if (nd->gradient != NULL)
+		{
+			// the corner takes the color of the old east edge, and x steps reverse
+			unsigned int w = nd->lowRight.first - nd->upLeft.first + 1;
+			for (int k = 0; k < 4; k++)
+			{
+				nd->gradient[k] += nd->gradient[4 + k] * (int)(w - 1);
+				nd->gradient[4 + k] = -nd->gradient[4 + k];
+			}
+		}
 
-	// Step 1 : just change the coordinates(ul and lr) of nw, ne,sw and se according to the flipped image
-	// Step 2 : find the new coordinates -  no chnage is made in the if statements
-	// Step 3 : recursive calls to the children with the new coordinates
-	if (subroot == NULL)
-	{
-		return NULL;
-	}
+		pair<unsigned int, unsigned int> parent_ul = nd->upLeft;
+		pair<unsigned int, unsigned int> parent_lr = nd->lowRight;
+		pair<unsigned int, unsigned int> nw_ul, nw_lr, ne_ul, ne_lr, sw_ul, sw_lr, se_ul, se_lr;
 
-	subroot->upLeft = parent_ul;
-	subroot->lowRight = parent_lr;
+		if (nd->NE != NULL)
+		{
+			// update the ul and lr for NW
+			nw_ul.first = parent_ul.first;
+			nw_ul.second = parent_ul.second;
+			nw_lr.first = parent_ul.first + nd->NE->lowRight.first - nd->NE->upLeft.first;
+			nw_lr.second = nd->NE->lowRight.second;
+		}
+		if (nd->NW != NULL)
+		{
+			// update the ul and lr for NE
+			unsigned int ne_width = 0;
+			if (nd->NE != NULL)
+			{
+				ne_width = nd->NE->lowRight.first - nd->NE->upLeft.first + 1;
+			}
+			ne_ul.first = parent_ul.first + ne_width;
+			ne_ul.second = parent_ul.second;
+			ne_lr.first = parent_lr.first;
+			ne_lr.second = nd->NW->lowRight.second;
+		}
+		if (nd->SE != NULL)
+		{
+			sw_ul.first = parent_ul.first;
+			sw_ul.second = nd->SE->upLeft.second;
+			sw_lr.first = parent_ul.first + nd->SE->lowRight.first - nd->SE->upLeft.first;
+			sw_lr.second = nd->SE->lowRight.second;
+		}
+		if (nd->SW != NULL)
+		{
+			unsigned int se_width = 0;
+			if (nd->SE != NULL)
+			{
+				se_width = nd->SE->lowRight.first - nd->SE->upLeft.first + 1;
+			}
+			se_ul.first = parent_ul.first + se_width;
+			se_ul.second = nd->SW->upLeft.second;
+			se_lr.first = parent_lr.first;
+			se_lr.second = parent_lr.second;
+		}
 
-	pair<unsigned int, unsigned int> nw_ul, nw_lr, ne_ul, ne_lr, sw_ul, sw_lr, se_ul, se_lr;
+		Node *old_nw = nd->NW;
+		Node *old_ne = nd->NE;
+		Node *old_sw = nd->SW;
+		Node *old_se = nd->SE;
 
-	if (subroot->NE != NULL)
-	{
-		// update the ul and lr for NW
-		nw_ul.first = parent_ul.first;
-		nw_ul.second = parent_ul.second;
-		nw_lr.first = parent_ul.first + subroot->NE->lowRight.first - subroot->NE->upLeft.first;
-		nw_lr.second = subroot->NE->lowRight.second;
-	}
-	if (subroot->NW != NULL)
-	{
-		// update the ul and lr for NE
-		unsigned int ne_width = 0;
-		if (subroot->NE != NULL)
+		nd->NW = old_ne;
+		nd->NE = old_nw;
+		nd->SW = old_se;
+		nd->SE = old_sw;
+
+		if (nd->NW != NULL)
 		{
-			ne_width = subroot->NE->lowRight.first - subroot->NE->upLeft.first + 1;
+			nd->NW->upLeft = nw_ul;
+			nd->NW->lowRight = nw_lr;
 		}
-		ne_ul.first = parent_ul.first + ne_width;
-		ne_ul.second = parent_ul.second;
-		ne_lr.first = parent_lr.first;
-		ne_lr.second = subroot->NW->lowRight.second;
-	}
-	if (subroot->SE != NULL)
+		if (nd->NE != NULL)
+		{
+			nd->NE->upLeft = ne_ul;
+			nd->NE->lowRight = ne_lr;
+		}
+		if (nd->SW != NULL)
+		{
+			nd->SW->upLeft = sw_ul;
+			nd->SW->lowRight = sw_lr;
+		}
+		if (nd->SE != NULL)
+		{
+			nd->SE->upLeft = se_ul;
+			nd->SE->lowRight = se_lr;
+		}
+	});
+}
+
+template <class Metric>
+bool QTree::PruneNode(Node *subroot, typename Metric::value_type tol)
+{
+	// a stub is pruned later, with the subtree it stands for (see Prune)
+	if (subroot == NULL || IsSpilled(subroot))
 	{
-		sw_ul.first = parent_ul.first;
-		sw_ul.second = subroot->SE->upLeft.second;
-		sw_lr.first = parent_ul.first + subroot->SE->lowRight.first - subroot->SE->upLeft.first;
-		sw_lr.second = subroot->SE->lowRight.second;
+		return false;
 	}
-	if (subroot->SW != NULL)
+	bool found = false;
+	if (toleranceLeaves<Metric>(subroot, subroot->avg, tol, found) && found)
 	{
-		unsigned int se_width = 0;
-		if (subroot->SE != NULL)
-		{
-			se_width = subroot->SE->lowRight.first - subroot->SE->upLeft.first + 1;
-		}
-		se_ul.first = parent_ul.first + se_width;
-		se_ul.second = subroot->SW->upLeft.second;
-		se_lr.first = parent_lr.first;
-		se_lr.second = parent_lr.second;
+		// only a flat leaf is left as it was
+		bool changed = !IsLeaf(subroot) || subroot->block != NULL || subroot->gradient != NULL;
+		ClearNode(subroot->NW);
+		ClearNode(subroot->NE);
+		ClearNode(subroot->SW);
+		ClearNode(subroot->SE);
+		subroot->NW = nullptr;
+		subroot->NE = nullptr;
+		subroot->SW = nullptr;
+		subroot->SE = nullptr;
+		delete[] subroot->block;
+		subroot->block = nullptr;
+		delete[] subroot->gradient;
+		subroot->gradient = nullptr;
+		return changed;
 	}
-
-	Node *old_nw = subroot->NW;
-	Node *old_ne = subroot->NE;
-	Node *old_sw = subroot->SW;
-	Node *old_se = subroot->SE;
-
-	subroot->NW = FlipHorizontalNode(old_ne, nw_ul, nw_lr);
-	subroot->NE = FlipHorizontalNode(old_nw, ne_ul, ne_lr);
-	subroot->SW = FlipHorizontalNode(old_se, sw_ul, sw_lr);
-	subroot->SE = FlipHorizontalNode(old_sw, se_ul, se_lr);
-
-	return subroot;
+	bool changed = PruneNode<Metric>(subroot->NW, tol);
+	changed |= PruneNode<Metric>(subroot->NE, tol);
+	changed |= PruneNode<Metric>(subroot->SW, tol);
+	changed |= PruneNode<Metric>(subroot->SE, tol);
+	return changed;
 }
 
-void QTree::PruneNode(Node *subroot, double tol, RGBAPixel p)
+template <class Metric>
+void QTree::ParallelPruneNode(Node *subroot, typename Metric::value_type tol, unsigned int cutoff, TaskGroup &work,
+							  atomic<bool> &changed)
 {
-	if (subroot == NULL)
+	if (subroot == NULL || IsSpilled(subroot))
 	{
 		return;
 	}
-	else
+	unsigned long long area = (unsigned long long)(subroot->lowRight.first - subroot->upLeft.first + 1) *
+							  (subroot->lowRight.second - subroot->upLeft.second + 1);
+	if (area <= cutoff)
 	{
-		if (toleranceLeaves(subroot, p, tol))
+		if (PruneNode<Metric>(subroot, tol))
 		{
-			ClearNode(subroot->NW);
-			ClearNode(subroot->NE);
-			ClearNode(subroot->SW);
-			ClearNode(subroot->SE);
-			subroot->NW = nullptr;
-			subroot->NE = nullptr;
-			subroot->SW = nullptr;
-			subroot->SE = nullptr;
-			return;
+			changed = true;
 		}
-		PruneNode(subroot->NW, tol, subroot->avg);
-		PruneNode(subroot->NE, tol, subroot->avg);
-		PruneNode(subroot->SW, tol, subroot->avg);
-		PruneNode(subroot->SE, tol, subroot->avg);
+		return;
 	}
-}
 
-bool QTree::toleranceLeaves(Node *subroot, RGBAPixel pixel, double tol)
-{
-	// Step 1 : find the leaves
-	// Step 2 : find an array with checking the tol value
-	// Step 3 : if the size of leaves is equal to the size of the leaves array then return true
-	if (subroot != NULL)
+	bool found = false;
+	if (toleranceLeaves<Metric>(subroot, subroot->avg, tol, found) && found)
 	{
-		vector<Node *> nodeArray = findLeaves(subroot);
-		if (nodeArray.size() == 0)
+		if (!IsLeaf(subroot) || subroot->block != NULL || subroot->gradient != NULL)
 		{
-			return false;
+			changed = true;
 		}
-		vector<Node *> nn;
-		for (int i = 0; i < nodeArray.size(); i++)
+		// detach now, free later: nothing else can reach these nodes, once
+		// the spill file has forgotten any of them it holds
+		Node *discarded[4] = {subroot->NW, subroot->NE, subroot->SW, subroot->SE};
+		for (int i = 0; i < 4; i++)
 		{
-			if (nodeArray[i]->avg.distanceTo(subroot->avg) <= tol)
+			ForgetSpilled(discarded[i]);
+		}
+		subroot->NW = nullptr;
+		subroot->NE = nullptr;
+		subroot->SW = nullptr;
+		subroot->SE = nullptr;
+		delete[] subroot->block;
+		subroot->block = nullptr;
+		delete[] subroot->gradient;
+		subroot->gradient = nullptr;
+		// (the task may outlive this tree, so it must not touch it)
+		Reclaimer().Enqueue([discarded]() {
+			for (int i = 0; i < 4; i++)
 			{
-				nn.push_back(nodeArray[i]);
+				PostOrder(discarded[i], [](Node *nd) { delete nd; });
 			}
+		});
+		return;
+	}
+
+	Node *children[4] = {subroot->NW, subroot->NE, subroot->SW, subroot->SE};
+	for (int i = 0; i < 4; i++)
+	{
+		Node *child = children[i];
+		if (child != NULL)
+		{
+			work.Run([this, child, tol, cutoff, &work, &changed]() { ParallelPruneNode<Metric>(child, tol, cutoff, work, changed); });
 		}
-		return nn.size() == nodeArray.size();
 	}
-	return false;
 }
 
-vector<Node *> QTree::findLeaves(Node *subroot)
+/**
+ * Checks every pixel leaf under subroot against avg, stopping at the first
+ * one out of tolerance. Sets found if at least one pixel leaf was seen.
+ * Spilled subtrees are checked through copies read back for the purpose.
+ */
+template <class Metric>
+bool QTree::toleranceLeaves(const Node *subroot, const RGBAPixel &avg, typename Metric::value_type tol, bool &found) const
 {
-	vector<Node *> nodeArray;
-	if (subroot != NULL)
-	{
-		if ((subroot->upLeft == subroot->lowRight) && (subroot->NW == NULL) && (subroot->NE == NULL) && (subroot->SW == NULL) && (subroot->SE == NULL))
+	return AllLeaves(subroot, [this, &avg, tol, &found](const Node *leaf) {
+		// every pixel of a block leaf takes part
+		if (leaf->block != NULL)
 		{
-			nodeArray.push_back(subroot);
+			found = true;
+			const unsigned char *end = leaf->block + BlockBytes(leaf);
+			for (const unsigned char *p = leaf->block; p != end; p += 4)
+			{
+				if (Metric::Distance(BlockPixel(p), avg) > tol)
+				{
+					return false;
+				}
+			}
+			return true;
 		}
-		else
+		// as does every pixel of a gradient leaf
+		if (leaf->gradient != NULL)
 		{
-			vector<Node *> children = {subroot->NW, subroot->NE, subroot->SW, subroot->SE};
-			for (int i = 0; i < children.size(); i++)
+			found = true;
+			for (unsigned int y = 0; y <= leaf->lowRight.second - leaf->upLeft.second; y++)
 			{
-				vector<Node *> leaves = findLeaves(children[i]);
-				nodeArray.insert(nodeArray.end(), leaves.begin(), leaves.end());
+				for (unsigned int x = 0; x <= leaf->lowRight.first - leaf->upLeft.first; x++)
+				{
+					if (Metric::Distance(GradientPixel(leaf->gradient, x, y), avg) > tol)
+					{
+						return false;
+					}
+				}
 			}
+			return true;
 		}
-	}
-	return nodeArray;
-}
-void QTree::RotateCCWNode(Node* node, int node_width, int node_height) {
-    if (node == nullptr) {
-        return; 
-    }
-    Node* temp = node->NW;
-    node->NW = node->NE;
-    node->NE = node->SE;
-    node->SE = node->SW;
-    node->SW = temp;
-
-    int left_ul = node->upLeft.second;
-    int left_lr = node_width - node->lowRight.first - 1;
-    int right_lr = left_ul + (node->lowRight.second - node->upLeft.second);
-    int right_ul = left_lr + (node->lowRight.first - node->upLeft.first);
-
-    node->upLeft = make_pair(left_ul, left_lr);
-    node->lowRight = make_pair(right_lr, right_ul);
-
-    int new_width = node_height;
-    int new_height = node_width;
-    RotateCCWNode(node->NW, new_height, new_width);
-    RotateCCWNode(node->NE, new_height, new_width);
-    RotateCCWNode(node->SE, new_height, new_width);
-    RotateCCWNode(node->SW, new_height, new_width);
+		// only single-pixel leaves take part, as in an unpruned tree
+		if (leaf->upLeft != leaf->lowRight)
+		{
+			Node *spilled = LoadSpilled(leaf);
+			if (spilled == NULL)
+			{
+				return true;
+			}
+			bool within = toleranceLeaves<Metric>(spilled, avg, tol, found);
+			DeleteSubtree(spilled);
+			return within;
+		}
+		found = true;
+		return Metric::Distance(leaf->avg, avg) <= tol;
+	});
+}
+
+void QTree::RotateCCWNode(Node* subroot, int node_width) {
+    // every node moves independently of the others, given the image width
+    ParallelPreOrder(subroot, [node_width](Node* node) {
+        if (node->block != NULL)
+        {
+            // pixel (x, y) of a w x h block moves to (y, w - 1 - x) of the h x w one
+            unsigned int w = node->lowRight.first - node->upLeft.first + 1;
+            unsigned int h = node->lowRight.second - node->upLeft.second + 1;
+            unsigned char* rotated = new unsigned char[BlockBytes(node)];
+            for (unsigned int y = 0; y < h; y++)
+            {
+                for (unsigned int x = 0; x < w; x++)
+                {
+                    memcpy(rotated + ((size_t)(w - 1 - x) * h + y) * 4, node->block + ((size_t)y * w + x) * 4, 4);
+                }
+            }
+            delete[] node->block;
+            node->block = rotated;
+        }
+        if (node->gradient != NULL)
+        {
+            // the corner takes the color of the old north east corner; the
+            // old y step runs along x, and the old x step backwards along y
+            unsigned int w = node->lowRight.first - node->upLeft.first + 1;
+            for (int k = 0; k < 4; k++)
+            {
+                int xStep = node->gradient[4 + k];
+                node->gradient[k] += xStep * (int)(w - 1);
+                node->gradient[4 + k] = node->gradient[8 + k];
+                node->gradient[8 + k] = -xStep;
+            }
+        }
+
+        Node* temp = node->NW;
+        node->NW = node->NE;
+        node->NE = node->SE;
+        node->SE = node->SW;
+        node->SW = temp;
+
+        int left_ul = node->upLeft.second;
+        int left_lr = node_width - node->lowRight.first - 1;
+        int right_lr = left_ul + (node->lowRight.second - node->upLeft.second);
+        int right_ul = left_lr + (node->lowRight.first - node->upLeft.first);
+
+        node->upLeft = make_pair(left_ul, left_lr);
+        node->lowRight = make_pair(right_lr, right_ul);
+    });
 }
 
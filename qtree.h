@@ -9,13 +9,25 @@
 #ifndef _QTREE_H_
 #define _QTREE_H_
 
+#include <atomic>
+#include <functional>
+#include <string>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 #include "cs221util/PNG.h"
 #include "cs221util/RGBAPixel.h"
+#include "colormetric.h"
 
 using namespace std;
 using namespace cs221util;
 
+class TaskGroup;
+struct RawImage;
+class ColorIntegral;
+class TileDiff;
+class SpillStore;
+
 /**
  * Like we had for PA1, the Node class *should be* private to the tree
  * class via the principle of encapsulation -- the end user does not
@@ -25,6 +37,11 @@ using namespace cs221util;
 class Node {
 public:
     Node(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, RGBAPixel a); // Node constructor
+    ~Node(); // frees the block and gradient, if any
+
+    // nodes live in the per-thread NodePool (see nodepool.h)
+    static void* operator new(size_t size);
+    static void operator delete(void* p, size_t size);
 
     pair<unsigned int, unsigned int> upLeft;   // image coordinates of upper-left corner of node's rectangular region
     pair<unsigned int, unsigned int> lowRight; // image coordinates of lower-right corner of node's rectangular region
@@ -33,6 +50,91 @@ public:
     Node* NE; // upper-right child
     Node* SW; // lower-left child
     Node* SE; // lower-right child
+    unsigned char* block; // block leaves only: the rectangle's pixels, packed RGBA8, row-major; null otherwise
+    int* gradient; // gradient leaves only: R, G, B, A (alpha scaled to 255) at upLeft, then their steps per pixel
+                   // in x, then in y, all in 16.16 fixed point; null otherwise
+
+private:
+    Node(const Node& other);
+    Node& operator=(const Node& other);
+};
+
+/**
+ * Node counts of a QTree whose identical subtrees may be shared
+ * (see QTree::Deduplicate).
+ */
+struct DedupStats {
+    size_t nodes;       // nodes of the tree, counting every use of a shared subtree
+    size_t uniqueNodes; // nodes actually allocated
+    double ratio;       // nodes / uniqueNodes; 1 when nothing is shared
+};
+
+/**
+ * How a QTree is built from an image.
+ */
+struct BuildOptions {
+    enum Split {
+        MIDPOINT, // halve each rectangle, extra line to the upper/left side
+        ADAPTIVE  // split where the colors on either side are most uniform
+    };
+
+    Split split;
+
+    // Subdivision stops at rectangles at most blockSize pixels on each
+    // side, which become block leaves holding their raw pixels (see
+    // Node::block). 1 gives the usual single-pixel leaves.
+    unsigned int blockSize;
+
+    enum Layout {
+        ALLOCATOR,    // nodes stay wherever the node pool put them
+        VAN_EMDE_BOAS // nodes are moved into van Emde Boas order (see QTree::Relayout)
+    };
+
+    Layout layout;
+
+    BuildOptions();
+};
+
+/**
+ * Outcome of QTree::PruneToBudget.
+ */
+struct PruneStats {
+    size_t nodes;        // nodes left in the tree
+    double squaredError; // sum over pixels and R, G, B, A (alpha scaled to 255) of the squared
+                         // difference between the pruned tree and the tree before pruning
+};
+
+/**
+ * What a QTree decoding constructor made of its encoding.
+ */
+enum DecodeResult {
+    DECODE_COMPLETE,  // every record was decoded
+    DECODE_TRUNCATED, // the encoding ends early; the tree is the coarser one its prefix describes,
+                      // or empty (Width() 0) if not even the header arrived
+    DECODE_MALFORMED  // the encoding is corrupt; the tree is empty
+};
+
+/**
+ * Memory budget of a QTree (see QTree::SetMemoryBudget).
+ */
+struct SpillOptions {
+    size_t budget;    // bytes of nodes, blocks and gradients kept in memory; 0 for no budget
+    size_t unitBytes; // largest subtree spilled as one piece
+    string directory; // where the spill file is created
+
+    SpillOptions(); // no budget, 256 KB units, /tmp
+};
+
+/**
+ * Spilling counters of a QTree; all but residentBytes count from the last
+ * SetMemoryBudget.
+ */
+struct SpillStats {
+    unsigned long long spills;   // subtrees written to the spill file
+    unsigned long long faultIns; // spilled subtrees read back
+    size_t residentBytes;        // bytes of nodes, blocks and gradients in memory
+    size_t spilledBytes;         // bytes of the spilled subtrees, in the spill file
+    size_t stubs;                // subtrees spilled at present
 };
 
 /**
@@ -70,12 +172,12 @@ public:
     /**
      * Counts the number of nodes in the tree
      */
-    unsigned int CountNodes() const;
+    size_t CountNodes() const;
 
     /**
      * Counts the number of leaves in the tree
      */
-    unsigned int CountLeaves() const;
+    size_t CountLeaves() const;
 
     /* =============== end of given functions ====================*/
 
@@ -117,6 +219,38 @@ public:
      */
     QTree(const PNG& imIn);
 
+    /**
+     * Constructor that builds a QTree straight from caller-owned 8-bit
+     * pixels (see rawimage.h), e.g. a decoded frame already in memory or a
+     * MappedImage, without first copying them into a PNG. The tree is
+     * identical to the one built from the equivalent PNG.
+     *
+     * @param imIn view of the pixels; only read during construction
+     */
+    QTree(const RawImage& imIn);
+
+    /**
+     * Constructors that build the tree as options say. With ADAPTIVE
+     * splits, each node picks its west column width and north row height
+     * independently, each minimizing the summed squared color error of the
+     * two sides it separates, so an edge off the midpoint is separated in
+     * one split instead of many. Candidates are restricted to the middle
+     * half of the rectangle (keeping the depth logarithmic), and the
+     * midpoint wins ties. As with the default constructor, the tree goes
+     * down to single pixels; only the rectangles differ, so Prune,
+     * Render, FlipHorizontal and RotateCCW work unchanged.
+     *
+     * With a blockSize above 1, subdivision stops at blocks of at most
+     * blockSize x blockSize pixels, whose leaves keep the pixels packed
+     * as RGBA8 (alpha at byte precision, as in PNG files) instead of one
+     * node per pixel. Render copies those pixels; Prune tests them against
+     * the tolerance like single-pixel leaves and drops the block of a
+     * pruned leaf; CountLeaves counts each block once; FlipHorizontal and
+     * RotateCCW transform the pixels along with the rectangle.
+     */
+    QTree(const PNG& imIn, const BuildOptions& options);
+    QTree(const RawImage& imIn, const BuildOptions& options);
+
     /**
      * Overloaded assignment operator for QTrees.
      * Part of the Big Three that we must define because the class
@@ -141,6 +275,33 @@ public:
      */
     PNG Render(unsigned int scale) const;
 
+    /**
+     * RenderRegion renders only the part of Render(scale) that falls in
+     * the viewport with corners ul and lr (inclusive, in scaled output
+     * coordinates). Subtrees whose rectangles miss the viewport are
+     * skipped, so the cost depends on the visible area only.
+     * Viewport pixels outside the image are left at the default color.
+     *
+     * @param ul upper left corner of the viewport
+     * @param lr lower right corner of the viewport
+     * @param scale multiplier for each horizontal/vertical dimension
+     * @pre scale > 0, ul.first <= lr.first and ul.second <= lr.second
+     * @return image of (lr.first - ul.first + 1) x (lr.second - ul.second + 1) pixels
+     */
+    PNG RenderRegion(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, unsigned int scale) const;
+
+    /**
+     * Renders Render(scale) straight into caller-owned memory, as 8-bit
+     * RGBA rows: each pixel gets the four bytes PNG::writeToFile would
+     * encode for it. No PNG is built in between.
+     *
+     * @param out first byte of the upper left pixel; Height() * scale rows
+     *            of Width() * scale pixels
+     * @param stride bytes from one row to the next; 0 for Width() * scale * 4
+     * @pre scale > 0
+     */
+    void RenderInto(unsigned char* out, size_t stride, unsigned int scale) const;
+
     /**
      *  Prune function trims subtrees as high as possible in the tree.
      *  A subtree is pruned (cleared) if all of the subtree's leaves are within
@@ -156,6 +317,78 @@ public:
      */
     void Prune(double tolerance);
 
+    /**
+     * Prune with a compile-time choice of color distance (see colormetric.h).
+     * Prune(tolerance) is Prune<PremultipliedDistance>(tolerance).
+     * Instantiated for PremultipliedDistance, SquaredRGBDistance,
+     * MaxChannelDistance and LumaWeightedDistance.
+     *
+     * @param tolerance maximum distance, in the metric's units, to qualify for pruning
+     * @pre this tree has not previously been pruned, nor is copied from a previously pruned tree.
+     */
+    template <class Metric>
+    void Prune(double tolerance);
+
+    /**
+     * Multi-threaded Prune, producing exactly the same tree as
+     * Prune<Metric>(tolerance). Once a node is kept, its children decide
+     * independently, so each is handed to the shared ThreadPool; subtrees
+     * covering at most cutoff pixels are pruned serially within one task.
+     * Discarded subtrees are freed on a background thread of their own,
+     * which waiting on the shared pool never helps with, so the frees stay
+     * off the prune's critical path.
+     *
+     * @param tolerance maximum distance, in the metric's units, to qualify for pruning
+     * @param cutoff largest subtree area (in pixels) pruned serially in one task
+     * @pre this tree has not previously been pruned, nor is copied from a previously pruned tree.
+     */
+    template <class Metric>
+    void ParallelPrune(double tolerance, unsigned int cutoff);
+
+    /**
+     * ParallelPrune with the original RGBAPixel::distanceTo metric.
+     */
+    void ParallelPrune(double tolerance, unsigned int cutoff);
+
+    /**
+     * Prune that can also replace a subtree by a gradient leaf (see
+     * Node::gradient), whose color varies linearly across its rectangle.
+     * A subtree is pruned to a flat leaf exactly when Prune would prune it;
+     * failing that, to a gradient leaf if all of its leaves are within
+     * tolerance of the least-squares plane through its pixels, evaluated
+     * at each leaf. Smooth ramps then take a few gradient leaves instead of
+     * many flat ones. The planes come from per-node moments accumulated in
+     * one bottom-up pass, so each fit costs O(1).
+     *
+     * Render and RenderRegion draw gradients incrementally along each row;
+     * FlipHorizontal, RotateCCW, Deduplicate, PruneToBudget and
+     * EncodeProgressive handle gradient leaves; Quantize flattens them.
+     * PruneGradient(tolerance) is PruneGradient<PremultipliedDistance>(tolerance).
+     *
+     * @param tolerance maximum distance, in the metric's units, to qualify for pruning
+     * @pre this tree has not previously been pruned, nor is copied from a previously pruned tree.
+     */
+    template <class Metric>
+    void PruneGradient(double tolerance);
+    void PruneGradient(double tolerance);
+
+    /**
+     * Rate-distortion pruning: repeatedly collapses the subtree whose
+     * collapse adds the least squared error per node removed, until the
+     * tree has at most maxNodes nodes, or until the next collapse would
+     * take the total squared error past maxError, whichever comes first.
+     * Runs in O(n log n) for a tree of n nodes.
+     *
+     * Error is measured against the tree as it was before the call (the
+     * original image, for a tree that has not been pruned).
+     *
+     * @param maxNodes node budget; 0 prunes by maxError alone
+     * @param maxError error budget, in the units of PruneStats::squaredError;
+     *                 infinity prunes by maxNodes alone
+     * @return the node count and squared error reached
+     */
+    PruneStats PruneToBudget(size_t maxNodes, double maxError);
+
     /**
      *  FlipHorizontal rearranges the contents of the tree, so that
      *  its rendered image will appear mirrored across a vertical axis.
@@ -193,6 +426,176 @@ public:
 
     /* =============== end of public PA3 FUNCTIONS =========================*/
 
+    /* =============== additional public functions =========================*/
+
+    /**
+     * Width of the image represented by the tree (at scale 1).
+     */
+    unsigned int Width() const;
+
+    /**
+     * Height of the image represented by the tree (at scale 1).
+     */
+    unsigned int Height() const;
+
+    /**
+     * Number identifying what the tree holds. It changes with every
+     * operation that changes the tree, and no two trees ever have the
+     * same one, even a tree constructed where another was destroyed, so
+     * caches of rendered output (see tilecache.h) can key on it.
+     */
+    unsigned long long Generation() const;
+
+    /**
+     * Constructor that rebuilds a QTree from a level-ordered encoding
+     * (see progressive.h). The stream may be truncated: any region whose
+     * records are missing takes the average color of its nearest decoded
+     * ancestor.
+     *
+     * A corrupt encoding (a bad header, an impossible record, a varint
+     * past 64 bits) gives an empty tree instead.
+     *
+     * @param encoded bytes produced by EncodeProgressive
+     * @param result if not null, receives whether the encoding was
+     *               complete, truncated or malformed
+     */
+    QTree(const vector<unsigned char>& encoded, DecodeResult* result = NULL);
+
+    /**
+     * As above, reading the encoding from length bytes at data, which
+     * are not retained.
+     */
+    QTree(const unsigned char* data, size_t length, DecodeResult* result = NULL);
+
+    /**
+     * Appends a breadth-first, coarse-to-fine encoding of the tree to out:
+     * the root average first, then each level's children. Any prefix of
+     * the result can be decoded into a valid approximation of the image.
+     *
+     * @param out byte buffer to append to
+     */
+    void EncodeProgressive(vector<unsigned char>& out) const;
+
+    /**
+     * Clusters the leaf colors into a palette of at most k entries by
+     * median cut, weighting each leaf by its area, and replaces every
+     * leaf's average with its palette entry. Gradient leaves become flat
+     * leaves of their average color first. Intended to run after Prune,
+     * when the tree has few leaves compared to pixels; only leaves (and
+     * the pixels of block leaves) are examined, never the image. The palette is written with the tree by
+     * EncodeProgressive, which then stores leaves as one-byte indices.
+     *
+     * @param k maximum number of palette entries, clamped to [1, 256]
+     */
+    void Quantize(unsigned int k);
+
+    /**
+     * Palette produced by the last Quantize, or empty if the tree has
+     * not been quantized, or has been pruned (by any of the prunes, or
+     * UpdateFrame) since. Every leaf color (every pixel, for a block
+     * leaf) is one of its entries.
+     */
+    const vector<RGBAPixel>& Palette() const;
+
+    /**
+     * Shares identical subtrees, turning the tree into a DAG. Subtrees
+     * are identical when they have the same dimensions, the same shape
+     * and the same colors at every node, wherever they lie in the image;
+     * each set of identical subtrees is replaced by a single copy.
+     *
+     * Render, RenderRegion, the counts and EncodeProgressive give the
+     * same results as before. Prune, Quantize, FlipHorizontal and
+     * RotateCCW first expand the DAG back into a tree, so deduplicate
+     * after the last of them.
+     *
+     * @return node counts after sharing
+     */
+    DedupStats Deduplicate();
+
+    /**
+     * Node counts of the tree as it stands; nodes equals uniqueNodes
+     * unless Deduplicate has been called.
+     */
+    DedupStats SharingStats() const;
+
+    /**
+     * Moves every node into one contiguous run of memory, in van Emde Boas
+     * order: the top half of the tree's levels laid out the same way,
+     * followed by each subtree hanging below them, also laid out the same
+     * way. Any root-to-leaf path then touches O(log_B n) cache lines,
+     * whatever the line size B, and so do the top-down traversals of
+     * Render, Prune and the counts. Nodes still come from the node pool,
+     * so pruning and clearing free them as usual; the run goes back to
+     * the heap with the last of its nodes, so relayouts do not add up.
+     *
+     * Worth running once a tree is built (BuildOptions::VAN_EMDE_BOAS
+     * does so as part of construction) and again after a Prune, whose
+     * survivors are left scattered. Does nothing to a deduplicated tree.
+     */
+    void Relayout();
+
+    /**
+     * Sequence mode (see sequence.h): brings the tree up to date with a
+     * frame of the same size. Subtrees whose rectangles miss every tile
+     * marked in changed are kept as they are. A leaf over a changed tile,
+     * or a node with at least half of its tiles changed, is rebuilt from
+     * frame with options and pruned at tolerance; interior averages above
+     * it are recomputed from their children. Appends to delta the number
+     * of rebuilt subtrees, then a record for each.
+     *
+     * @return number of subtrees rebuilt
+     */
+    unsigned int UpdateFrame(const RawImage& frame, const TileDiff& changed, const BuildOptions& options, double tolerance,
+                             vector<unsigned char>& delta);
+
+    /**
+     * Applies what UpdateFrame appended to delta, starting at pos, to a
+     * tree in the state the updated tree was in before the update.
+     *
+     * @return false if delta is malformed
+     */
+    bool ApplyDelta(const vector<unsigned char>& delta, size_t pos);
+
+    /**
+     * Bounds the memory the tree takes. While its nodes, blocks and
+     * gradients take more than options.budget bytes, the coldest subtree
+     * of at most options.unitBytes (the one least recently read back;
+     * the largest, among those never read back) is written to a spill
+     * file and replaced by a stub: its root, kept with its rectangle and
+     * average color.
+     *
+     * Render, RenderRegion, the counts, EncodeProgressive and copies read
+     * the spilled subtrees they reach into temporary nodes, so they give
+     * the same results as before and leave the tree as it is; RenderRegion
+     * reads only the subtrees in its viewport. Prune, ParallelPrune,
+     * PruneGradient, FlipHorizontal, RotateCCW, Quantize, UpdateFrame and
+     * ApplyDelta fault in only the spilled subtrees they reach, one at a
+     * time, and spill each again once done with it, so they run in about
+     * the budget plus one unit; PruneToBudget, Deduplicate and Relayout
+     * fault every spilled subtree back in first. Either way the tree is
+     * spilled down to the budget again afterwards. Copies have no budget,
+     * and deduplicated trees are not spilled.
+     *
+     * Should the spill file fail to read back, the reads above use the
+     * stub as a leaf, while an operation that changes the tree throws
+     * runtime_error and leaves the subtree spilled rather than lose it
+     * (an operation that faults in on demand may by then have changed
+     * the rest of the tree).
+     *
+     * @param options the budget; a budget of 0 faults everything back in
+     *                and closes the spill file
+     * @return false if the spill file could not be created, or if a
+     *         spilled subtree could not be read back to change the budget;
+     *         the tree is then left without a budget, or with its old one
+     */
+    bool SetMemoryBudget(const SpillOptions& options);
+
+    /**
+     * Spilling counters, and the bytes the tree takes in memory (with or
+     * without a budget).
+     */
+    SpillStats SpillingStats() const;
+
 private:
     /*
      * Private member variables.
@@ -222,25 +625,34 @@ private:
     void Copy(const QTree& other);
 
     /**
-     * Private helper function for the constructor. Recursively builds
+     * Private helper function for the constructors. Recursively builds
      * the tree according to the specification of the constructor.
-     * @param img reference to the original input image.
+     * @param img reference to the original input image (a PNG or a RawImage).
      * @param ul upper left point of current node's rectangle.
      * @param lr lower right point of current node's rectangle.
+     * @param blockSize largest block leaf side; 1 for single-pixel leaves
+     */
+    template <class Image>
+    Node* BuildNode(const Image& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, unsigned int blockSize = 1);
+
+    /**
+     * BuildNode for BuildOptions::ADAPTIVE: splits where integral says
+     * the two sides are most uniform.
      */
-    Node* BuildNode(const PNG& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr);
+    template <class Image>
+    Node* BuildAdaptiveNode(const Image& img, const ColorIntegral& integral, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, unsigned int blockSize);
 
     /**
      * Private helper function for counting the total number of nodes in the tree. GIVEN
      * @param nd the root of the subtree whose nodes we want to count
      */
-    unsigned int CountNodes(Node* nd) const;
+    size_t CountNodes(Node* nd) const;
 
     /**
      * Private helper function for counting the number of leaves in the tree. GIVEN
      * @param nd the root of the subtree whose leaves we want to count
      */
-    unsigned int CountLeaves(Node* nd) const;
+    size_t CountLeaves(Node* nd) const;
 
     /* =================== end of private PA3 functions ============== */
 
@@ -0,0 +1,173 @@
+/**
+ * @file qtree_c.cpp
+ * @description C interface to QTree, for embedding the compressor in
+ *              programs not written in C++; all buffers are caller-owned
+ */
+
+#include <climits>
+#include <cstring>
+#include <new>
+#include "qtree.h"
+#include "qtree_c.h"
+#include "rawimage.h"
+
+/**
+ * The tree behind a handle, with its last encoding, kept so that a
+ * qtree_serialize retried with a larger buffer need not encode again.
+ */
+struct qtree
+{
+	QTree tree;
+	vector<unsigned char> encoded;
+	bool encodedValid;
+
+	qtree(const RawImage& image) : tree(image), encodedValid(false)
+	{
+	}
+
+	qtree(const unsigned char* data, size_t length, DecodeResult* result)
+		: tree(data, length, result), encodedValid(false)
+	{
+	}
+};
+
+namespace
+{
+	/**
+	 * Runs body, turning the exceptions it may throw into statuses, as
+	 * none may cross into C.
+	 */
+	template <class F>
+	qtree_status Guarded(F body)
+	{
+		try
+		{
+			return body();
+		}
+		catch (const bad_alloc&)
+		{
+			return QTREE_OUT_OF_MEMORY;
+		}
+		catch (...)
+		{
+			return QTREE_INTERNAL_ERROR;
+		}
+	}
+}
+
+qtree_status qtree_create_rgba(const unsigned char* pixels, unsigned int width, unsigned int height, size_t stride,
+							   qtree** out)
+{
+	if (pixels == NULL || out == NULL || width == 0 || height == 0 || (stride != 0 && stride < (size_t)width * 4))
+	{
+		return QTREE_INVALID_ARGUMENT;
+	}
+	*out = NULL;
+	return Guarded([=]() {
+		*out = new qtree(RGBAView(pixels, width, height, stride));
+		return QTREE_OK;
+	});
+}
+
+qtree_status qtree_deserialize(const unsigned char* data, size_t length, qtree** out)
+{
+	if (data == NULL || out == NULL || length == 0)
+	{
+		return QTREE_INVALID_ARGUMENT;
+	}
+	*out = NULL;
+	return Guarded([=]() {
+		DecodeResult result;
+		qtree* tree = new qtree(data, length, &result);
+		if (result == DECODE_MALFORMED)
+		{
+			delete tree;
+			return QTREE_MALFORMED;
+		}
+		*out = tree;
+		return QTREE_OK;
+	});
+}
+
+void qtree_free(qtree* tree)
+{
+	delete tree;
+}
+
+qtree_status qtree_prune(qtree* tree, double tolerance)
+{
+	if (tree == NULL || !(tolerance >= 0))
+	{
+		return QTREE_INVALID_ARGUMENT;
+	}
+	return Guarded([=]() {
+		tree->encodedValid = false;
+		tree->tree.Prune(tolerance);
+		return QTREE_OK;
+	});
+}
+
+qtree_status qtree_render(const qtree* tree, unsigned int scale, unsigned char* out, size_t stride, size_t capacity)
+{
+	if (tree == NULL || out == NULL || scale == 0 || (size_t)tree->tree.Width() * scale > UINT_MAX ||
+		(size_t)tree->tree.Height() * scale > UINT_MAX)
+	{
+		return QTREE_INVALID_ARGUMENT;
+	}
+	size_t rowBytes = (size_t)tree->tree.Width() * scale * 4;
+	size_t rows = (size_t)tree->tree.Height() * scale;
+	if (stride == 0)
+	{
+		stride = rowBytes;
+	}
+	if (stride < rowBytes)
+	{
+		return QTREE_INVALID_ARGUMENT;
+	}
+	if (capacity < (rows - 1) * stride + rowBytes)
+	{
+		return QTREE_BUFFER_TOO_SMALL;
+	}
+	return Guarded([=]() {
+		tree->tree.RenderInto(out, stride, scale);
+		return QTREE_OK;
+	});
+}
+
+qtree_status qtree_serialize(qtree* tree, unsigned char* out, size_t capacity, size_t* length)
+{
+	if (tree == NULL || length == NULL)
+	{
+		return QTREE_INVALID_ARGUMENT;
+	}
+	return Guarded([=]() {
+		if (!tree->encodedValid)
+		{
+			tree->encoded.clear();
+			tree->tree.EncodeProgressive(tree->encoded);
+			tree->encodedValid = true;
+		}
+		*length = tree->encoded.size();
+		if (out == NULL || capacity < tree->encoded.size())
+		{
+			return QTREE_BUFFER_TOO_SMALL;
+		}
+		memcpy(out, tree->encoded.data(), tree->encoded.size());
+		return QTREE_OK;
+	});
+}
+
+qtree_status qtree_get_stats(const qtree* tree, qtree_stats* stats)
+{
+	if (tree == NULL || stats == NULL)
+	{
+		return QTREE_INVALID_ARGUMENT;
+	}
+	return Guarded([=]() {
+		stats->width = tree->tree.Width();
+		stats->height = tree->tree.Height();
+		stats->nodes = tree->tree.CountNodes();
+		stats->leaves = tree->tree.CountLeaves();
+		return QTREE_OK;
+	});
+}
@@ -0,0 +1,123 @@
+/**
+ * @file qtree_c.h
+ * @description C interface to QTree, for embedding the compressor in
+ *              programs not written in C++; all buffers are caller-owned
+ */
+
+#ifndef _QTREE_C_H_
+#define _QTREE_C_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Symbols exported from the shared library. Build it with QTREE_BUILD
+ * defined, and with hidden visibility by default (-fvisibility=hidden)
+ * so that only these are exported; programs using it define neither.
+ */
+#if defined(_WIN32)
+#ifdef QTREE_BUILD
+#define QTREE_API __declspec(dllexport)
+#else
+#define QTREE_API __declspec(dllimport)
+#endif
+#else
+#define QTREE_API __attribute__((visibility("default")))
+#endif
+
+/**
+ * A tree, opaque to callers. Calls on different trees may run
+ * concurrently; calls on the same tree must not overlap.
+ */
+typedef struct qtree qtree;
+
+/**
+ * Outcome of a call. No call lets an exception escape, and none prints:
+ * failing allocations give QTREE_OUT_OF_MEMORY, and any other failure
+ * inside the library (such as a spilled subtree that cannot be read
+ * back) gives QTREE_INTERNAL_ERROR.
+ */
+typedef enum qtree_status {
+    QTREE_OK = 0,
+    QTREE_INVALID_ARGUMENT = 1, /* null pointer, zero size or scale, or a size overflowing 32 bits */
+    QTREE_BUFFER_TOO_SMALL = 2, /* the output buffer cannot hold the result; nothing was written */
+    QTREE_MALFORMED = 3,        /* the encoding is corrupt (DECODE_MALFORMED) */
+    QTREE_OUT_OF_MEMORY = 4,
+    QTREE_INTERNAL_ERROR = 5    /* the call failed inside the library; the tree may be partly updated */
+} qtree_status;
+
+/**
+ * Size and node counts of a tree.
+ */
+typedef struct qtree_stats {
+    unsigned int width;  /* of the image at scale 1 */
+    unsigned int height;
+    size_t nodes;
+    size_t leaves;
+} qtree_stats;
+
+/**
+ * Builds a tree from 8-bit RGBA pixels, read in place (the buffer is
+ * not copied) and not retained after the call.
+ *
+ * @param pixels first byte of the upper left pixel
+ * @param stride bytes from one row to the next; 0 for width * 4
+ * @param out receives the new tree, to be freed with qtree_free
+ */
+QTREE_API qtree_status qtree_create_rgba(const unsigned char* pixels, unsigned int width, unsigned int height,
+                                         size_t stride, qtree** out);
+
+/**
+ * Rebuilds a tree from an encoding made by qtree_serialize. A truncated
+ * encoding gives the coarser tree its prefix describes.
+ *
+ * @param out receives the new tree, to be freed with qtree_free
+ */
+QTREE_API qtree_status qtree_deserialize(const unsigned char* data, size_t length, qtree** out);
+
+/**
+ * Frees a tree and everything it holds; null is ignored.
+ */
+QTREE_API void qtree_free(qtree* tree);
+
+/**
+ * Collapses every subtree whose leaves are all within tolerance of its
+ * average color (QTree::Prune).
+ */
+QTREE_API qtree_status qtree_prune(qtree* tree, double tolerance);
+
+/**
+ * Renders the tree, each pixel scaled to scale x scale, as 8-bit RGBA
+ * rows written straight into out.
+ *
+ * @param stride bytes from one row to the next; 0 for width * scale * 4
+ * @param capacity bytes available at out; at least
+ *                 (height * scale - 1) * stride + width * scale * 4
+ */
+QTREE_API qtree_status qtree_render(const qtree* tree, unsigned int scale, unsigned char* out, size_t stride,
+                                    size_t capacity);
+
+/**
+ * Writes the tree's progressive encoding (see progressive.h) to out.
+ * If capacity is too small, or out is null, nothing is written, the
+ * result is QTREE_BUFFER_TOO_SMALL, and *length is set to the size
+ * needed; the encoding is kept, so the retry with a larger buffer only
+ * copies it.
+ *
+ * @param length receives the number of bytes written (or needed)
+ */
+QTREE_API qtree_status qtree_serialize(qtree* tree, unsigned char* out, size_t capacity, size_t* length);
+
+/**
+ * Size and node counts of the tree.
+ */
+QTREE_API qtree_status qtree_get_stats(const qtree* tree, qtree_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,223 @@
+/**
+ * @file quantize.cpp
+ * @description median-cut palette quantization of QTree leaf colors
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+#include "qtree.h"
+#include "qtree-traversal.h"
+#include "spill.h"
+
+namespace
+{
+	// A distinct leaf color, channels in 0..255 (alpha scaled), and the
+	// number of pixels it covers.
+	struct Sample
+	{
+		int channel[4];
+		unsigned long long weight;
+	};
+
+	// A run [begin, end) of samples forming one palette entry.
+	struct Box
+	{
+		size_t begin;
+		size_t end;
+		int axis;   // channel with the widest range
+		int extent; // that range
+	};
+
+	void Measure(const vector<Sample>& samples, Box& box)
+	{
+		box.axis = 0;
+		box.extent = 0;
+		for (int c = 0; c < 4; c++)
+		{
+			int lo = 255, hi = 0;
+			for (size_t i = box.begin; i < box.end; i++)
+			{
+				lo = min(lo, samples[i].channel[c]);
+				hi = max(hi, samples[i].channel[c]);
+			}
+			if (hi - lo > box.extent)
+			{
+				box.axis = c;
+				box.extent = hi - lo;
+			}
+		}
+	}
+
+	// Weighted mean of the box, at the precision the palette is stored in.
+	RGBAPixel Mean(const vector<Sample>& samples, const Box& box)
+	{
+		double sum[4] = {0, 0, 0, 0};
+		double total = 0;
+		for (size_t i = box.begin; i < box.end; i++)
+		{
+			for (int c = 0; c < 4; c++)
+			{
+				sum[c] += (double)samples[i].channel[c] * samples[i].weight;
+			}
+			total += samples[i].weight;
+		}
+		return RGBAPixel((unsigned char)lround(sum[0] / total), (unsigned char)lround(sum[1] / total),
+						 (unsigned char)lround(sum[2] / total), lround(sum[3] / total) / 255.0);
+	}
+
+	unsigned int Pack(const RGBAPixel& p)
+	{
+		return p.r | (p.g << 8) | (p.b << 16) | ((unsigned int)lround(p.a * 255) << 24);
+	}
+
+	unsigned int PackBytes(const unsigned char* p)
+	{
+		return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+	}
+}
+
+void QTree::Quantize(unsigned int k)
+{
+	k = max(1u, min(k, 256u));
+	SpillGuard guard(*this, SpillGuard::ON_DEMAND);
+	Unshare();
+
+	unordered_map<unsigned int, size_t> slot;
+	vector<Sample> samples;
+	auto addSample = [&slot, &samples](unsigned int key, unsigned long long weight) {
+		pair<unordered_map<unsigned int, size_t>::iterator, bool> ins = slot.insert(make_pair(key, samples.size()));
+		if (ins.second)
+		{
+			Sample s = {{(int)(key & 0xff), (int)((key >> 8) & 0xff), (int)((key >> 16) & 0xff), (int)(key >> 24)}, 0};
+			samples.push_back(s);
+		}
+		samples[ins.first->second].weight += weight;
+	};
+	auto addLeaf = [&addSample](const Node* nd) {
+		if (nd->block != NULL)
+		{
+			// a block leaf is rendered from its pixels, each of weight 1
+			for (size_t b = 0; b < BlockBytes(nd); b += 4)
+			{
+				addSample(PackBytes(nd->block + b), 1);
+			}
+			return;
+		}
+		// a gradient has no palette form; the leaf falls back to its average
+		unsigned long long area = (unsigned long long)(nd->lowRight.first - nd->upLeft.first + 1) *
+								  (nd->lowRight.second - nd->upLeft.second + 1);
+		addSample(Pack(nd->avg), area);
+	};
+
+	// gather the distinct leaf colors, weighted by area; those of a
+	// spilled subtree from a copy read back in its place
+	vector<Node*> leaves;
+	ForEachLeaf(root, [this, &leaves, &addLeaf](Node* nd) {
+		Node* spilled = LoadSpilled(nd);
+		if (spilled != NULL)
+		{
+			ForEachLeaf(spilled, addLeaf);
+			DeleteSubtree(spilled);
+			return;
+		}
+		leaves.push_back(nd);
+		addLeaf(nd);
+	});
+
+	// repeatedly split the box with the widest channel range at its
+	// weighted median along that channel
+	vector<Box> boxes;
+	if (!samples.empty())
+	{
+		Box all = {0, samples.size(), 0, 0};
+		Measure(samples, all);
+		boxes.push_back(all);
+	}
+	while (boxes.size() < k)
+	{
+		size_t widest = 0;
+		for (size_t i = 1; i < boxes.size(); i++)
+		{
+			if (boxes[i].extent > boxes[widest].extent)
+			{
+				widest = i;
+			}
+		}
+		Box box = boxes[widest];
+		if (box.extent == 0)
+		{
+			break;
+		}
+
+		int axis = box.axis;
+		sort(samples.begin() + box.begin, samples.begin() + box.end,
+			 [axis](const Sample& s, const Sample& t) { return s.channel[axis] < t.channel[axis]; });
+
+		unsigned long long total = 0, below = 0;
+		for (size_t i = box.begin; i < box.end; i++)
+		{
+			total += samples[i].weight;
+		}
+		size_t split = box.begin + 1;
+		for (size_t i = box.begin; i + 1 < box.end; i++)
+		{
+			below += samples[i].weight;
+			split = i + 1;
+			if (2 * below >= total)
+			{
+				break;
+			}
+		}
+
+		Box lower = {box.begin, split, 0, 0};
+		Box upper = {split, box.end, 0, 0};
+		Measure(samples, lower);
+		Measure(samples, upper);
+		boxes[widest] = lower;
+		boxes.push_back(upper);
+	}
+
+	// one entry per box; boxes whose means coincide share an entry
+	palette.clear();
+	unordered_map<unsigned int, unsigned char> index, entryOf;
+	for (size_t i = 0; i < boxes.size(); i++)
+	{
+		RGBAPixel color = Mean(samples, boxes[i]);
+		pair<unordered_map<unsigned int, unsigned char>::iterator, bool> ins =
+			index.insert(make_pair(Pack(color), (unsigned char)palette.size()));
+		if (ins.second)
+		{
+			palette.push_back(color);
+		}
+		for (size_t j = boxes[i].begin; j < boxes[i].end; j++)
+		{
+			const int* c = samples[j].channel;
+			entryOf[c[0] | (c[1] << 8) | (c[2] << 16) | ((unsigned int)c[3] << 24)] = ins.first->second;
+		}
+	}
+
+	auto remap = [this, &entryOf](Node* nd) {
+		delete[] nd->gradient;
+		nd->gradient = NULL;
+		if (nd->block != NULL)
+		{
+			for (size_t b = 0; b < BlockBytes(nd); b += 4)
+			{
+				PackBlockPixel(palette[entryOf[PackBytes(nd->block + b)]], nd->block + b);
+			}
+			return;
+		}
+		nd->avg = palette[entryOf[Pack(nd->avg)]];
+	};
+	for (size_t i = 0; i < leaves.size(); i++)
+	{
+		remap(leaves[i]);
+	}
+	ForEachSpilled([&remap](Node* unit) { ForEachLeaf(unit, remap); });
+}
+
+const vector<RGBAPixel>& QTree::Palette() const
+{
+	return palette;
+}
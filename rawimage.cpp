@@ -0,0 +1,251 @@
+/**
+ * @file rawimage.cpp
+ * @description non-owning views of 8-bit RGB/RGBA pixel buffers, and
+ *              memory-mapped raw, PPM and PAM image files
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "rawimage.h"
+
+namespace
+{
+	// Minimal cursor over a header: skips whitespace and '#' comments
+	// and reads unsigned decimal numbers and tokens.
+	struct HeaderReader
+	{
+		const char* pos;
+		const char* end;
+
+		void SkipSpace()
+		{
+			while (pos < end)
+			{
+				if (*pos == '#')
+				{
+					while (pos < end && *pos != '\n')
+					{
+						pos++;
+					}
+				}
+				else if (*pos == ' ' || *pos == '\t' || *pos == '\r' || *pos == '\n')
+				{
+					pos++;
+				}
+				else
+				{
+					return;
+				}
+			}
+		}
+
+		bool Number(unsigned long& value)
+		{
+			SkipSpace();
+			if (pos >= end || *pos < '0' || *pos > '9')
+			{
+				return false;
+			}
+			value = 0;
+			while (pos < end && *pos >= '0' && *pos <= '9')
+			{
+				value = value * 10 + (*pos - '0');
+				if (value > 0xffffffffUL)
+				{
+					return false;
+				}
+				pos++;
+			}
+			return true;
+		}
+
+		string Token()
+		{
+			SkipSpace();
+			const char* start = pos;
+			while (pos < end && *pos != ' ' && *pos != '\t' && *pos != '\r' && *pos != '\n')
+			{
+				pos++;
+			}
+			return string(start, pos);
+		}
+	};
+}
+
+RawImage RGBAView(const unsigned char* data, unsigned int width, unsigned int height, size_t stride)
+{
+	RawImage view;
+	view.data = data;
+	view.width = width;
+	view.height = height;
+	view.stride = stride != 0 ? stride : (size_t)width * 4;
+	view.channels = 4;
+	return view;
+}
+
+MappedImage::MappedImage()
+{
+	mapping = NULL;
+	length = 0;
+	view = RGBAView(NULL, 0, 0);
+}
+
+MappedImage::~MappedImage()
+{
+	Close();
+}
+
+bool MappedImage::Open(const string& fileName)
+{
+	Close();
+	if (!Map(fileName) || !ParseHeader())
+	{
+		Close();
+		return false;
+	}
+	return true;
+}
+
+bool MappedImage::OpenRaw(const string& fileName, unsigned int width, unsigned int height)
+{
+	Close();
+	if (!Map(fileName) || length / 4 / max(width, 1u) < height)
+	{
+		Close();
+		return false;
+	}
+	view = RGBAView((const unsigned char*)mapping, width, height);
+	return true;
+}
+
+void MappedImage::Close()
+{
+	if (mapping != NULL)
+	{
+		munmap(mapping, length);
+	}
+	mapping = NULL;
+	length = 0;
+	view = RGBAView(NULL, 0, 0);
+}
+
+const RawImage& MappedImage::View() const
+{
+	return view;
+}
+
+bool MappedImage::Map(const string& fileName)
+{
+	int fd = open(fileName.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0)
+	{
+		close(fd);
+		return false;
+	}
+	length = info.st_size;
+	void* addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+	{
+		length = 0;
+		return false;
+	}
+	// pixels are read front to back exactly once while building
+	madvise(addr, length, MADV_SEQUENTIAL);
+	mapping = addr;
+	return true;
+}
+
+bool MappedImage::ParseHeader()
+{
+	HeaderReader header = {(const char*)mapping, (const char*)mapping + length};
+	string magic = header.Token();
+	unsigned long width = 0, height = 0, depth = 0, maxval = 0;
+
+	if (magic == "P6")
+	{
+		depth = 3;
+		if (!header.Number(width) || !header.Number(height) || !header.Number(maxval))
+		{
+			return false;
+		}
+		// exactly one whitespace byte separates the header from the pixels
+		if (header.pos >= header.end)
+		{
+			return false;
+		}
+		header.pos++;
+	}
+	else if (magic == "P7")
+	{
+		while (true)
+		{
+			string key = header.Token();
+			if (key == "ENDHDR")
+			{
+				break;
+			}
+			bool understood;
+			if (key == "WIDTH")
+			{
+				understood = header.Number(width);
+			}
+			else if (key == "HEIGHT")
+			{
+				understood = header.Number(height);
+			}
+			else if (key == "DEPTH")
+			{
+				understood = header.Number(depth);
+			}
+			else if (key == "MAXVAL")
+			{
+				understood = header.Number(maxval);
+			}
+			else
+			{
+				// the tuple type is implied by the depth
+				understood = key == "TUPLTYPE" && !header.Token().empty();
+			}
+			if (!understood)
+			{
+				return false;
+			}
+		}
+		if (header.pos >= header.end || *header.pos != '\n')
+		{
+			return false;
+		}
+		header.pos++;
+	}
+	else
+	{
+		return false;
+	}
+
+	if (width == 0 || height == 0 || maxval != 255 || (depth != 3 && depth != 4))
+	{
+		return false;
+	}
+	size_t offset = header.pos - (const char*)mapping;
+	if ((length - offset) / depth / width < height)
+	{
+		return false;
+	}
+
+	view.data = (const unsigned char*)mapping + offset;
+	view.width = width;
+	view.height = height;
+	view.stride = (size_t)width * depth;
+	view.channels = depth;
+	return true;
+}
@@ -0,0 +1,98 @@
+/**
+ * @file rawimage.h
+ * @description non-owning views of 8-bit RGB/RGBA pixel buffers, and
+ *              memory-mapped raw, PPM and PAM image files
+ */
+
+#ifndef _RAWIMAGE_H_
+#define _RAWIMAGE_H_
+
+#include <cstddef>
+#include <string>
+#include "cs221util/RGBAPixel.h"
+
+using namespace std;
+using namespace cs221util;
+
+/**
+ * RawImage: a view of caller-owned, interleaved 8-bit pixels.
+ * Rows are stride bytes apart; each pixel is channels bytes, either
+ * R G B (alpha taken as opaque) or R G B A.
+ * The view never copies or frees the pixels.
+ */
+struct RawImage {
+    const unsigned char* data; // first byte of the upper left pixel
+    unsigned int width;
+    unsigned int height;
+    size_t stride;             // bytes from one row to the next
+    unsigned int channels;     // 3 (RGB) or 4 (RGBA)
+
+    /**
+     * Converts the pixel at (x, y) exactly as PNG::readFromFile would.
+     */
+    RGBAPixel Pixel(unsigned int x, unsigned int y) const
+    {
+        const unsigned char* p = data + y * stride + (size_t)x * channels;
+        return RGBAPixel(p[0], p[1], p[2], channels == 4 ? p[3] / 255. : 1.0);
+    }
+};
+
+/**
+ * Makes a view of a tightly packed RGBA8 buffer when stride is 0,
+ * or of rows stride bytes apart otherwise.
+ */
+RawImage RGBAView(const unsigned char* data, unsigned int width, unsigned int height, size_t stride = 0);
+
+/**
+ * MappedImage: an image file mapped read-only into memory, exposed as a
+ * RawImage over the mapping itself, so pixels are read straight from the
+ * page cache without being decoded into a separate buffer.
+ *
+ * Supported files: binary PPM (P6) and PAM (P7, depth 3 or 4) with a
+ * maximum value of 255, and headerless RGBA8 files of known dimensions.
+ */
+class MappedImage {
+public:
+    MappedImage();
+
+    /**
+     * Unmaps the file, if one is open.
+     */
+    ~MappedImage();
+
+    /**
+     * Maps a PPM or PAM file, recognized by its magic number.
+     * @return true, if the file was mapped and its header understood.
+     */
+    bool Open(const string& fileName);
+
+    /**
+     * Maps a headerless file of width * height RGBA8 pixels.
+     * @return true, if the file was mapped and is large enough.
+     */
+    bool OpenRaw(const string& fileName, unsigned int width, unsigned int height);
+
+    /**
+     * Unmaps the file; views obtained earlier become invalid.
+     */
+    void Close();
+
+    /**
+     * View of the mapped pixels; valid until Close or destruction.
+     * @pre a file is open
+     */
+    const RawImage& View() const;
+
+private:
+    void* mapping;
+    size_t length;
+    RawImage view;
+
+    bool Map(const string& fileName);
+    bool ParseHeader();
+
+    MappedImage(const MappedImage& other);
+    MappedImage& operator=(const MappedImage& other);
+};
+
+#endif
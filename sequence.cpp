@@ -0,0 +1,418 @@
+/**
+ * @file sequence.cpp
+ * @description frame-sequence encoding: a live QTree per sequence, updated
+ *              frame to frame by rebuilding only the subtrees over changed
+ *              pixels, and sent as keyframes and subtree deltas
+ */
+
+#include <algorithm>
+#include <cstring>
+#include "progressive.h"
+#include "qtree-traversal.h"
+#include "sequence.h"
+#include "spill.h"
+
+namespace
+{
+	const unsigned char MAGIC[3] = {'Q', 'T', 'S'};
+	const unsigned char KEYFRAME = 'K';
+	const unsigned char DELTA = 'D';
+
+	// View of the rectangle ul..lr of img.
+	RawImage SubView(const RawImage& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr)
+	{
+		RawImage view = img;
+		view.data = img.data + ul.second * img.stride + (size_t)ul.first * img.channels;
+		view.width = lr.first - ul.first + 1;
+		view.height = lr.second - ul.second + 1;
+		return view;
+	}
+}
+
+TileDiff::TileDiff(const RawImage& previous, const RawImage& current, unsigned int tileSize)
+{
+	this->tileSize = tileSize;
+	columns = (current.width + tileSize - 1) / tileSize;
+	rows = (current.height + tileSize - 1) / tileSize;
+	sums.assign((size_t)(columns + 1) * (rows + 1), 0);
+
+	vector<unsigned char> changed(columns);
+	size_t pixelBytes = current.channels;
+	for (unsigned int row = 0; row < rows; row++)
+	{
+		fill(changed.begin(), changed.end(), 0);
+		unsigned int y1 = min((row + 1) * tileSize, current.height);
+		for (unsigned int y = row * tileSize; y < y1; y++)
+		{
+			const unsigned char* before = previous.data + y * previous.stride;
+			const unsigned char* after = current.data + y * current.stride;
+			for (unsigned int column = 0; column < columns; column++)
+			{
+				if (changed[column])
+				{
+					continue;
+				}
+				size_t x0 = (size_t)column * tileSize, x1 = min((column + 1) * tileSize, current.width);
+				changed[column] = memcmp(before + x0 * pixelBytes, after + x0 * pixelBytes, (x1 - x0) * pixelBytes) != 0;
+			}
+		}
+		unsigned int rowSum = 0;
+		for (unsigned int column = 0; column < columns; column++)
+		{
+			rowSum += changed[column];
+			size_t at = (size_t)(row + 1) * (columns + 1) + column + 1;
+			sums[at] = sums[at - (columns + 1)] + rowSum;
+		}
+	}
+}
+
+unsigned int TileDiff::Changed(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) const
+{
+	size_t c0 = ul.first / tileSize, c1 = lr.first / tileSize + 1;
+	size_t r0 = ul.second / tileSize, r1 = lr.second / tileSize + 1;
+	size_t stride = columns + 1;
+	return sums[r1 * stride + c1] - sums[r0 * stride + c1] - sums[r1 * stride + c0] + sums[r0 * stride + c0];
+}
+
+unsigned int TileDiff::Tiles(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) const
+{
+	return (lr.first / tileSize - ul.first / tileSize + 1) * (lr.second / tileSize - ul.second / tileSize + 1);
+}
+
+bool TileDiff::IsChanged(unsigned int column, unsigned int row) const
+{
+	return Changed(make_pair(column * tileSize, row * tileSize), make_pair(column * tileSize, row * tileSize)) != 0;
+}
+
+unsigned int TileDiff::TileSize() const
+{
+	return tileSize;
+}
+
+unsigned int TileDiff::Columns() const
+{
+	return columns;
+}
+
+unsigned int TileDiff::Rows() const
+{
+	return rows;
+}
+
+/**
+ * Updates the tree to a new frame; see qtree.h.
+ */
+unsigned int QTree::UpdateFrame(const RawImage& frame, const TileDiff& changed, const BuildOptions& options, double tolerance,
+								vector<unsigned char>& delta)
+{
+	SpillGuard guard(*this, SpillGuard::ON_DEMAND);
+	Unshare();
+	palette.clear();
+	vector<unsigned char> path, records;
+	unsigned int rebuilt = 0;
+	if (root != NULL)
+	{
+		root = UpdateFrameNode(root, frame, changed, options, tolerance, path, records, rebuilt);
+	}
+	PutVarint(delta, rebuilt);
+	delta.insert(delta.end(), records.begin(), records.end());
+	return rebuilt;
+}
+
+/**
+ * Private helper for UpdateFrame: returns the node that takes subroot's
+ * place, appending a record for it if it was rebuilt. path holds the
+ * child indices leading to subroot.
+ */
+Node* QTree::UpdateFrameNode(Node* subroot, const RawImage& frame, const TileDiff& changed, const BuildOptions& options, double tolerance,
+							 vector<unsigned char>& path, vector<unsigned char>& records, unsigned int& rebuilt)
+{
+	unsigned int dirty = changed.Changed(subroot->upLeft, subroot->lowRight);
+	if (dirty == 0)
+	{
+		return subroot;
+	}
+
+	if (IsSpilled(subroot))
+	{
+		// a spilled subtree that changed is read back for the update, and
+		// spilled again once it is done
+		FaultIn(subroot);
+		Node* updated = UpdateFrameNode(subroot, frame, changed, options, tolerance, path, records, rebuilt);
+		Respill(updated);
+		return updated;
+	}
+
+	if (IsLeaf(subroot) || 2 * dirty >= changed.Tiles(subroot->upLeft, subroot->lowRight))
+	{
+		Node* fresh = BuildRegion(frame, subroot->upLeft, subroot->lowRight, options, tolerance);
+		ClearNode(subroot);
+
+		PutVarint(records, path.size());
+		for (size_t i = 0; i < path.size(); i += 4)
+		{
+			unsigned char packed = 0;
+			for (size_t j = i; j < min(i + 4, path.size()); j++)
+			{
+				packed |= path[j] << (2 * (j - i));
+			}
+			records.push_back(packed);
+		}
+		vector<unsigned char> subtree;
+		EncodeSubtree(fresh, subtree, palette);
+		PutVarint(records, subtree.size());
+		records.insert(records.end(), subtree.begin(), subtree.end());
+		rebuilt++;
+		return fresh;
+	}
+
+	Node** slots[4] = {&subroot->NW, &subroot->NE, &subroot->SW, &subroot->SE};
+	for (int i = 0; i < 4; i++)
+	{
+		if (*slots[i] != NULL)
+		{
+			path.push_back(i);
+			*slots[i] = UpdateFrameNode(*slots[i], frame, changed, options, tolerance, path, records, rebuilt);
+			path.pop_back();
+		}
+	}
+	subroot->avg = calculateAvg(subroot->NW, subroot->NE, subroot->SW, subroot->SE);
+	return subroot;
+}
+
+/**
+ * Private helper for UpdateFrame: a pruned subtree for the rectangle
+ * ul..lr of frame, built as a tree of its own and moved into place.
+ */
+Node* QTree::BuildRegion(const RawImage& frame, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+						 const BuildOptions& options, double tolerance)
+{
+	QTree region(SubView(frame, ul, lr), options);
+	region.Prune(tolerance);
+	Node* subroot = region.root;
+	region.root = NULL;
+	PreOrder(subroot, [ul](Node* nd) {
+		nd->upLeft.first += ul.first;
+		nd->upLeft.second += ul.second;
+		nd->lowRight.first += ul.first;
+		nd->lowRight.second += ul.second;
+	});
+	return subroot;
+}
+
+/**
+ * Applies an UpdateFrame delta; see qtree.h.
+ */
+bool QTree::ApplyDelta(const vector<unsigned char>& delta, size_t pos)
+{
+	SpillGuard guard(*this, SpillGuard::ON_DEMAND);
+	Unshare();
+	palette.clear();
+	unsigned long long count;
+	if (!GetVarint(delta, pos, count))
+	{
+		return false;
+	}
+	for (unsigned long long record = 0; record < count; record++)
+	{
+		unsigned long long depth, length;
+		if (!GetVarint(delta, pos, depth) || depth > delta.size() * 4 || delta.size() - pos < (depth + 3) / 4)
+		{
+			return false;
+		}
+
+		// follow the path, remembering the nodes above the target; spilled
+		// subtrees on the way are read back, to be spilled again by the guard
+		vector<Node*> above;
+		Node** slot = &root;
+		for (unsigned long long level = 0; level < depth; level++)
+		{
+			if (*slot == NULL)
+			{
+				return false;
+			}
+			Node* nd = *slot;
+			FaultIn(nd);
+			Node** slots[4] = {&nd->NW, &nd->NE, &nd->SW, &nd->SE};
+			above.push_back(nd);
+			slot = slots[(delta[pos + level / 4] >> (2 * (level % 4))) & 3];
+		}
+		pos += (depth + 3) / 4;
+		if (*slot == NULL || !GetVarint(delta, pos, length) || delta.size() - pos < length)
+		{
+			return false;
+		}
+
+		ProgressiveDecoder decoder((*slot)->upLeft, (*slot)->lowRight, palette);
+		if (!decoder.Feed(delta.data() + pos, length) || !decoder.Done())
+		{
+			return false;
+		}
+		pos += length;
+		ClearNode(*slot);
+		*slot = decoder.ReleaseRoot();
+
+		for (size_t i = above.size(); i-- > 0;)
+		{
+			above[i]->avg = calculateAvg(above[i]->NW, above[i]->NE, above[i]->SW, above[i]->SE);
+		}
+	}
+	return pos == delta.size();
+}
+
+SequenceOptions::SequenceOptions()
+{
+	tolerance = 0.05;
+	tileSize = 16;
+	keyframeChange = 0.5;
+	keyframeInterval = 0;
+}
+
+SequenceEncoder::SequenceEncoder(const SequenceOptions& options)
+{
+	this->options = options;
+	this->options.tileSize = max(options.tileSize, 1u);
+	tree = NULL;
+	previousView = RGBAView(NULL, 0, 0);
+	stats.frames = 0;
+	stats.keyframes = 0;
+	stats.subtreesRebuilt = 0;
+	stats.bytes = 0;
+	sinceKeyframe = 0;
+}
+
+SequenceEncoder::~SequenceEncoder()
+{
+	delete tree;
+}
+
+void SequenceEncoder::Encode(const RawImage& frame, vector<unsigned char>& out)
+{
+	size_t start = out.size();
+	stats.frames++;
+	sinceKeyframe++;
+
+	bool same = tree != NULL && frame.width == previousView.width && frame.height == previousView.height &&
+				frame.channels == previousView.channels;
+	bool due = options.keyframeInterval != 0 && sinceKeyframe >= options.keyframeInterval;
+	if (!same || due)
+	{
+		Keyframe(frame, out);
+	}
+	else
+	{
+		TileDiff changed(previousView, frame, options.tileSize);
+		pair<unsigned int, unsigned int> ul(0, 0), lr(frame.width - 1, frame.height - 1);
+		if (changed.Changed(ul, lr) > options.keyframeChange * changed.Tiles(ul, lr))
+		{
+			Keyframe(frame, out);
+		}
+		else
+		{
+			out.insert(out.end(), MAGIC, MAGIC + 3);
+			out.push_back(DELTA);
+			stats.subtreesRebuilt += tree->UpdateFrame(frame, changed, options.build, options.tolerance, out);
+			Remember(frame, &changed);
+		}
+	}
+	stats.bytes += out.size() - start;
+}
+
+void SequenceEncoder::Keyframe(const RawImage& frame, vector<unsigned char>& out)
+{
+	delete tree;
+	tree = new QTree(frame, options.build);
+	tree->Prune(options.tolerance);
+	out.insert(out.end(), MAGIC, MAGIC + 3);
+	out.push_back(KEYFRAME);
+	tree->EncodeProgressive(out);
+	Remember(frame, NULL);
+	stats.keyframes++;
+	sinceKeyframe = 0;
+}
+
+/**
+ * Keeps a packed copy of the frame for the next comparison; after a delta
+ * only the changed tiles need copying.
+ */
+void SequenceEncoder::Remember(const RawImage& frame, const TileDiff* changed)
+{
+	size_t rowBytes = (size_t)frame.width * frame.channels;
+	if (changed == NULL)
+	{
+		previous.resize(rowBytes * frame.height);
+		previousView = frame;
+		previousView.data = previous.data();
+		previousView.stride = rowBytes;
+		for (unsigned int y = 0; y < frame.height; y++)
+		{
+			memcpy(&previous[y * rowBytes], frame.data + y * frame.stride, rowBytes);
+		}
+		return;
+	}
+	unsigned int size = changed->TileSize();
+	for (unsigned int row = 0; row < changed->Rows(); row++)
+	{
+		for (unsigned int column = 0; column < changed->Columns(); column++)
+		{
+			if (!changed->IsChanged(column, row))
+			{
+				continue;
+			}
+			size_t x0 = (size_t)column * size, x1 = min((column + 1) * size, frame.width);
+			for (unsigned int y = row * size; y < min((row + 1) * size, frame.height); y++)
+			{
+				memcpy(&previous[y * rowBytes + x0 * frame.channels], frame.data + y * frame.stride + x0 * frame.channels,
+					   (x1 - x0) * frame.channels);
+			}
+		}
+	}
+}
+
+const QTree* SequenceEncoder::Tree() const
+{
+	return tree;
+}
+
+const SequenceStats& SequenceEncoder::Stats() const
+{
+	return stats;
+}
+
+SequenceDecoder::SequenceDecoder()
+{
+	tree = NULL;
+}
+
+SequenceDecoder::~SequenceDecoder()
+{
+	delete tree;
+}
+
+bool SequenceDecoder::Decode(const vector<unsigned char>& packet)
+{
+	if (packet.size() < 4 || !equal(MAGIC, MAGIC + 3, packet.begin()))
+	{
+		return false;
+	}
+	if (packet[3] == KEYFRAME)
+	{
+		DecodeResult result;
+		QTree* keyframe = new QTree(packet.data() + 4, packet.size() - 4, &result);
+		if (result != DECODE_COMPLETE)
+		{
+			// a keyframe packet carries its whole stream
+			delete keyframe;
+			return false;
+		}
+		delete tree;
+		tree = keyframe;
+		return true;
+	}
+	return packet[3] == DELTA && tree != NULL && tree->ApplyDelta(packet, 4);
+}
+
+const QTree* SequenceDecoder::Tree() const
+{
+	return tree;
+}
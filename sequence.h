@@ -0,0 +1,164 @@
+/**
+ * @file sequence.h
+ * @description frame-sequence encoding: a live QTree per sequence, updated
+ *              frame to frame by rebuilding only the subtrees over changed
+ *              pixels, and sent as keyframes and subtree deltas
+ */
+
+#ifndef _SEQUENCE_H_
+#define _SEQUENCE_H_
+
+#include <vector>
+#include "qtree.h"
+#include "rawimage.h"
+
+/**
+ * Packet layout. Every packet starts with 'Q' 'T' 'S' and a kind byte:
+ *
+ *   'K' | EncodeProgressive stream                    (keyframe)
+ *   'D' | count | delta record*                       (delta)
+ *
+ * A delta record replaces one subtree of the tree left by the previous
+ * packet:
+ *
+ *   depth | path | length | node records
+ *
+ * where path gives the child taken at each of depth levels from the root
+ * (0..3 for NW/NE/SW/SE, four per byte, low bits first), and the length
+ * bytes that follow are the subtree's node records (see EncodeSubtree).
+ * After each record the averages of the nodes on the path are recomputed
+ * from their children. Integers are varints.
+ */
+
+/**
+ * TileDiff: which tiles of a frame differ from the previous frame, with
+ * the number of changed tiles over any rectangle in constant time.
+ */
+class TileDiff {
+public:
+    /**
+     * Compares two frames of the same size and channel count byte by
+     * byte, a tile row span at a time, skipping tiles already known to
+     * have changed.
+     *
+     * @param tileSize side of the square tiles, in pixels; at least 1
+     */
+    TileDiff(const RawImage& previous, const RawImage& current, unsigned int tileSize);
+
+    /**
+     * Number of changed tiles overlapping the rectangle (corners inclusive).
+     */
+    unsigned int Changed(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) const;
+
+    /**
+     * Number of tiles overlapping the rectangle.
+     */
+    unsigned int Tiles(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) const;
+
+    /**
+     * Whether tile (column, row) changed.
+     */
+    bool IsChanged(unsigned int column, unsigned int row) const;
+
+    unsigned int TileSize() const;
+    unsigned int Columns() const;
+    unsigned int Rows() const;
+
+private:
+    unsigned int tileSize;
+    unsigned int columns;
+    unsigned int rows;
+    vector<unsigned int> sums; // summed-area table of changed tiles, (columns + 1) x (rows + 1)
+};
+
+/**
+ * How a SequenceEncoder builds and refreshes its tree.
+ */
+struct SequenceOptions {
+    BuildOptions build;
+    double tolerance;          // Prune tolerance of every built subtree
+    unsigned int tileSize;     // granularity of change detection
+    double keyframeChange;     // send a keyframe when more than this fraction of tiles changed
+    unsigned int keyframeInterval; // and at least every this many frames; 0 only when needed
+
+    SequenceOptions(); // tolerance 0.05, 16 pixel tiles, keyframes past 50% change, no interval
+};
+
+struct SequenceStats {
+    unsigned int frames;
+    unsigned int keyframes;
+    unsigned long long subtreesRebuilt; // delta records sent
+    unsigned long long bytes;           // packet bytes sent
+};
+
+/**
+ * SequenceEncoder: turns frames into packets. The first frame, a frame
+ * whose size or channel count differs from the last, or one that changed
+ * too much becomes a keyframe; any other frame becomes a delta against
+ * the live tree, which keeps every subtree over unchanged pixels as it
+ * is and rebuilds (and prunes) only the subtrees over changed tiles.
+ */
+class SequenceEncoder {
+public:
+    SequenceEncoder(const SequenceOptions& options = SequenceOptions());
+    ~SequenceEncoder();
+
+    /**
+     * Appends the packet for the next frame to out.
+     * @param frame the frame; only read during the call
+     */
+    void Encode(const RawImage& frame, vector<unsigned char>& out);
+
+    /**
+     * The live tree, as the decoder will hold it after the last packet;
+     * null before the first frame.
+     */
+    const QTree* Tree() const;
+
+    const SequenceStats& Stats() const;
+
+private:
+    SequenceOptions options;
+    QTree* tree;
+    vector<unsigned char> previous; // last frame, tightly packed
+    RawImage previousView;
+    SequenceStats stats;
+    unsigned int sinceKeyframe;
+
+    void Keyframe(const RawImage& frame, vector<unsigned char>& out);
+    void Remember(const RawImage& frame, const TileDiff* changed);
+
+    SequenceEncoder(const SequenceEncoder& other);
+    SequenceEncoder& operator=(const SequenceEncoder& other);
+};
+
+/**
+ * SequenceDecoder: applies packets, in order, to a live tree.
+ */
+class SequenceDecoder {
+public:
+    SequenceDecoder();
+    ~SequenceDecoder();
+
+    /**
+     * Applies one packet.
+     * @return false if the packet is malformed (a keyframe whose stream
+     *         is corrupt or cut short included), or is a delta with no
+     *         keyframe before it; the tree is then left as it was, or
+     *         partially updated by a malformed delta
+     */
+    bool Decode(const vector<unsigned char>& packet);
+
+    /**
+     * The current tree; null before the first keyframe.
+     */
+    const QTree* Tree() const;
+
+private:
+    QTree* tree;
+
+    SequenceDecoder(const SequenceDecoder& other);
+    SequenceDecoder& operator=(const SequenceDecoder& other);
+};
+
+#endif
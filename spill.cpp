@@ -0,0 +1,700 @@
+/**
+ * @file spill.cpp
+ * @description out-of-core storage for the subtrees of a QTree over its
+ *              memory budget (see QTree::SetMemoryBudget)
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <unistd.h>
+#include <unordered_set>
+#include "qtree-traversal.h"
+#include "spill.h"
+
+namespace
+{
+	// Spill record layout, per node in pre-order:
+	//   mask | upLeft lowRight (4 x uint32) | r g b | a (double) | [block] | [gradient]
+	// where the low four bits of mask flag NW/NE/SW/SE. Everything is
+	// stored as it is in memory, so a subtree reads back exactly.
+	const unsigned char HAS_BLOCK = 0x10;
+	const unsigned char HAS_GRADIENT = 0x20;
+	const size_t NODE_BYTES = 1 + 4 * sizeof(unsigned int) + 3 + sizeof(double);
+
+	void Put(vector<unsigned char>& out, const void* data, size_t len)
+	{
+		const unsigned char* bytes = (const unsigned char*)data;
+		out.insert(out.end(), bytes, bytes + len);
+	}
+
+	/**
+	 * Appends the records of nd and its descendants; counts their nodes and leaves.
+	 */
+	void Serialize(const Node* nd, vector<unsigned char>& out, size_t& nodes, size_t& leaves)
+	{
+		const Node* children[4] = {nd->NW, nd->NE, nd->SW, nd->SE};
+		unsigned char mask = 0;
+		for (int i = 0; i < 4; i++)
+		{
+			if (children[i] != NULL)
+			{
+				mask |= 1 << i;
+			}
+		}
+		mask |= nd->block != NULL ? HAS_BLOCK : 0;
+		mask |= nd->gradient != NULL ? HAS_GRADIENT : 0;
+
+		out.push_back(mask);
+		unsigned int corners[4] = {nd->upLeft.first, nd->upLeft.second, nd->lowRight.first, nd->lowRight.second};
+		Put(out, corners, sizeof(corners));
+		out.push_back(nd->avg.r);
+		out.push_back(nd->avg.g);
+		out.push_back(nd->avg.b);
+		Put(out, &nd->avg.a, sizeof(double));
+		if (nd->block != NULL)
+		{
+			Put(out, nd->block, BlockBytes(nd));
+		}
+		if (nd->gradient != NULL)
+		{
+			Put(out, nd->gradient, GRADIENT_TERMS * sizeof(int));
+		}
+
+		nodes++;
+		leaves += (mask & 0xf) == 0 ? 1 : 0;
+		for (int i = 0; i < 4; i++)
+		{
+			if (children[i] != NULL)
+			{
+				Serialize(children[i], out, nodes, leaves);
+			}
+		}
+	}
+
+	/**
+	 * Reads the node whose record starts at pos, with its descendants.
+	 * @return null if the bytes run out
+	 */
+	Node* Deserialize(const vector<unsigned char>& in, size_t& pos)
+	{
+		if (in.size() - pos < NODE_BYTES)
+		{
+			return NULL;
+		}
+		unsigned char mask = in[pos++];
+		unsigned int corners[4];
+		memcpy(corners, &in[pos], sizeof(corners));
+		pos += sizeof(corners);
+		RGBAPixel avg(in[pos], in[pos + 1], in[pos + 2]);
+		pos += 3;
+		memcpy(&avg.a, &in[pos], sizeof(double));
+		pos += sizeof(double);
+
+		Node* nd = new Node(make_pair(corners[0], corners[1]), make_pair(corners[2], corners[3]), avg);
+		if (mask & HAS_BLOCK)
+		{
+			if (in.size() - pos < BlockBytes(nd))
+			{
+				delete nd;
+				return NULL;
+			}
+			nd->block = new unsigned char[BlockBytes(nd)];
+			memcpy(nd->block, &in[pos], BlockBytes(nd));
+			pos += BlockBytes(nd);
+		}
+		if (mask & HAS_GRADIENT)
+		{
+			if (in.size() - pos < GRADIENT_TERMS * sizeof(int))
+			{
+				delete nd;
+				return NULL;
+			}
+			nd->gradient = new int[GRADIENT_TERMS];
+			memcpy(nd->gradient, &in[pos], GRADIENT_TERMS * sizeof(int));
+			pos += GRADIENT_TERMS * sizeof(int);
+		}
+
+		Node** slots[4] = {&nd->NW, &nd->NE, &nd->SW, &nd->SE};
+		for (int i = 0; i < 4; i++)
+		{
+			if (mask & (1 << i))
+			{
+				*slots[i] = Deserialize(in, pos);
+				if (*slots[i] == NULL)
+				{
+					DeleteSubtree(nd);
+					return NULL;
+				}
+			}
+		}
+		return nd;
+	}
+
+	bool WriteAt(int fd, const unsigned char* data, size_t len, size_t offset)
+	{
+		while (len > 0)
+		{
+			ssize_t written = pwrite(fd, data, len, offset);
+			if (written <= 0)
+			{
+				return false;
+			}
+			data += written;
+			len -= written;
+			offset += written;
+		}
+		return true;
+	}
+
+	bool ReadAt(int fd, unsigned char* data, size_t len, size_t offset)
+	{
+		while (len > 0)
+		{
+			ssize_t got = pread(fd, data, len, offset);
+			if (got <= 0)
+			{
+				return false;
+			}
+			data += got;
+			len -= got;
+			offset += got;
+		}
+		return true;
+	}
+
+	/**
+	 * Bytes of the subtree at nd. Appends to units the largest interior
+	 * subtrees of at most unitBytes that hold no stub of store, and their
+	 * sizes to sizes. Sets stubbed if the subtree holds a stub.
+	 */
+	size_t FindUnits(Node* nd, size_t unitBytes, const SpillStore& store, vector<Node*>& units, vector<size_t>& sizes,
+					 bool& stubbed)
+	{
+		stubbed = false;
+		if (nd == NULL)
+		{
+			return 0;
+		}
+		if (IsLeaf(nd))
+		{
+			stubbed = store.IsStub(nd);
+			return NodeBytes(nd);
+		}
+		size_t first = units.size();
+		size_t bytes = NodeBytes(nd);
+		Node* children[4] = {nd->NW, nd->NE, nd->SW, nd->SE};
+		for (int i = 0; i < 4; i++)
+		{
+			bool below;
+			bytes += FindUnits(children[i], unitBytes, store, units, sizes, below);
+			stubbed = stubbed || below;
+		}
+		// a unit must not take a stub along, or the subtree behind it would be lost
+		if (!stubbed && bytes <= unitBytes)
+		{
+			// nd's subtree takes the place of the units found inside it
+			units.resize(first);
+			sizes.resize(first);
+			units.push_back(nd);
+			sizes.push_back(bytes);
+		}
+		return bytes;
+	}
+}
+
+size_t NodeBytes(const Node* nd)
+{
+	size_t bytes = sizeof(Node);
+	if (nd->block != NULL)
+	{
+		bytes += BlockBytes(nd);
+	}
+	if (nd->gradient != NULL)
+	{
+		bytes += GRADIENT_TERMS * sizeof(int);
+	}
+	return bytes;
+}
+
+SpillOptions::SpillOptions()
+{
+	budget = 0;
+	unitBytes = 256 * 1024;
+	directory = "/tmp";
+}
+
+SpillStore::SpillStore(const SpillOptions& options)
+	: options(options), faultIns(0)
+{
+	string name = options.directory + "/qtree-spill-XXXXXX";
+	vector<char> path(name.begin(), name.end());
+	path.push_back('\0');
+	fd = mkstemp(path.data());
+	if (fd >= 0)
+	{
+		unlink(path.data());
+	}
+	end = 0;
+	liveBytes = 0;
+	hiddenNodes = 0;
+	hiddenLeaves = 0;
+	spills = 0;
+}
+
+SpillStore::~SpillStore()
+{
+	if (fd >= 0)
+	{
+		close(fd);
+	}
+}
+
+bool SpillStore::IsOpen() const
+{
+	return fd >= 0;
+}
+
+const SpillOptions& SpillStore::Options() const
+{
+	return options;
+}
+
+bool SpillStore::Spill(Node* unit)
+{
+	vector<unsigned char> bytes;
+	Record record;
+	record.nodes = 0;
+	record.leaves = 0;
+	Serialize(unit, bytes, record.nodes, record.leaves);
+
+	// the first place freed that is large enough, or else the end of the file
+	size_t hole = 0;
+	while (hole < holes.size() && holes[hole].second < bytes.size())
+	{
+		hole++;
+	}
+	record.offset = hole < holes.size() ? holes[hole].first : end;
+	if (!WriteAt(fd, bytes.data(), bytes.size(), record.offset))
+	{
+		return false;
+	}
+	record.stub = unit;
+	record.length = bytes.size();
+	if (hole < holes.size())
+	{
+		holes[hole].first += bytes.size();
+		holes[hole].second -= bytes.size();
+		if (holes[hole].second == 0)
+		{
+			holes.erase(holes.begin() + hole);
+		}
+	}
+	else
+	{
+		end += bytes.size();
+	}
+	liveBytes += bytes.size();
+
+	Node** slots[4] = {&unit->NW, &unit->NE, &unit->SW, &unit->SE};
+	for (int i = 0; i < 4; i++)
+	{
+		DeleteSubtree(*slots[i]);
+		*slots[i] = NULL;
+	}
+	stubs[unit] = record;
+	hiddenNodes += record.nodes - 1;
+	hiddenLeaves += record.leaves - 1;
+	spills++;
+	return true;
+}
+
+Node* SpillStore::Load(const Node* stub) const
+{
+	Record record;
+	{
+		lock_guard<mutex> guard(lock);
+		unordered_map<const Node*, Record>::const_iterator found = stubs.find(stub);
+		if (found == stubs.end())
+		{
+			return NULL;
+		}
+		record = found->second;
+	}
+	Node* copy = Read(record);
+	if (copy != NULL)
+	{
+		unsigned long long stamp = ++faultIns;
+		lock_guard<mutex> guard(lock);
+		lastUse[stub] = stamp;
+	}
+	return copy;
+}
+
+bool SpillStore::IsStub(const Node* nd) const
+{
+	lock_guard<mutex> guard(lock);
+	return stubs.count(nd) != 0;
+}
+
+bool SpillStore::FaultIn(Node* stub)
+{
+	unordered_map<const Node*, Record>::iterator found = stubs.find(stub);
+	if (found == stubs.end())
+	{
+		return true;
+	}
+	if (!Attach(found->second))
+	{
+		return false;
+	}
+	Release(found->second);
+	stubs.erase(found);
+	return true;
+}
+
+void SpillStore::Forget(const Node* nd)
+{
+	lock_guard<mutex> guard(lock);
+	unordered_map<const Node*, Record>::iterator found = stubs.find(nd);
+	if (found != stubs.end())
+	{
+		Release(found->second);
+		stubs.erase(found);
+	}
+}
+
+bool SpillStore::Restore()
+{
+	for (unordered_map<const Node*, Record>::iterator it = stubs.begin(); it != stubs.end();)
+	{
+		if (!Attach(it->second))
+		{
+			// left spilled rather than lost; the caller hears of it
+			++it;
+			continue;
+		}
+		Release(it->second);
+		it = stubs.erase(it);
+	}
+	if (!stubs.empty())
+	{
+		return false;
+	}
+	end = 0;
+	holes.clear();
+	if (ftruncate(fd, 0) != 0)
+	{
+		// the space is only left allocated; later spills overwrite it
+	}
+	return true;
+}
+
+unsigned long long SpillStore::LastUse(const Node* unit) const
+{
+	lock_guard<mutex> guard(lock);
+	unordered_map<const Node*, unsigned long long>::const_iterator found = lastUse.find(unit);
+	return found == lastUse.end() ? 0 : found->second;
+}
+
+void SpillStore::Retain(const vector<Node*>& units)
+{
+	lock_guard<mutex> guard(lock);
+	unordered_map<const Node*, unsigned long long> kept;
+	for (size_t i = 0; i < units.size(); i++)
+	{
+		unordered_map<const Node*, unsigned long long>::const_iterator found = lastUse.find(units[i]);
+		if (found != lastUse.end())
+		{
+			kept.insert(*found);
+		}
+	}
+	lastUse.swap(kept);
+}
+
+size_t SpillStore::HiddenNodes() const
+{
+	return hiddenNodes;
+}
+
+size_t SpillStore::HiddenLeaves() const
+{
+	return hiddenLeaves;
+}
+
+void SpillStore::Stats(SpillStats& stats) const
+{
+	stats.spills = spills;
+	stats.faultIns = faultIns;
+	stats.spilledBytes = liveBytes;
+	stats.stubs = stubs.size();
+}
+
+Node* SpillStore::Read(const Record& record) const
+{
+	vector<unsigned char> bytes(record.length);
+	if (!ReadAt(fd, bytes.data(), bytes.size(), record.offset))
+	{
+		return NULL;
+	}
+	size_t pos = 0;
+	return Deserialize(bytes, pos);
+}
+
+bool SpillStore::Attach(const Record& record)
+{
+	Node* copy = Read(record);
+	if (copy == NULL)
+	{
+		return false;
+	}
+	Node* stub = record.stub;
+	stub->NW = copy->NW;
+	stub->NE = copy->NE;
+	stub->SW = copy->SW;
+	stub->SE = copy->SE;
+	copy->NW = copy->NE = copy->SW = copy->SE = NULL;
+	delete copy;
+	faultIns++;
+	return true;
+}
+
+void SpillStore::Release(const Record& record)
+{
+	holes.push_back(make_pair(record.offset, record.length));
+	liveBytes -= record.length;
+	hiddenNodes -= record.nodes - 1;
+	hiddenLeaves -= record.leaves - 1;
+}
+
+SpillGuard::SpillGuard(QTree& tree, Reach reach)
+	: tree(tree)
+{
+	tree.Touch();
+	if (reach == WHOLE_TREE && !tree.Unspill())
+	{
+		// what was read back goes out again; the rest never left the file
+		tree.SpillToBudget();
+		throw runtime_error("QTree: a spilled subtree could not be read back");
+	}
+}
+
+SpillGuard::~SpillGuard()
+{
+	tree.SpillToBudget();
+}
+
+/**
+ * Sets the memory budget; see qtree.h.
+ */
+bool QTree::SetMemoryBudget(const SpillOptions& options)
+{
+	if (!Unspill())
+	{
+		// the old budget stays, with its file
+		SpillToBudget();
+		return false;
+	}
+	delete spill;
+	spill = NULL;
+	if (options.budget == 0)
+	{
+		return true;
+	}
+	spill = new SpillStore(options);
+	if (!spill->IsOpen())
+	{
+		delete spill;
+		spill = NULL;
+		return false;
+	}
+	SpillToBudget();
+	return true;
+}
+
+SpillStats QTree::SpillingStats() const
+{
+	SpillStats stats;
+	stats.spills = 0;
+	stats.faultIns = 0;
+	stats.spilledBytes = 0;
+	stats.stubs = 0;
+	if (spill != NULL)
+	{
+		spill->Stats(stats);
+	}
+
+	// shared subtrees are in memory once
+	unordered_set<const Node*> seen;
+	stats.residentBytes = 0;
+	PreOrder(root, [this, &seen, &stats](const Node* nd) {
+		if (!shared || seen.insert(nd).second)
+		{
+			stats.residentBytes += NodeBytes(nd);
+		}
+	});
+	return stats;
+}
+
+/**
+ * Faults every spilled subtree back in. Does nothing without a budget.
+ * @return false if some subtree could not be read back; it stays spilled
+ */
+bool QTree::Unspill()
+{
+	return spill == NULL || spill->Restore();
+}
+
+/**
+ * Spills the coldest subtrees until the rest of the tree fits the budget.
+ * Subtrees are spilled whole, so the tree above them (the few nodes over
+ * subtrees larger than a unit) always stays in memory.
+ */
+void QTree::SpillToBudget()
+{
+	if (spill == NULL || shared || root == NULL)
+	{
+		return;
+	}
+	vector<Node*> units;
+	vector<size_t> sizes;
+	bool stubbed;
+	size_t resident = FindUnits(root, spill->Options().unitBytes, *spill, units, sizes, stubbed);
+	spill->Retain(units);
+	if (resident <= spill->Options().budget)
+	{
+		return;
+	}
+
+	// least recently read back first; among those never read back, the
+	// largest first, so fewer spills reach the budget
+	vector<unsigned long long> uses(units.size());
+	vector<size_t> order(units.size());
+	for (size_t i = 0; i < units.size(); i++)
+	{
+		uses[i] = spill->LastUse(units[i]);
+		order[i] = i;
+	}
+	sort(order.begin(), order.end(), [&uses, &sizes](size_t a, size_t b) {
+		return uses[a] != uses[b] ? uses[a] < uses[b] : sizes[a] > sizes[b];
+	});
+	for (size_t i = 0; i < order.size() && resident > spill->Options().budget; i++)
+	{
+		Node* unit = units[order[i]];
+		size_t freed = sizes[order[i]] - NodeBytes(unit);
+		if (!spill->Spill(unit))
+		{
+			// the file cannot take more; keep the rest in memory
+			return;
+		}
+		resident -= freed;
+	}
+}
+
+Node* QTree::LoadSpilled(const Node* nd) const
+{
+	return spill != NULL ? spill->Load(nd) : NULL;
+}
+
+/**
+ * Whether nd stands in for a spilled subtree.
+ */
+bool QTree::IsSpilled(const Node* nd) const
+{
+	return spill != NULL && IsLeaf(nd) && spill->IsStub(nd);
+}
+
+/**
+ * Reads the subtree spilled at nd, if any, back under it for an operation
+ * that changes it.
+ * @throws runtime_error if it cannot be read back; it then stays spilled
+ */
+void QTree::FaultIn(Node* nd)
+{
+	if (spill != NULL && IsLeaf(nd) && !spill->FaultIn(nd))
+	{
+		throw runtime_error("QTree: a spilled subtree could not be read back");
+	}
+}
+
+/**
+ * Spills unit again once an operation that faulted it in is done with it.
+ * If the file cannot take it, it stays in memory until SpillToBudget.
+ */
+void QTree::Respill(Node* unit)
+{
+	if (spill != NULL && !IsLeaf(unit))
+	{
+		spill->Spill(unit);
+	}
+}
+
+/**
+ * Forgets the spilled subtrees under subroot, which is about to be freed,
+ * so that no record outlives its stub. Safe to call from several tasks.
+ */
+void QTree::ForgetSpilled(Node* subroot)
+{
+	if (spill == NULL)
+	{
+		return;
+	}
+	PreOrder(subroot, [this](Node* nd) {
+		if (IsLeaf(nd))
+		{
+			spill->Forget(nd);
+		}
+	});
+}
+
+/**
+ * Runs op on each spilled subtree in turn, faulted in under its stub and
+ * spilled again right after, so only one is in memory at a time. op is
+ * given the stub, which the operation has already handled as a leaf, and
+ * must not free it.
+ */
+void QTree::ForEachSpilled(const function<void(Node*)>& op)
+{
+	if (spill == NULL)
+	{
+		return;
+	}
+	vector<Node*> units;
+	PreOrder(root, [this, &units](Node* nd) {
+		if (IsSpilled(nd))
+		{
+			units.push_back(nd);
+		}
+	});
+	for (size_t i = 0; i < units.size(); i++)
+	{
+		FaultIn(units[i]);
+		op(units[i]);
+		Respill(units[i]);
+	}
+}
+
+/**
+ * A copy of the subtree at nd with every spilled subtree read back in.
+ */
+Node* QTree::CopySpilledNode(const Node* nd) const
+{
+	if (nd == NULL)
+	{
+		return NULL;
+	}
+	Node* copy = LoadSpilled(nd);
+	if (copy != NULL)
+	{
+		return copy;
+	}
+	copy = new Node(nd->upLeft, nd->lowRight, nd->avg);
+	copy->block = CopyBlock(nd);
+	copy->gradient = CopyGradient(nd);
+	copy->NW = CopySpilledNode(nd->NW);
+	copy->NE = CopySpilledNode(nd->NE);
+	copy->SW = CopySpilledNode(nd->SW);
+	copy->SE = CopySpilledNode(nd->SE);
+	return copy;
+}
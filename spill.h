@@ -0,0 +1,178 @@
+/**
+ * @file spill.h
+ * @description out-of-core storage for the subtrees of a QTree over its
+ *              memory budget (see QTree::SetMemoryBudget)
+ */
+
+#ifndef _SPILL_H_
+#define _SPILL_H_
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "qtree.h"
+
+/**
+ * Bytes a node takes in memory: the node itself, plus its block or
+ * gradient if it has one.
+ */
+size_t NodeBytes(const Node* nd);
+
+/**
+ * SpillStore: a spill file of subtrees, each replaced in the tree by a
+ * stub, which is the subtree's root with its children, block and gradient
+ * freed. Only interior nodes are spilled, so a stub reads as an ordinary
+ * leaf of its subtree's average color.
+ *
+ * Load, IsStub and Forget may be called concurrently with each other (the
+ * file is read with pread); Spill, FaultIn and Restore may not be called
+ * concurrently with anything. The place of a subtree read back or
+ * forgotten is reused by later spills.
+ */
+class SpillStore {
+public:
+    /**
+     * Creates the spill file in options.directory. It is unlinked at
+     * once, so it disappears with the store or the process.
+     */
+    SpillStore(const SpillOptions& options);
+
+    ~SpillStore();
+
+    /**
+     * Whether the spill file was created.
+     */
+    bool IsOpen() const;
+
+    const SpillOptions& Options() const;
+
+    /**
+     * Writes the subtree under unit to the file and frees unit's
+     * descendants, leaving unit as its stub.
+     * @pre unit has children, and neither it nor any node below it is a stub
+     * @return false if the write failed; the subtree is then left as it was
+     */
+    bool Spill(Node* unit);
+
+    /**
+     * A new copy of the subtree spilled at stub, or null if stub is not
+     * a stub or the subtree could not be read back.
+     */
+    Node* Load(const Node* stub) const;
+
+    /**
+     * Whether nd is the stub of a spilled subtree.
+     */
+    bool IsStub(const Node* nd) const;
+
+    /**
+     * Reads the subtree spilled at stub back under it, and forgets its
+     * record. Does nothing if stub is not a stub.
+     * @return false if the subtree could not be read back; it then stays spilled
+     */
+    bool FaultIn(Node* stub);
+
+    /**
+     * Forgets the subtree spilled at nd, if any, before nd is freed or
+     * made a leaf of its own.
+     */
+    void Forget(const Node* nd);
+
+    /**
+     * Reads every spilled subtree back under its stub, and empties the
+     * file once all are back.
+     * @return false if some subtree could not be read back; those stay spilled
+     */
+    bool Restore();
+
+    /**
+     * When the subtree at unit was last loaded, on a clock that counts
+     * loads; 0 if it never was.
+     */
+    unsigned long long LastUse(const Node* unit) const;
+
+    /**
+     * Forgets when subtrees were loaded, except for the given units.
+     */
+    void Retain(const vector<Node*>& units);
+
+    /**
+     * Nodes and leaves of the spilled subtrees that are not in memory
+     * (each stub stands in for one of each).
+     */
+    size_t HiddenNodes() const;
+    size_t HiddenLeaves() const;
+
+    /**
+     * Fills in the counters of stats, all but residentBytes.
+     */
+    void Stats(SpillStats& stats) const;
+
+private:
+    struct Record {
+        Node* stub;
+        size_t offset;       // of the subtree's bytes in the file
+        size_t length;
+        size_t nodes;        // in the subtree, root included
+        size_t leaves;
+    };
+
+    SpillOptions options;
+    int fd;
+    size_t end;                          // bytes written to the file
+    size_t liveBytes;                    // of them, bytes of subtrees still spilled
+    vector<pair<size_t, size_t> > holes; // offset and length of places free for reuse
+    unordered_map<const Node*, Record> stubs;
+    size_t hiddenNodes;
+    size_t hiddenLeaves;
+    unsigned long long spills;
+    mutable atomic<unsigned long long> faultIns;
+    mutable mutex lock; // guards stubs against Forget, and lastUse
+    mutable unordered_map<const Node*, unsigned long long> lastUse;
+
+    // Reads the subtree of a record into a new node tree; null on failure.
+    Node* Read(const Record& record) const;
+
+    // Reads the subtree of a record back under its stub; false on failure.
+    bool Attach(const Record& record);
+
+    // Frees the place of a record in the file and its share of the counts.
+    void Release(const Record& record);
+
+    SpillStore(const SpillStore& other);
+    SpillStore& operator=(const SpillStore& other);
+};
+
+/**
+ * SpillGuard: brackets a QTree operation that changes the tree. Gives the
+ * tree a new generation (see QTree::Generation) on construction, and for a
+ * tree with a budget, spills to the budget again on destruction.
+ *
+ * An operation that needs the whole tree at once has every spilled subtree
+ * faulted back in on construction. One that works ON_DEMAND faults in only
+ * the subtrees it reaches, itself (see QTree::FaultIn and
+ * QTree::ForEachSpilled), so it runs in about the budget plus one unit.
+ */
+class SpillGuard {
+public:
+    enum Reach {
+        WHOLE_TREE, // every spilled subtree is read back first
+        ON_DEMAND   // the operation reads back what it reaches
+    };
+
+    /**
+     * @throws runtime_error for WHOLE_TREE, if a spilled subtree cannot
+     *         be read back; the tree is then left as it was
+     */
+    SpillGuard(QTree& tree, Reach reach = WHOLE_TREE);
+    ~SpillGuard();
+
+private:
+    QTree& tree;
+
+    SpillGuard(const SpillGuard& other);
+    SpillGuard& operator=(const SpillGuard& other);
+};
+
+#endif
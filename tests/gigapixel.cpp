@@ -0,0 +1,125 @@
+/**
+ * @file gigapixel.cpp
+ * @description test of a QTree over a 100000 x 50000 image, whose 5e9
+ *              pixels overflow 32 bits; the image is streamed in as a
+ *              progressive encoding, so no pixel buffer is ever allocated
+ */
+
+#include <cmath>
+#include <cstdio>
+#include "../progressive.h"
+#include "../qtree.h"
+#include "../qtree-traversal.h"
+
+namespace
+{
+	const unsigned int WIDTH = 100000;
+	const unsigned int HEIGHT = 50000;
+
+	int failures = 0;
+
+	void Check(bool ok, const char* what)
+	{
+		printf("%s: %s\n", ok ? "ok  " : "FAIL", what);
+		failures += ok ? 0 : 1;
+	}
+
+	bool Is(const RGBAPixel* p, unsigned char r, unsigned char g, unsigned char b)
+	{
+		return p->r == r && p->g == g && p->b == b;
+	}
+
+	Node* Leaf(unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1, const RGBAPixel& color)
+	{
+		return new Node(make_pair(x0, y0), make_pair(x1, y1), color);
+	}
+
+	/**
+	 * Encoding of a tree over the whole image: red, green and blue
+	 * quadrants, and a grey, half transparent south east quadrant split
+	 * once more so that its last pixel is a leaf of its own. Each quadrant
+	 * holds 1.25e9 pixels, so only sums over the whole image overflow.
+	 */
+	vector<unsigned char> Stream()
+	{
+		const unsigned int midX = WIDTH / 2, midY = HEIGHT / 2;
+		RGBAPixel grey(100, 100, 100, 0.5);
+		Node* root = Leaf(0, 0, WIDTH - 1, HEIGHT - 1, RGBAPixel(75, 75, 75, 0.875));
+		root->NW = Leaf(0, 0, midX - 1, midY - 1, RGBAPixel(200, 0, 0));
+		root->NE = Leaf(midX, 0, WIDTH - 1, midY - 1, RGBAPixel(0, 200, 0));
+		root->SW = Leaf(0, midY, midX - 1, HEIGHT - 1, RGBAPixel(0, 0, 200));
+		root->SE = Leaf(midX, midY, WIDTH - 1, HEIGHT - 1, grey);
+		Node* se = root->SE;
+		se->NW = Leaf(midX, midY, WIDTH - 2, HEIGHT - 2, grey);
+		se->NE = Leaf(WIDTH - 1, midY, WIDTH - 1, HEIGHT - 2, grey);
+		se->SW = Leaf(midX, HEIGHT - 1, WIDTH - 2, HEIGHT - 1, grey);
+		se->SE = Leaf(WIDTH - 1, HEIGHT - 1, WIDTH - 1, HEIGHT - 1, grey);
+
+		vector<unsigned char> out = {'Q', 'T', 'P', 4};
+		PutVarint(out, WIDTH);
+		PutVarint(out, HEIGHT);
+		PutVarint(out, 0);
+		EncodeSubtree(root, out, vector<RGBAPixel>());
+		DeleteSubtree(root);
+		return out;
+	}
+
+	/**
+	 * An ApplyDelta record turning the last pixel white, so that the
+	 * averages above it are recomputed over the whole image.
+	 */
+	vector<unsigned char> WhiteCorner()
+	{
+		Node* pixel = Leaf(WIDTH - 1, HEIGHT - 1, WIDTH - 1, HEIGHT - 1, RGBAPixel(255, 255, 255));
+		vector<unsigned char> subtree;
+		EncodeSubtree(pixel, subtree, vector<RGBAPixel>());
+		DeleteSubtree(pixel);
+
+		vector<unsigned char> delta;
+		PutVarint(delta, 1);       // records
+		PutVarint(delta, 2);       // depth
+		delta.push_back(3 | 3 << 2); // SE, then SE again
+		PutVarint(delta, subtree.size());
+		delta.insert(delta.end(), subtree.begin(), subtree.end());
+		return delta;
+	}
+}
+
+int main()
+{
+	DecodeResult result;
+	QTree tree(Stream(), &result);
+	Check(result == DECODE_COMPLETE, "the stream decodes completely");
+	Check(tree.Width() == WIDTH && tree.Height() == HEIGHT, "the decoded tree keeps its size");
+	Check(tree.CountNodes() == 9 && tree.CountLeaves() == 7, "nodes and leaves are counted");
+
+	// viewports at the far corner and across the middle; only they are drawn
+	PNG corner = tree.RenderRegion(make_pair(WIDTH - 3, HEIGHT - 3), make_pair(WIDTH - 1, HEIGHT - 1), 1);
+	Check(corner.width() == 3 && Is(corner.getPixel(2, 2), 100, 100, 100), "the last pixel renders");
+	PNG middle = tree.RenderRegion(make_pair(WIDTH / 2 - 2, HEIGHT / 2 - 2), make_pair(WIDTH / 2 + 1, HEIGHT / 2 + 1), 1);
+	Check(Is(middle.getPixel(0, 0), 200, 0, 0) && Is(middle.getPixel(3, 0), 0, 200, 0) &&
+			  Is(middle.getPixel(0, 3), 0, 0, 200) && Is(middle.getPixel(3, 3), 100, 100, 100),
+		  "the quadrants meet in the middle");
+
+	vector<unsigned char> encoded;
+	tree.EncodeProgressive(encoded);
+	QTree again(encoded);
+	Check(again.CountNodes() == 9 && again.Width() == WIDTH, "the tree encodes again");
+
+	// the averages above the changed pixel weigh quadrants of 1.25e9 pixels each
+	Check(tree.ApplyDelta(WhiteCorner(), 0), "a delta applies at the last pixel");
+	corner = tree.RenderRegion(make_pair(WIDTH - 1, HEIGHT - 1), make_pair(WIDTH - 1, HEIGHT - 1), 1);
+	Check(Is(corner.getPixel(0, 0), 255, 255, 255), "the last pixel changes");
+	QTree collapsed(tree);
+	collapsed.Prune(1e9);
+	PNG average = collapsed.RenderRegion(make_pair(0u, 0u), make_pair(0u, 0u), 1);
+	Check(collapsed.CountNodes() == 1 && Is(average.getPixel(0, 0), 75, 75, 75) &&
+			  fabs(average.getPixel(0, 0)->a - 0.875) < 1 / 255.0,
+		  "the whole image averages over 5e9 pixels");
+
+	PruneStats stats = tree.PruneToBudget(1, INFINITY);
+	Check(stats.nodes == 1 && tree.CountLeaves() == 1, "PruneToBudget collapses the whole image");
+	Check(stats.squaredError > 0 && std::isfinite(stats.squaredError), "its error is summed in range");
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,87 @@
+/**
+ * @file nodepool.cpp
+ * @description test that the node pool's memory stays bounded when trees
+ *              are built, relaid out and freed over and over, and that
+ *              freeing a large tree gives its memory back
+ */
+
+#include <cstdio>
+#include "../nodepool.h"
+#include "../qtree.h"
+
+namespace
+{
+	int failures = 0;
+
+	void Check(bool ok, const char* what)
+	{
+		printf("%s: %s\n", ok ? "ok  " : "FAIL", what);
+		failures += ok ? 0 : 1;
+	}
+
+	PNG Noise(unsigned int width, unsigned int height)
+	{
+		PNG image(width, height);
+		unsigned int state = 1;
+		for (unsigned int y = 0; y < height; y++)
+		{
+			for (unsigned int x = 0; x < width; x++)
+			{
+				state = state * 1103515245 + 12345;
+				RGBAPixel* p = image.getPixel(x, y);
+				p->r = state >> 24;
+				p->g = state >> 16;
+				p->b = state >> 8;
+			}
+		}
+		return image;
+	}
+
+	double Megabytes(size_t bytes)
+	{
+		return bytes / 1048576.0;
+	}
+}
+
+int main()
+{
+	PNG image = Noise(256, 256);
+	BuildOptions options;
+	options.layout = BuildOptions::VAN_EMDE_BOAS;
+
+	size_t first = 0;
+	for (int i = 0; i < 20; i++)
+	{
+		QTree tree(image, options);
+		tree.Relayout();
+		if (i == 0)
+		{
+			first = NodePool::Stats().reservedBytes;
+		}
+	}
+	size_t last = NodePool::Stats().reservedBytes;
+	printf("reserved after the first tree %.1f MB, after 20 %.1f MB\n", Megabytes(first), Megabytes(last));
+	Check(last <= first, "relaid out trees give their runs back");
+
+	{
+		QTree tree(image, options);
+		tree.Prune(0.1);
+		tree.Relayout();
+		QTree copy(tree);
+		copy.Relayout();
+	}
+	Check(NodePool::Stats().reservedBytes <= first, "pruned and copied runs are freed too");
+
+	size_t before = NodePool::Stats().reservedBytes, peak;
+	{
+		QTree large(Noise(1024, 1024));
+		peak = NodePool::Stats().reservedBytes;
+	}
+	size_t after = NodePool::Stats().reservedBytes;
+	printf("reserved before a large tree %.1f MB, with it %.1f MB, after it %.1f MB\n", Megabytes(before),
+		   Megabytes(peak), Megabytes(after));
+	Check(peak - before > NodePool::TRIM_BYTES, "the large tree needs more than TRIM_BYTES");
+	Check(after <= before + NodePool::TRIM_BYTES, "freeing it gives its chunks back");
+
+	return failures == 0 ? 0 : 1;
+}
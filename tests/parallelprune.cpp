@@ -0,0 +1,116 @@
+/**
+ * @file parallelprune.cpp
+ * @description test that ParallelPrune gives the same tree as Prune, on
+ *              trees held in memory and on trees with spilled subtrees
+ */
+
+#include <cstdio>
+#include <vector>
+#include "../qtree.h"
+#include "../rawimage.h"
+
+namespace
+{
+	const unsigned int WIDTH = 500;
+	const unsigned int HEIGHT = 300;
+
+	int failures = 0;
+
+	void Check(bool ok, const char* what)
+	{
+		printf("%s: %s\n", ok ? "ok  " : "FAIL", what);
+		failures += ok ? 0 : 1;
+	}
+
+	/**
+	 * Flat squares over ramps and a noisy band, so that every tolerance
+	 * keeps some subtrees and collapses others.
+	 */
+	vector<unsigned char> Pixels()
+	{
+		vector<unsigned char> pixels((size_t)WIDTH * HEIGHT * 4);
+		unsigned int state = 3;
+		for (unsigned int y = 0; y < HEIGHT; y++)
+		{
+			for (unsigned int x = 0; x < WIDTH; x++)
+			{
+				unsigned char* p = &pixels[((size_t)y * WIDTH + x) * 4];
+				state = state * 1103515245 + 12345;
+				p[0] = x * x / 7 + y;
+				p[1] = x / 9 * 30;
+				p[2] = y > 200 && y < 240 ? state >> 24 : (x ^ y) >> 3;
+				p[3] = (x / 50 + y / 50) % 4 == 0 ? 128 : 255;
+				if ((x / 40 + y / 40) % 3 == 0)
+				{
+					p[0] = p[1] = p[2] = 100;
+				}
+			}
+		}
+		return pixels;
+	}
+
+	bool Same(const QTree& a, const QTree& b)
+	{
+		vector<unsigned char> encodedA, encodedB;
+		a.EncodeProgressive(encodedA);
+		b.EncodeProgressive(encodedB);
+		return a.CountNodes() == b.CountNodes() && a.CountLeaves() == b.CountLeaves() && a.Render(1) == b.Render(1) &&
+			   encodedA == encodedB;
+	}
+}
+
+int main()
+{
+	vector<unsigned char> pixels = Pixels();
+	RawImage image = RGBAView(pixels.data(), WIDTH, HEIGHT);
+	double tolerances[] = {0, 0.02, 0.1, 0.5};
+	unsigned int cutoffs[] = {1, 64, 4096};
+
+	bool same = true;
+	for (double tolerance : tolerances)
+	{
+		for (unsigned int cutoff : cutoffs)
+		{
+			QTree serial(image), parallel(image);
+			serial.Prune(tolerance);
+			parallel.ParallelPrune(tolerance, cutoff);
+			same = same && Same(serial, parallel);
+		}
+	}
+	Check(same, "ParallelPrune matches Prune in memory");
+
+	same = true;
+	for (double tolerance : tolerances)
+	{
+		QTree serial(image), parallel(image);
+		serial.Prune<PremultipliedDistance>(tolerance);
+		parallel.ParallelPrune<PremultipliedDistance>(tolerance, 64);
+		same = same && Same(serial, parallel);
+	}
+	Check(same, "ParallelPrune matches Prune with another metric");
+
+	// a tenth of the tree in memory; the rest in units of 16 KB
+	same = true;
+	bool spilled = true;
+	for (double tolerance : tolerances)
+	{
+		for (unsigned int cutoff : cutoffs)
+		{
+			QTree serial(image), parallel(image);
+			SpillOptions options;
+			options.budget = parallel.SpillingStats().residentBytes / 10;
+			options.unitBytes = 16 * 1024;
+			spilled = spilled && parallel.SetMemoryBudget(options) && parallel.SpillingStats().stubs > 0;
+			serial.Prune(tolerance);
+			parallel.ParallelPrune(tolerance, cutoff);
+			same = same && Same(serial, parallel);
+			// and again once every subtree is read back
+			spilled = spilled && parallel.SetMemoryBudget(SpillOptions()) && parallel.SpillingStats().stubs == 0;
+			same = same && Same(serial, parallel);
+		}
+	}
+	Check(spilled, "the budgeted trees spill and read back");
+	Check(same, "ParallelPrune matches Prune on spilled trees");
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,187 @@
+/**
+ * @file progressive.cpp
+ * @description tests of the progressive encoding (see progressive.h):
+ *              round trips of plain, palette, block and gradient leaves,
+ *              version 1 headers, truncated prefixes and corrupt streams
+ */
+
+#include <cstdio>
+#include "../progressive.h"
+#include "../qtree.h"
+#include "../qtree-traversal.h"
+
+namespace
+{
+	int failures = 0;
+
+	void Check(bool ok, const char* what)
+	{
+		printf("%s: %s\n", ok ? "ok  " : "FAIL", what);
+		failures += ok ? 0 : 1;
+	}
+
+	/**
+	 * Smooth ramps over the left half and noise over the right, so that
+	 * pruning leaves both large flat or gradient leaves and single pixels.
+	 */
+	PNG TestImage(unsigned int width, unsigned int height)
+	{
+		PNG image(width, height);
+		unsigned int state = 7;
+		for (unsigned int y = 0; y < height; y++)
+		{
+			for (unsigned int x = 0; x < width; x++)
+			{
+				RGBAPixel* p = image.getPixel(x, y);
+				if (x < width / 2)
+				{
+					p->r = x * 4;
+					p->g = y * 4;
+					p->b = 128;
+				}
+				else
+				{
+					state = state * 1103515245 + 12345;
+					p->r = state >> 24;
+					p->g = state >> 16;
+					p->b = state >> 8;
+				}
+			}
+		}
+		return image;
+	}
+
+	struct Leaves
+	{
+		size_t blocks;
+		size_t gradients;
+	};
+
+	/**
+	 * Block and gradient leaves of the tree the stream decodes to, as read
+	 * straight from the decoder's nodes.
+	 */
+	Leaves DecodedLeaves(const vector<unsigned char>& encoded)
+	{
+		ProgressiveDecoder decoder(false);
+		decoder.Feed(encoded.data(), encoded.size());
+		Node* root = decoder.ReleaseRoot();
+		Leaves leaves = {0, 0};
+		PreOrder(root, [&leaves](Node* nd) {
+			leaves.blocks += nd->block != NULL ? 1 : 0;
+			leaves.gradients += nd->gradient != NULL ? 1 : 0;
+		});
+		DeleteSubtree(root);
+		return leaves;
+	}
+
+	/**
+	 * Whether tree survives EncodeProgressive and the decoding constructor
+	 * unchanged: complete decoding, same counts, render and palette, and
+	 * the same bytes when encoded again.
+	 */
+	bool RoundTrips(const QTree& tree, vector<unsigned char>& encoded)
+	{
+		encoded.clear();
+		tree.EncodeProgressive(encoded);
+		DecodeResult result;
+		QTree decoded(encoded, &result);
+		vector<unsigned char> again;
+		decoded.EncodeProgressive(again);
+		return result == DECODE_COMPLETE && decoded.CountNodes() == tree.CountNodes() &&
+			   decoded.CountLeaves() == tree.CountLeaves() && decoded.Render(1) == tree.Render(1) &&
+			   decoded.Palette().size() == tree.Palette().size() && again == encoded;
+	}
+}
+
+int main()
+{
+	PNG image = TestImage(64, 48);
+	vector<unsigned char> encoded;
+
+	QTree plain(image);
+	plain.Prune(0.05);
+	Check(RoundTrips(plain, encoded), "plain leaves round trip");
+	Check(encoded.size() > 4 && encoded[3] == 4, "streams are written as version 4");
+
+	QTree palette(image);
+	palette.Prune(0.05);
+	palette.Quantize(16);
+	Check(!palette.Palette().empty() && RoundTrips(palette, encoded), "palette leaves round trip");
+
+	BuildOptions options;
+	options.blockSize = 4;
+	QTree blocks(image, options);
+	Check(RoundTrips(blocks, encoded) && DecodedLeaves(encoded).blocks > 0, "block leaves (mask bit 4) round trip");
+	blocks.Quantize(16);
+	Check(RoundTrips(blocks, encoded) && DecodedLeaves(encoded).blocks > 0, "block leaves round trip with a palette");
+
+	QTree gradients(image);
+	gradients.PruneGradient(0.05);
+	Check(RoundTrips(gradients, encoded) && DecodedLeaves(encoded).gradients > 0,
+		  "gradient leaves (mask bit 5) round trip");
+
+	// version 1: no palette size; a root split into four single pixels
+	vector<unsigned char> v1 = {'Q', 'T', 'P', 1, 2, 2, 0x0f, 1, 1, 10, 20, 30, 255};
+	unsigned char colors[4][4] = {{255, 0, 0, 255}, {0, 255, 0, 255}, {0, 0, 255, 255}, {9, 9, 9, 255}};
+	for (int i = 0; i < 4; i++)
+	{
+		v1.push_back(0);
+		v1.insert(v1.end(), colors[i], colors[i] + 4);
+	}
+	DecodeResult result;
+	QTree old(v1, &result);
+	PNG rendered = old.Render(1);
+	Check(result == DECODE_COMPLETE && old.CountLeaves() == 4 && rendered.getPixel(1, 0)->g == 255 &&
+			  rendered.getPixel(1, 1)->r == 9,
+		  "version 1 streams decode");
+
+	// a prefix decodes to a coarser tree over the same image
+	encoded.clear();
+	plain.EncodeProgressive(encoded);
+	QTree prefix(encoded.data(), encoded.size() / 2, &result);
+	Check(result == DECODE_TRUNCATED && prefix.Width() == 64 && prefix.Height() == 48 &&
+			  prefix.Render(1) != plain.Render(1),
+		  "a truncated stream gives a coarser tree");
+	// magic, three one-byte varints, then the root's mask, split and color:
+	// the root and the placeholders for its four children
+	QTree root(encoded.data(), 14, &result);
+	PNG flat = root.Render(1);
+	Check(result == DECODE_TRUNCATED && root.CountNodes() == 5 && *flat.getPixel(0, 0) == *flat.getPixel(63, 47),
+		  "a stream cut after the root record gives one flat color");
+	QTree header(encoded.data(), 3, &result);
+	Check(result == DECODE_TRUNCATED && header.Width() == 0, "a stream cut inside the header gives no tree");
+
+	// fed a byte at a time, the decoder reaches the same image
+	ProgressiveDecoder decoder;
+	for (size_t i = 0; i < encoded.size(); i++)
+	{
+		decoder.Feed(&encoded[i], 1);
+	}
+	Check(decoder.Done() && decoder.Canvas() == plain.Render(1), "a stream fed a byte at a time decodes");
+
+	vector<unsigned char> corrupt = encoded;
+	corrupt[0] = 'X';
+	QTree badMagic(corrupt, &result);
+	Check(result == DECODE_MALFORMED && badMagic.Width() == 0, "a bad magic number is malformed");
+	corrupt = encoded;
+	corrupt[3] = 5;
+	QTree badVersion(corrupt, &result);
+	Check(result == DECODE_MALFORMED, "an unknown version is malformed");
+
+	// the root record starts right after the 4-byte magic and three one-byte varints
+	corrupt = encoded;
+	corrupt[7] = 0x40;
+	QTree badMask(corrupt, &result);
+	Check(result == DECODE_MALFORMED && badMask.Width() == 0, "an unknown mask bit is malformed");
+	corrupt = encoded;
+	corrupt[8] = 65;
+	QTree badSplit(corrupt, &result);
+	Check(result == DECODE_MALFORMED, "a split outside the rectangle is malformed");
+	corrupt.assign(encoded.begin(), encoded.begin() + 8);
+	corrupt.insert(corrupt.end(), 11, 0xff);
+	QTree badVarint(corrupt, &result);
+	Check(result == DECODE_MALFORMED, "a varint past 64 bits is malformed");
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,115 @@
+/**
+ * @file sequence.cpp
+ * @description tests of frame-sequence encoding: decoded trees match the
+ *              encoder's live tree frame by frame, and deltas with no
+ *              keyframe before them or cut short are rejected
+ */
+
+#include <cstdio>
+#include <vector>
+#include "../qtree.h"
+#include "../rawimage.h"
+#include "../sequence.h"
+
+namespace
+{
+	const unsigned int WIDTH = 160;
+	const unsigned int HEIGHT = 120;
+	const unsigned int FRAMES = 8;
+
+	int failures = 0;
+
+	void Check(bool ok, const char* what)
+	{
+		printf("%s: %s\n", ok ? "ok  " : "FAIL", what);
+		failures += ok ? 0 : 1;
+	}
+
+	/**
+	 * Frame i: a fixed background of ramps, with a small square that
+	 * moves a few pixels each frame and a counter bar that grows.
+	 */
+	vector<unsigned char> Frame(unsigned int i)
+	{
+		vector<unsigned char> pixels((size_t)WIDTH * HEIGHT * 4);
+		for (unsigned int y = 0; y < HEIGHT; y++)
+		{
+			for (unsigned int x = 0; x < WIDTH; x++)
+			{
+				unsigned char* p = &pixels[((size_t)y * WIDTH + x) * 4];
+				p[0] = x;
+				p[1] = y * 2;
+				p[2] = (x / 16 + y / 16) % 2 == 0 ? 40 : 200;
+				p[3] = 255;
+				bool square = x >= 20 + 5 * i && x < 36 + 5 * i && y >= 30 && y < 46;
+				bool bar = y >= 100 && y < 104 && x < 10 * (i + 1);
+				if (square || bar)
+				{
+					p[0] = 255;
+					p[1] = 255 - 20 * i;
+					p[2] = 0;
+				}
+			}
+		}
+		return pixels;
+	}
+
+	bool Same(const QTree* a, const QTree* b)
+	{
+		if (a == NULL || b == NULL)
+		{
+			return false;
+		}
+		vector<unsigned char> encodedA, encodedB;
+		a->EncodeProgressive(encodedA);
+		b->EncodeProgressive(encodedB);
+		return a->CountNodes() == b->CountNodes() && a->Render(1) == b->Render(1) && encodedA == encodedB;
+	}
+}
+
+int main()
+{
+	SequenceEncoder encoder;
+	SequenceDecoder decoder;
+	vector<vector<unsigned char> > packets;
+	bool decoded = true, same = true;
+	for (unsigned int i = 0; i < FRAMES; i++)
+	{
+		vector<unsigned char> pixels = Frame(i);
+		vector<unsigned char> packet;
+		encoder.Encode(RGBAView(pixels.data(), WIDTH, HEIGHT), packet);
+		decoded = decoded && decoder.Decode(packet);
+		same = same && Same(decoder.Tree(), encoder.Tree());
+		packets.push_back(packet);
+	}
+	const SequenceStats& stats = encoder.Stats();
+	Check(stats.frames == FRAMES && stats.keyframes == 1 && stats.subtreesRebuilt > 0,
+		  "small changes are sent as deltas after one keyframe");
+	Check(decoded, "every packet decodes");
+	Check(same, "every decoded tree renders and encodes as the encoder's tree");
+
+	// the delta packets alone, with no keyframe before them
+	SequenceDecoder late;
+	Check(!late.Decode(packets[1]) && late.Tree() == NULL, "a delta with no keyframe is rejected");
+
+	// a delta cut short is malformed; every shorter prefix of it is too
+	SequenceDecoder cut;
+	bool rejected = cut.Decode(packets[0]);
+	const vector<unsigned char>& delta = packets[1];
+	for (size_t length = 4; length < delta.size(); length += delta.size() / 16 + 1)
+	{
+		rejected = rejected && !cut.Decode(vector<unsigned char>(delta.begin(), delta.begin() + length));
+	}
+	Check(rejected, "a truncated delta is rejected");
+
+	// so is a keyframe cut short, which leaves the tree as it was
+	SequenceDecoder keyframes, reference;
+	keyframes.Decode(packets[0]);
+	reference.Decode(packets[0]);
+	const vector<unsigned char>& key = packets[0];
+	Check(!keyframes.Decode(vector<unsigned char>(key.begin(), key.begin() + key.size() / 2)) &&
+			  Same(keyframes.Tree(), reference.Tree()),
+		  "a truncated keyframe is rejected");
+
+	return failures == 0 ? 0 : 1;
+}
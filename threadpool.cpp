@@ -0,0 +1,183 @@
+/**
+ * @file threadpool.cpp
+ * @description fixed-size worker pool and task groups used by the
+ *              parallel QTree passes
+ */
+
+#include <chrono>
+#include "threadpool.h"
+#include "trace.h"
+
+namespace
+{
+	// Runs a bare task; its exception, if any, has nowhere to go.
+	void RunDetached(const function<void()>& task)
+	{
+		try
+		{
+			task();
+		}
+		catch (...)
+		{
+		}
+	}
+}
+
+ThreadPool::ThreadPool(unsigned int threads)
+{
+	if (threads == 0)
+	{
+		threads = max(1u, thread::hardware_concurrency());
+	}
+	stopping = false;
+	for (unsigned int i = 0; i < threads; i++)
+	{
+		workers.push_back(thread(&ThreadPool::WorkerLoop, this));
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
+	}
+	available.notify_all();
+	for (size_t i = 0; i < workers.size(); i++)
+	{
+		workers[i].join();
+	}
+}
+
+void ThreadPool::Enqueue(function<void()> task)
+{
+	{
+		lock_guard<mutex> guard(lock);
+		tasks.push_back(task);
+	}
+	available.notify_one();
+}
+
+bool ThreadPool::RunPending()
+{
+	function<void()> task;
+	{
+		lock_guard<mutex> guard(lock);
+		if (tasks.empty())
+		{
+			return false;
+		}
+		task = tasks.front();
+		tasks.pop_front();
+	}
+	RunDetached(task);
+	return true;
+}
+
+unsigned int ThreadPool::Size() const
+{
+	return workers.size();
+}
+
+ThreadPool& ThreadPool::Shared()
+{
+	static ThreadPool shared;
+	return shared;
+}
+
+void ThreadPool::WorkerLoop()
+{
+	while (true)
+	{
+		function<void()> task;
+		{
+			unique_lock<mutex> guard(lock);
+			available.wait(guard, [this]() { return stopping || !tasks.empty(); });
+			if (tasks.empty())
+			{
+				return;
+			}
+			task = tasks.front();
+			tasks.pop_front();
+		}
+		RunDetached(task);
+	}
+}
+
+TaskGroup::TaskGroup(ThreadPool& pool) : pool(pool), pending(0)
+{
+}
+
+TaskGroup::~TaskGroup()
+{
+	Drain();
+}
+
+void TaskGroup::Run(function<void()> task)
+{
+	long long image = Tracer::Image();
+	function<void()> counted = [this, task, image]() {
+		// spans of the task belong to the image of the thread that queued it
+		TraceImage tag(image);
+		exception_ptr thrown;
+		try
+		{
+			task();
+		}
+		catch (...)
+		{
+			thrown = current_exception();
+		}
+		// notify under the lock so Wait cannot miss the last completion
+		lock_guard<mutex> guard(lock);
+		if (thrown && !error)
+		{
+			error = thrown;
+		}
+		if (--pending == 0)
+		{
+			done.notify_all();
+		}
+	};
+	pending++;
+	try
+	{
+		pool.Enqueue(counted);
+	}
+	catch (...)
+	{
+		// never queued, so never to finish
+		lock_guard<mutex> guard(lock);
+		pending--;
+		throw;
+	}
+}
+
+void TaskGroup::Wait()
+{
+	Drain();
+	exception_ptr thrown;
+	{
+		lock_guard<mutex> guard(lock);
+		thrown = error;
+		error = exception_ptr();
+	}
+	if (thrown)
+	{
+		rethrow_exception(thrown);
+	}
+}
+
+void TaskGroup::Drain()
+{
+	while (pending > 0)
+	{
+		if (!pool.RunPending())
+		{
+			unique_lock<mutex> guard(lock);
+			done.wait_for(guard, chrono::milliseconds(1), [this]() { return pending == 0; });
+		}
+	}
+	// the last task may still hold the lock while notifying
+	lock_guard<mutex> guard(lock);
+}
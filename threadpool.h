@@ -0,0 +1,133 @@
+/**
+ * @file threadpool.h
+ * @description fixed-size worker pool and task groups used by the
+ *              parallel QTree passes
+ */
+
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/**
+ * ThreadPool: a fixed set of worker threads draining one FIFO task queue.
+ * An exception thrown by a task reaches the waiter through the future of
+ * Submit or the Wait of a TaskGroup; one escaping a bare Enqueue task is
+ * dropped, so it cannot take down the worker.
+ */
+class ThreadPool {
+public:
+    /**
+     * @param threads number of workers; 0 picks one per hardware thread
+     */
+    ThreadPool(unsigned int threads = 0);
+
+    /**
+     * Finishes the queued tasks, then joins the workers.
+     */
+    ~ThreadPool();
+
+    /**
+     * Queues a task and returns a future for its result.
+     */
+    template <class F>
+    auto Submit(F task) -> future<decltype(task())>
+    {
+        typedef decltype(task()) R;
+        shared_ptr<packaged_task<R()> > job = make_shared<packaged_task<R()> >(task);
+        future<R> result = job->get_future();
+        Enqueue([job]() { (*job)(); });
+        return result;
+    }
+
+    /**
+     * Queues a task with no result.
+     */
+    void Enqueue(function<void()> task);
+
+    /**
+     * Runs one queued task on the calling thread, if there is one.
+     * Lets a thread that waits on other tasks help instead of blocking,
+     * so waiting from inside a task cannot deadlock the pool.
+     *
+     * @return whether a task was run
+     */
+    bool RunPending();
+
+    /**
+     * Number of worker threads.
+     */
+    unsigned int Size() const;
+
+    /**
+     * Process-wide pool with one worker per hardware thread, created on
+     * first use.
+     */
+    static ThreadPool& Shared();
+
+private:
+    vector<thread> workers;
+    deque<function<void()> > tasks;
+    mutex lock;
+    condition_variable available;
+    bool stopping;
+
+    void WorkerLoop();
+
+    ThreadPool(const ThreadPool& other);
+    ThreadPool& operator=(const ThreadPool& other);
+};
+
+/**
+ * TaskGroup: a batch of tasks on a pool that can be waited for together.
+ * Wait() runs queued tasks on the calling thread while it waits.
+ * A task that throws still counts as finished; the first exception thrown
+ * by any task of the group is rethrown by Wait.
+ */
+class TaskGroup {
+public:
+    TaskGroup(ThreadPool& pool);
+
+    /**
+     * Waits for any tasks still outstanding. An exception no Wait has
+     * rethrown is dropped.
+     */
+    ~TaskGroup();
+
+    /**
+     * Queues a task as part of this group.
+     */
+    void Run(function<void()> task);
+
+    /**
+     * Blocks until every task of the group has finished, then rethrows
+     * the first exception a task threw, if any.
+     */
+    void Wait();
+
+private:
+    ThreadPool& pool;
+    atomic<unsigned int> pending;
+    mutex lock;
+    condition_variable done;
+    exception_ptr error; // first exception thrown by a task; guarded by lock
+
+    // Wait without rethrowing.
+    void Drain();
+
+    TaskGroup(const TaskGroup& other);
+    TaskGroup& operator=(const TaskGroup& other);
+};
+
+#endif
@@ -0,0 +1,252 @@
+/**
+ * @file tilecache.cpp
+ * @description deep-zoom tile pyramid generation from a QTree, backed by a
+ *              bounded LRU cache of rendered tiles
+ */
+
+#include <cmath>
+#include "tilecache.h"
+
+bool TileKey::operator==(const TileKey& other) const
+{
+	return tree == other.tree && generation == other.generation && tileSize == other.tileSize && zoom == other.zoom &&
+		   x == other.x && y == other.y;
+}
+
+size_t TileKeyHash::operator()(const TileKey& key) const
+{
+	size_t h = hash<const void*>()(key.tree);
+	h = h * 31 + key.generation;
+	h = h * 31 + key.tileSize;
+	h = h * 31 + key.zoom;
+	h = h * 1000003 + key.x;
+	h = h * 1000003 + key.y;
+	return h;
+}
+
+TileCache::TileCache(size_t capacity)
+{
+	this->capacity = capacity;
+	hits = 0;
+	misses = 0;
+}
+
+shared_ptr<const PNG> TileCache::Get(const TileKey& key)
+{
+	lock_guard<mutex> guard(lock);
+	unordered_map<TileKey, EntryList::iterator, TileKeyHash>::iterator it = index.find(key);
+	if (it == index.end())
+	{
+		misses++;
+		return shared_ptr<const PNG>();
+	}
+	hits++;
+	entries.splice(entries.begin(), entries, it->second);
+	return it->second->second;
+}
+
+void TileCache::Put(const TileKey& key, shared_ptr<const PNG> tile)
+{
+	lock_guard<mutex> guard(lock);
+	if (capacity == 0)
+	{
+		return;
+	}
+	unordered_map<TileKey, EntryList::iterator, TileKeyHash>::iterator it = index.find(key);
+	if (it != index.end())
+	{
+		it->second->second = tile;
+		entries.splice(entries.begin(), entries, it->second);
+		return;
+	}
+	entries.push_front(make_pair(key, tile));
+	index[key] = entries.begin();
+	while (entries.size() > capacity)
+	{
+		index.erase(entries.back().first);
+		entries.pop_back();
+	}
+}
+
+void TileCache::Invalidate(const QTree* tree)
+{
+	lock_guard<mutex> guard(lock);
+	for (EntryList::iterator it = entries.begin(); it != entries.end();)
+	{
+		if (it->first.tree == tree)
+		{
+			index.erase(it->first);
+			it = entries.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+}
+
+size_t TileCache::Size() const
+{
+	lock_guard<mutex> guard(lock);
+	return entries.size();
+}
+
+size_t TileCache::Capacity() const
+{
+	return capacity;
+}
+
+unsigned long long TileCache::Hits() const
+{
+	lock_guard<mutex> guard(lock);
+	return hits;
+}
+
+unsigned long long TileCache::Misses() const
+{
+	lock_guard<mutex> guard(lock);
+	return misses;
+}
+
+TileProducer::TileProducer(const QTree& tree, TileCache& cache, unsigned int tileSize)
+	: tree(tree), cache(cache)
+{
+	this->tileSize = tileSize;
+	// smallest level count at which the larger dimension shrinks to 1
+	unsigned long long larger = max(tree.Width(), tree.Height());
+	maxZoom = 0;
+	while ((1ULL << maxZoom) < larger)
+	{
+		maxZoom++;
+	}
+}
+
+unsigned int TileProducer::MaxZoom() const
+{
+	return maxZoom;
+}
+
+unsigned int TileProducer::LevelWidth(unsigned int zoom) const
+{
+	unsigned int shift = maxZoom - zoom;
+	return (unsigned int)(((unsigned long long)tree.Width() + (1ULL << shift) - 1) >> shift);
+}
+
+unsigned int TileProducer::LevelHeight(unsigned int zoom) const
+{
+	unsigned int shift = maxZoom - zoom;
+	return (unsigned int)(((unsigned long long)tree.Height() + (1ULL << shift) - 1) >> shift);
+}
+
+unsigned int TileProducer::TilesAcross(unsigned int zoom) const
+{
+	return (LevelWidth(zoom) + tileSize - 1) / tileSize;
+}
+
+unsigned int TileProducer::TilesDown(unsigned int zoom) const
+{
+	return (LevelHeight(zoom) + tileSize - 1) / tileSize;
+}
+
+shared_ptr<const PNG> TileProducer::GetTile(unsigned int zoom, unsigned int x, unsigned int y)
+{
+	TileKey key = {&tree, tree.Generation(), tileSize, zoom, x, y};
+	shared_ptr<const PNG> tile = cache.Get(key);
+	if (tile)
+	{
+		return tile;
+	}
+
+	unsigned int w = min(tileSize, LevelWidth(zoom) - x * tileSize);
+	unsigned int h = min(tileSize, LevelHeight(zoom) - y * tileSize);
+	if (zoom == maxZoom)
+	{
+		tile = make_shared<const PNG>(tree.RenderRegion(make_pair(x * tileSize, y * tileSize),
+														make_pair(x * tileSize + w - 1, y * tileSize + h - 1), 1));
+	}
+	else
+	{
+		shared_ptr<const PNG> fine[4];
+		for (unsigned int i = 0; i < 4; i++)
+		{
+			unsigned int fx = 2 * x + i % 2, fy = 2 * y + i / 2;
+			if (fx < TilesAcross(zoom + 1) && fy < TilesDown(zoom + 1))
+			{
+				fine[i] = GetTile(zoom + 1, fx, fy);
+			}
+		}
+		tile = Downsample(fine, w, h);
+	}
+	cache.Put(key, tile);
+	return tile;
+}
+
+void TileProducer::GeneratePyramid(function<void(unsigned int zoom, unsigned int x, unsigned int y, const PNG& tile)> sink)
+{
+	GenerateTile(0, 0, 0, sink);
+}
+
+shared_ptr<const PNG> TileProducer::GenerateTile(unsigned int zoom, unsigned int x, unsigned int y,
+												 const function<void(unsigned int zoom, unsigned int x, unsigned int y, const PNG& tile)>& sink)
+{
+	unsigned int w = min(tileSize, LevelWidth(zoom) - x * tileSize);
+	unsigned int h = min(tileSize, LevelHeight(zoom) - y * tileSize);
+	shared_ptr<const PNG> tile;
+	if (zoom == maxZoom)
+	{
+		tile = make_shared<const PNG>(tree.RenderRegion(make_pair(x * tileSize, y * tileSize),
+														make_pair(x * tileSize + w - 1, y * tileSize + h - 1), 1));
+	}
+	else
+	{
+		// the finer tiles are dropped once this one is filtered from them
+		shared_ptr<const PNG> fine[4];
+		for (unsigned int i = 0; i < 4; i++)
+		{
+			unsigned int fx = 2 * x + i % 2, fy = 2 * y + i / 2;
+			if (fx < TilesAcross(zoom + 1) && fy < TilesDown(zoom + 1))
+			{
+				fine[i] = GenerateTile(zoom + 1, fx, fy, sink);
+			}
+		}
+		tile = Downsample(fine, w, h);
+	}
+	sink(zoom, x, y, *tile);
+	TileKey key = {&tree, tree.Generation(), tileSize, zoom, x, y};
+	cache.Put(key, tile);
+	return tile;
+}
+
+shared_ptr<const PNG> TileProducer::Downsample(const shared_ptr<const PNG> fine[4], unsigned int w, unsigned int h) const
+{
+	shared_ptr<PNG> tile = make_shared<PNG>(w, h);
+	for (unsigned int y = 0; y < h; y++)
+	{
+		RGBAPixel *dst = tile->getPixel(0, y);
+		for (unsigned int x = 0; x < w; x++)
+		{
+			// the 2x2 source block lies in the fine tile covering this
+			// quadrant of the coarse tile
+			unsigned int quadrant = (2 * x >= tileSize ? 1 : 0) + (2 * y >= tileSize ? 2 : 0);
+			const PNG *src = fine[quadrant].get();
+			unsigned int sx = (2 * x) % tileSize, sy = (2 * y) % tileSize;
+			double r = 0, g = 0, b = 0, a = 0;
+			unsigned int count = 0;
+			for (unsigned int dy = 0; dy < 2 && sy + dy < src->height(); dy++)
+			{
+				const RGBAPixel *row = src->getPixel(0, sy + dy);
+				for (unsigned int dx = 0; dx < 2 && sx + dx < src->width(); dx++)
+				{
+					const RGBAPixel &p = row[sx + dx];
+					r += p.r;
+					g += p.g;
+					b += p.b;
+					a += p.a;
+					count++;
+				}
+			}
+			dst[x] = RGBAPixel((int)lround(r / count), (int)lround(g / count), (int)lround(b / count), a / count);
+		}
+	}
+	return tile;
+}
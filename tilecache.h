@@ -0,0 +1,157 @@
+/**
+ * @file tilecache.h
+ * @description deep-zoom tile pyramid generation from a QTree, backed by a
+ *              bounded LRU cache of rendered tiles
+ */
+
+#ifndef _TILECACHE_H_
+#define _TILECACHE_H_
+
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "qtree.h"
+
+/**
+ * Identifies one rendered tile: the tree it came from and that tree's
+ * generation (see QTree::Generation), the tile size, the pyramid level
+ * and the tile's column/row within that level.
+ */
+struct TileKey {
+    const QTree* tree;
+    unsigned long long generation;
+    unsigned int tileSize;
+    unsigned int zoom;
+    unsigned int x;
+    unsigned int y;
+
+    bool operator==(const TileKey& other) const;
+};
+
+struct TileKeyHash {
+    size_t operator()(const TileKey& key) const;
+};
+
+/**
+ * TileCache: a bounded, thread-safe LRU cache of rendered tiles.
+ * Tiles are shared, so a tile handed out stays valid after it is evicted.
+ * A cache may be shared by producers for several trees and tile sizes.
+ * As keys carry the tree's generation, a tree that has changed, or a new
+ * tree at the address of a dead one, never gets stale tiles back; the
+ * stale entries just age out, unless Invalidate drops them sooner.
+ */
+class TileCache {
+public:
+    /**
+     * @param capacity maximum number of tiles kept
+     */
+    TileCache(size_t capacity);
+
+    /**
+     * Looks up a tile, marking it most recently used on a hit.
+     * @return the tile, or null on a miss
+     */
+    shared_ptr<const PNG> Get(const TileKey& key);
+
+    /**
+     * Inserts (or replaces) a tile, evicting the least recently used
+     * tiles beyond capacity.
+     */
+    void Put(const TileKey& key, shared_ptr<const PNG> tile);
+
+    /**
+     * Drops every tile rendered from the given tree, whatever its generation.
+     */
+    void Invalidate(const QTree* tree);
+
+    size_t Size() const;
+    size_t Capacity() const;
+    unsigned long long Hits() const;
+    unsigned long long Misses() const;
+
+private:
+    typedef list<pair<TileKey, shared_ptr<const PNG> > > EntryList;
+
+    size_t capacity;
+    EntryList entries; // most recently used first
+    unordered_map<TileKey, EntryList::iterator, TileKeyHash> index;
+    unsigned long long hits;
+    unsigned long long misses;
+    mutable mutex lock;
+};
+
+/**
+ * TileProducer: cuts the image represented by a QTree into a deep-zoom
+ * pyramid of fixed-size tiles. The tree may change between calls, as
+ * long as its dimensions do not.
+ *
+ * Level MaxZoom() is the image at scale 1 and each lower level halves
+ * both dimensions (rounding up), down to a single pixel at level 0.
+ * Tiles at the top level are rendered straight from the tree with
+ * RenderRegion; every lower tile is a 2x2 box filter of the (cached)
+ * tiles below it, so each level reuses the work of the level above it
+ * instead of going back to the tree.
+ */
+class TileProducer {
+public:
+    /**
+     * @param tree tree to render; must outlive the producer
+     * @param cache cache shared with other producers
+     * @param tileSize width and height of a full tile, in pixels
+     * @pre tileSize is even and nonzero, so 2x2 blocks never straddle tiles
+     */
+    TileProducer(const QTree& tree, TileCache& cache, unsigned int tileSize);
+
+    /**
+     * Index of the full resolution level.
+     */
+    unsigned int MaxZoom() const;
+
+    /**
+     * Dimensions of the image at the given level.
+     */
+    unsigned int LevelWidth(unsigned int zoom) const;
+    unsigned int LevelHeight(unsigned int zoom) const;
+
+    /**
+     * Number of tile columns/rows at the given level.
+     */
+    unsigned int TilesAcross(unsigned int zoom) const;
+    unsigned int TilesDown(unsigned int zoom) const;
+
+    /**
+     * Returns one tile, rendering it (and any missing tiles it is built
+     * from) on a cache miss. Edge tiles are cropped to the image.
+     * @pre zoom <= MaxZoom(), x < TilesAcross(zoom), y < TilesDown(zoom)
+     */
+    shared_ptr<const PNG> GetTile(unsigned int zoom, unsigned int x, unsigned int y);
+
+    /**
+     * Renders the whole pyramid, handing every tile to sink. Each part of
+     * the tree is rendered once, a full resolution tile at a time, and
+     * each lower tile is filtered from the four above it. Tiles are made
+     * depth first, every tile right after the ones it is filtered from,
+     * so only a few tiles per level are held at once, however large the
+     * image. Tiles are also offered to the cache.
+     */
+    void GeneratePyramid(function<void(unsigned int zoom, unsigned int x, unsigned int y, const PNG& tile)> sink);
+
+private:
+    const QTree& tree;
+    TileCache& cache;
+    unsigned int tileSize;
+    unsigned int maxZoom;
+
+    // Makes the tile at (zoom, x, y) and, first, the tiles it is filtered
+    // from, handing each to sink; used by GeneratePyramid.
+    shared_ptr<const PNG> GenerateTile(unsigned int zoom, unsigned int x, unsigned int y,
+                                       const function<void(unsigned int zoom, unsigned int x, unsigned int y, const PNG& tile)>& sink);
+
+    // Halves the 2x2 block of finer tiles (any of which may be null at the
+    // image edge) into one tile of the given dimensions.
+    shared_ptr<const PNG> Downsample(const shared_ptr<const PNG> fine[4], unsigned int w, unsigned int h) const;
+};
+
+#endif
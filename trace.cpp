@@ -0,0 +1,190 @@
+/**
+ * @file trace.cpp
+ * @description optional timeline of the compression pipeline (decode,
+ *              build, prune, render, transforms, encode), written as
+ *              Chrome trace-event JSON
+ */
+
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "trace.h"
+
+atomic<bool> Tracer::enabled(false);
+
+namespace
+{
+	struct Span
+	{
+		const char* name;
+		long long begin; // ns, steady clock
+		long long end;
+		long long image;
+	};
+
+	/**
+	 * Spans of one thread. Only its thread appends; the lock is there
+	 * for Start and WriteJSON, so it is never contended while tracing.
+	 */
+	struct ThreadLog
+	{
+		unsigned int tid;
+		mutex lock;
+		vector<Span> spans;
+	};
+
+	/**
+	 * Logs of every thread that has recorded a span. Logs outlive their
+	 * threads, so spans of finished threads are still written.
+	 */
+	struct Registry
+	{
+		mutex lock;
+		vector<unique_ptr<ThreadLog> > logs;
+		atomic<long long> origin; // time of the last Start
+	};
+
+	Registry& Logs()
+	{
+		static Registry registry;
+		return registry;
+	}
+
+	thread_local ThreadLog* mine = NULL;
+	thread_local long long image = -1;
+
+	ThreadLog& Mine()
+	{
+		if (mine == NULL)
+		{
+			Registry& registry = Logs();
+			lock_guard<mutex> guard(registry.lock);
+			registry.logs.push_back(unique_ptr<ThreadLog>(new ThreadLog()));
+			mine = registry.logs.back().get();
+			mine->tid = registry.logs.size();
+		}
+		return *mine;
+	}
+
+	// Writes s as a JSON string.
+	void Quote(ostream& out, const char* s)
+	{
+		out << '"';
+		for (; *s != '\0'; s++)
+		{
+			if (*s == '"' || *s == '\\')
+			{
+				out << '\\';
+			}
+			out << *s;
+		}
+		out << '"';
+	}
+}
+
+void Tracer::Start()
+{
+	Registry& registry = Logs();
+	lock_guard<mutex> guard(registry.lock);
+	for (size_t i = 0; i < registry.logs.size(); i++)
+	{
+		lock_guard<mutex> logGuard(registry.logs[i]->lock);
+		registry.logs[i]->spans.clear();
+	}
+	registry.origin = Now();
+	enabled = true;
+}
+
+void Tracer::Stop()
+{
+	enabled = false;
+}
+
+bool Tracer::WriteJSON(const string& fileName)
+{
+	ofstream out(fileName.c_str());
+	if (!out)
+	{
+		return false;
+	}
+	out.setf(ios::fixed);
+	out.precision(3);
+
+	Registry& registry = Logs();
+	lock_guard<mutex> guard(registry.lock);
+	long long origin = registry.origin;
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+	bool first = true;
+	for (size_t i = 0; i < registry.logs.size(); i++)
+	{
+		ThreadLog& log = *registry.logs[i];
+		lock_guard<mutex> logGuard(log.lock);
+		if (log.spans.empty())
+		{
+			continue;
+		}
+		out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << log.tid
+			<< ",\"args\":{\"name\":\"thread " << log.tid << "\"}}";
+		first = false;
+		// complete ("X") events, in microseconds from Start
+		for (size_t k = 0; k < log.spans.size(); k++)
+		{
+			const Span& span = log.spans[k];
+			out << ",\n{\"name\":";
+			Quote(out, span.name);
+			out << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << log.tid << ",\"ts\":" << (span.begin - origin) / 1000.0
+				<< ",\"dur\":" << (span.end - span.begin) / 1000.0;
+			if (span.image >= 0)
+			{
+				out << ",\"args\":{\"image\":" << span.image << "}";
+			}
+			out << "}";
+		}
+	}
+	out << "\n]}\n";
+	out.close();
+	return !out.fail();
+}
+
+size_t Tracer::Spans()
+{
+	Registry& registry = Logs();
+	lock_guard<mutex> guard(registry.lock);
+	size_t count = 0;
+	for (size_t i = 0; i < registry.logs.size(); i++)
+	{
+		lock_guard<mutex> logGuard(registry.logs[i]->lock);
+		count += registry.logs[i]->spans.size();
+	}
+	return count;
+}
+
+long long Tracer::Image()
+{
+	return image;
+}
+
+void Tracer::SetImage(long long id)
+{
+	image = id;
+}
+
+long long Tracer::Now()
+{
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Tracer::Record(const char* name, long long begin, long long end)
+{
+	// spans begun before the last Start belong to a discarded trace
+	if (begin < Logs().origin)
+	{
+		return;
+	}
+	ThreadLog& log = Mine();
+	Span span = {name, begin, end, image};
+	lock_guard<mutex> guard(log.lock);
+	log.spans.push_back(span);
+}
@@ -0,0 +1,149 @@
+/**
+ * @file trace.h
+ * @description optional timeline of the compression pipeline (decode,
+ *              build, prune, render, transforms, encode), written as
+ *              Chrome trace-event JSON
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <atomic>
+#include <string>
+
+using namespace std;
+
+/**
+ * Tracer: records timed spans, tagged with the thread and the image they
+ * belong to, between Start and Stop. WriteJSON produces a file that loads
+ * in about:tracing or Perfetto, where nested spans show as a flame chart
+ * per thread.
+ *
+ * While tracing is off a span costs one relaxed atomic load. While it is
+ * on, each thread appends to a log of its own, so threads do not contend.
+ */
+class Tracer {
+public:
+    /**
+     * Discards any recorded spans and starts recording.
+     */
+    static void Start();
+
+    /**
+     * Stops recording; the spans recorded so far are kept for WriteJSON.
+     */
+    static void Stop();
+
+    /**
+     * Whether spans are being recorded.
+     */
+    static bool Enabled()
+    {
+        return enabled.load(memory_order_relaxed);
+    }
+
+    /**
+     * Writes the recorded spans as Chrome trace-event JSON, timed from
+     * the last Start. Spans still open are left out.
+     *
+     * @return false if the file could not be written
+     */
+    static bool WriteJSON(const string& fileName);
+
+    /**
+     * Spans recorded since the last Start, across all threads.
+     */
+    static size_t Spans();
+
+    /**
+     * Image ID the calling thread's spans are tagged with; -1 for none.
+     * Tasks run through a TaskGroup carry the ID of the thread that
+     * queued them.
+     */
+    static long long Image();
+    static void SetImage(long long id);
+
+    /**
+     * Steady-clock time in nanoseconds.
+     */
+    static long long Now();
+
+    /**
+     * Appends a finished span to the calling thread's log.
+     * @param name a string that outlives the trace, usually a literal
+     */
+    static void Record(const char* name, long long begin, long long end);
+
+private:
+    static atomic<bool> enabled;
+};
+
+/**
+ * TraceScope: a span from construction to destruction, recorded only if
+ * tracing was on when it began.
+ */
+class TraceScope {
+public:
+    /**
+     * @param name a string that outlives the trace, usually a literal
+     * @param active whether to record this span at all, so that spans
+     *               around frequently called code can be thinned out
+     */
+    TraceScope(const char* name, bool active = true)
+        : name(name), begin(active && Tracer::Enabled() ? Tracer::Now() : -1)
+    {
+    }
+
+    ~TraceScope()
+    {
+        if (begin >= 0)
+        {
+            Tracer::Record(name, begin, Tracer::Now());
+        }
+    }
+
+private:
+    const char* name;
+    long long begin; // -1 when not recorded
+
+    TraceScope(const TraceScope& other);
+    TraceScope& operator=(const TraceScope& other);
+};
+
+/**
+ * TraceImage: tags the calling thread's spans with an image ID until
+ * destruction, when the previous ID is restored.
+ */
+class TraceImage {
+public:
+    TraceImage(long long id) : previous(Tracer::Image())
+    {
+        Tracer::SetImage(id);
+    }
+
+    ~TraceImage()
+    {
+        Tracer::SetImage(previous);
+    }
+
+private:
+    long long previous;
+
+    TraceImage(const TraceImage& other);
+    TraceImage& operator=(const TraceImage& other);
+};
+
+#define TRACE_JOIN2(a, b) a##b
+#define TRACE_JOIN(a, b) TRACE_JOIN2(a, b)
+
+/**
+ * Traces the rest of the enclosing block as a span called name.
+ */
+#define TRACE_SCOPE(name) ::TraceScope TRACE_JOIN(traceScope, __LINE__)(name)
+
+/**
+ * Like TRACE_SCOPE, but only when active is true.
+ */
+#define TRACE_SCOPE_IF(name, active) ::TraceScope TRACE_JOIN(traceScope, __LINE__)(name, active)
+
+#endif
@@ -0,0 +1,147 @@
+/**
+ * @file treecache.cpp
+ * @description content-addressed, byte-bounded LRU cache of built and
+ *              pruned QTrees
+ */
+
+#include "treecache.h"
+
+bool TreeKey::operator==(const TreeKey& other) const
+{
+	return imageHash == other.imageHash && width == other.width && height == other.height &&
+		   tolerance == other.tolerance && transforms == other.transforms;
+}
+
+size_t TreeKeyHash::operator()(const TreeKey& key) const
+{
+	// the image hash is already well mixed
+	size_t h = (size_t)key.imageHash;
+	h = h * 31 + key.width;
+	h = h * 31 + key.height;
+	h = h * 31 + hash<double>()(key.tolerance);
+	h = h * 31 + hash<string>()(key.transforms);
+	return h;
+}
+
+TreeCache::TreeCache(size_t capacity)
+{
+	this->capacity = capacity;
+	bytes = 0;
+	hits = 0;
+	misses = 0;
+}
+
+shared_ptr<const QTree> TreeCache::Get(const TreeKey& key)
+{
+	lock_guard<mutex> guard(lock);
+	unordered_map<TreeKey, EntryList::iterator, TreeKeyHash>::iterator it = index.find(key);
+	if (it == index.end())
+	{
+		misses++;
+		return shared_ptr<const QTree>();
+	}
+	hits++;
+	entries.splice(entries.begin(), entries, it->second);
+	return it->second->tree;
+}
+
+void TreeCache::Put(const TreeKey& key, shared_ptr<const QTree> tree)
+{
+	size_t size = Footprint(*tree);
+
+	lock_guard<mutex> guard(lock);
+	unordered_map<TreeKey, EntryList::iterator, TreeKeyHash>::iterator it = index.find(key);
+	if (it != index.end())
+	{
+		Remove(it->second);
+	}
+	if (size > capacity)
+	{
+		return;
+	}
+	Entry entry = {key, tree, size};
+	entries.push_front(entry);
+	index[key] = entries.begin();
+	bytes += size;
+	while (bytes > capacity)
+	{
+		Remove(--entries.end());
+	}
+}
+
+shared_ptr<const QTree> TreeCache::Load(const PNG& img, double tolerance, const string& transforms)
+{
+	TreeKey key = {img.contentHash(), img.width(), img.height(), tolerance, transforms};
+	shared_ptr<const QTree> cached = Get(key);
+	if (cached)
+	{
+		return cached;
+	}
+
+	// built outside the lock; concurrent misses on one key may each build
+	// the tree, and the last Put wins
+	shared_ptr<QTree> tree = make_shared<QTree>(img);
+	tree->Prune(tolerance);
+	for (size_t i = 0; i < transforms.size(); i++)
+	{
+		if (transforms[i] == 'F')
+		{
+			tree->FlipHorizontal();
+		}
+		else
+		{
+			tree->RotateCCW();
+		}
+	}
+	Put(key, tree);
+	return tree;
+}
+
+size_t TreeCache::Footprint(const QTree& tree)
+{
+	// distinct nodes with their blocks and gradients (see NodeBytes)
+	return sizeof(QTree) + tree.SpillingStats().residentBytes + tree.Palette().size() * sizeof(RGBAPixel);
+}
+
+size_t TreeCache::Size() const
+{
+	lock_guard<mutex> guard(lock);
+	return entries.size();
+}
+
+size_t TreeCache::Bytes() const
+{
+	lock_guard<mutex> guard(lock);
+	return bytes;
+}
+
+size_t TreeCache::Capacity() const
+{
+	return capacity;
+}
+
+unsigned long long TreeCache::Hits() const
+{
+	lock_guard<mutex> guard(lock);
+	return hits;
+}
+
+unsigned long long TreeCache::Misses() const
+{
+	lock_guard<mutex> guard(lock);
+	return misses;
+}
+
+double TreeCache::HitRate() const
+{
+	lock_guard<mutex> guard(lock);
+	unsigned long long lookups = hits + misses;
+	return lookups == 0 ? 0.0 : (double)hits / lookups;
+}
+
+void TreeCache::Remove(EntryList::iterator entry)
+{
+	bytes -= entry->bytes;
+	index.erase(entry->key);
+	entries.erase(entry);
+}
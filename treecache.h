@@ -0,0 +1,110 @@
+/**
+ * @file treecache.h
+ * @description content-addressed, byte-bounded LRU cache of built and
+ *              pruned QTrees
+ */
+
+#ifndef _TREECACHE_H_
+#define _TREECACHE_H_
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "qtree.h"
+
+/**
+ * Identifies a tree by what it was made from: the image contents (see
+ * PNG::contentHash) and dimensions, the Prune tolerance, and the
+ * transforms applied afterwards, in order ('F' for FlipHorizontal,
+ * 'R' for RotateCCW).
+ */
+struct TreeKey {
+    uint64_t imageHash;
+    unsigned int width;
+    unsigned int height;
+    double tolerance;
+    string transforms;
+
+    bool operator==(const TreeKey& other) const;
+};
+
+struct TreeKeyHash {
+    size_t operator()(const TreeKey& key) const;
+};
+
+/**
+ * TreeCache: a thread-safe LRU cache of trees, bounded by the memory
+ * their nodes occupy. Trees are shared and immutable; a tree handed out
+ * stays valid after it is evicted, and callers that need to modify one
+ * copy it first.
+ */
+class TreeCache {
+public:
+    /**
+     * @param capacity maximum number of bytes of cached trees
+     */
+    TreeCache(size_t capacity);
+
+    /**
+     * Looks up a tree, marking it most recently used on a hit.
+     * @return the tree, or null on a miss
+     */
+    shared_ptr<const QTree> Get(const TreeKey& key);
+
+    /**
+     * Inserts (or replaces) a tree, evicting the least recently used
+     * trees until the total fits. A tree larger than the whole capacity
+     * is not kept.
+     */
+    void Put(const TreeKey& key, shared_ptr<const QTree> tree);
+
+    /**
+     * Returns the tree for img pruned at tolerance and then transformed,
+     * building it and caching it on a miss.
+     *
+     * @param transforms operations applied after Prune, in order
+     * @pre transforms contains only 'F' and 'R'
+     */
+    shared_ptr<const QTree> Load(const PNG& img, double tolerance, const string& transforms);
+
+    /**
+     * Approximate memory held by a tree: its distinct nodes with the
+     * pixels of block leaves and the planes of gradient leaves, plus its
+     * palette. This is what counts against the capacity.
+     */
+    static size_t Footprint(const QTree& tree);
+
+    size_t Size() const;
+    size_t Bytes() const;
+    size_t Capacity() const;
+    unsigned long long Hits() const;
+    unsigned long long Misses() const;
+
+    /**
+     * Hits / (hits + misses), or 0 before the first lookup.
+     */
+    double HitRate() const;
+
+private:
+    struct Entry {
+        TreeKey key;
+        shared_ptr<const QTree> tree;
+        size_t bytes;
+    };
+    typedef list<Entry> EntryList;
+
+    size_t capacity;
+    size_t bytes;      // sum of the entries' footprints
+    EntryList entries; // most recently used first
+    unordered_map<TreeKey, EntryList::iterator, TreeKeyHash> index;
+    unsigned long long hits;
+    unsigned long long misses;
+    mutable mutex lock;
+
+    void Remove(EntryList::iterator entry);
+};
+
+#endif